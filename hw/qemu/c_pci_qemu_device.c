@@ -3,11 +3,32 @@
 #include "hw/pci/pci.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
 #include "qemu/timer.h"
 #include "qom/object.h"
 #include "qemu/main-loop.h"
+#include "qemu/lockable.h"
+#include "sysemu/iothread.h"
+#include "sysemu/hostmem.h"
 #include "qemu/module.h"
+#include "qemu/log.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/crc32c.h"
+#include "qemu/range.h"
+#include "crypto/hash.h"
 #include "qapi/visitor.h"
+#include "qapi/error.h"
+#include "hw/qdev-properties.h"
+#include "trace.h"
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define TYPE_PCI_CUSTOM_DEVICE  "c_pci_dev"
 #define DEVICE_ID               0xABCD;
@@ -17,268 +38,3751 @@
 #define REG_OPCODE              0x18
 #define REG_RESULT              0x20
 #define REG_ERROR               0x24
+#define REG_DMA_CHANNELS        0x28
+#define REG_BATCH_STATUS        0x2C
+#define REG_QUEUES              0x30
+#define REG_BATCH_OP1           0x40
+#define REG_BATCH_OP2           0x48
+#define REG_BATCH_RES           0x50
+#define REG_BATCH_COUNT         0x58
+#define REG_BATCH_OPCODE        0x5C
+#define REG_IRQ_STATUS          0x60
+#define REG_IRQ_MASK            0x64
+#define REG_IRQ_COAL_COUNT      0x68
+#define REG_IRQ_COAL_USEC       0x6C
+#define REG_WB_BASE             0x70
+#define REG_TIMESTAMP           0x78
+#define REG_TAG_OPS             0x80
+#define REG_TAG_CMD             0x88
+#define REG_TAG_DONE            0x8C
+#define REG_TAG_ERROR           0x90
+#define REG_TAG_RESULT          0x200
 #define OPCODE_ADD              0x00
 #define OPCODE_MUL              0x01
 #define OPCODE_DIV              0x02
 #define OPCODE_SUB              0x03
+#define OPCODE_NR               4
 
-#define BIG_BAR_SIZE            4096
+/**
+ * our ERROR register, bits are latched until written back as 1:
+ * Bit 0 is compute error: unknown opcode or division by zero.
+ * Bit 1 is DMA error: a DMA request on any channel failed.
+ */
+#define ERR_COMPUTE             (1 << 0)
+#define ERR_DMA                 (1 << 1)
+
+/**
+ * our TIMESTAMP register, 64 bit, read only: free running nanosecond counter
+ * of the virtual clock. It stops with the VM. Descriptor timestamps use the
+ * same clock, so the driver can compare them with its own reads of it.
+ */
+#define TIMESTAMP_CLOCK         QEMU_CLOCK_VIRTUAL
+
+/**
+ * Tagged operations of the arithmetic unit:
+ * The unit has a queue of TAG_NR operations, each one named by a tag. The
+ * guest writes both operands to REG_TAG_OPS (64 bit, op1 in the low half,
+ * op2 in the high half), then the tag and the opcode to REG_TAG_CMD, that is
+ * the doorbell. The write returns at once, the operation runs later, so the
+ * guest pushes several back to back while the unit works.
+ *
+ * our TAG_CMD register: bits 4..0 are the tag, bits 15..8 the opcode. A tag
+ * stays busy from its push until its operation ran, pushing a busy tag is an
+ * error (ERR_COMPUTE) and the operation is dropped.
+ *
+ * our TAG_DONE register: bit N is set when tag N has its result in
+ * REG_TAG_RESULT + 4 * N, write 1 to clear. Pushing tag N clears it too.
+ * our TAG_ERROR register: bit N is set when the operation of tag N failed
+ * (unknown opcode, division by zero), its result is 0. Write 1 to clear.
+ *
+ * Each time the queue drains, the compute vector is signalled once, the
+ * status write-back carries TAG_DONE, TAG_ERROR and the results.
+ */
+#define TAG_NR                  32
+#define TAG_CMD_TAG_MASK        (TAG_NR - 1)
+#define TAG_CMD_OPCODE_SHIFT    8
+
+typedef struct c_pci_tag_op {
+    uint32_t _op1;
+    uint32_t _op2;
+    uint8_t _opcode;
+    uint8_t _tag;
+} c_pci_tag_op;
+
+/**
+ * Batch mode of the arithmetic unit:
+ * The guest places two arrays of REG_BATCH_COUNT little endian uint32_t
+ * operands in its memory, writes their addresses to REG_BATCH_OP1 and
+ * REG_BATCH_OP2, the address of the result array to REG_BATCH_RES, then writes
+ * the opcode to REG_BATCH_OPCODE, that is the doorbell. The device fetches the
+ * operands by DMA, computes the whole array with host vector instructions,
+ * writes the results back and signals the compute vector once.
+ *
+ * Address registers are 64 bit, they take one 8 byte access or two 4 byte
+ * accesses (low half first).
+ *
+ * our BATCH_STATUS register:
+ * Bit 0 is busy.
+ * Bit 1 is done, write 1 to clear.
+ * Bit 2 is error, unknown opcode or DMA failure, write 1 to clear.
+ * Bit 3 is division by zero, at least one lane divided by zero and got 0 as
+ *      result, write 1 to clear.
+ */
+#define BATCH_STS_BUSY          (1 << 0)
+#define BATCH_STS_DONE          (1 << 1)
+#define BATCH_STS_ERROR         (1 << 2)
+#define BATCH_STS_DIV_ZERO      (1 << 3)
+
+/* Lanes fetched, computed and written back per step. */
+#define BATCH_CHUNK             4096
+
+/**
+ * Queue pairs:
+ * Every queue pair is a submission queue (SQ) of `c_pci_sqe` and a completion
+ * queue (CQ) of `c_pci_cqe` in guest memory, both of QP_REG_SIZE entries. A
+ * queue pair owns a QP_STRIDE bytes register window in BAR0 (queue N starts at
+ * REG_QP_BASE + N * QP_STRIDE), REG_QUEUES tells how many there are.
+ *
+ * The driver fills SQ entries and writes the index of the next free slot to
+ * QP_REG_SQ_TAIL, that is the doorbell. The device executes entries in order,
+ * posts a completion for each one and signals the compute vector once per
+ * run. Completions carry a phase bit, 1 on the first pass over the CQ and
+ * flipped on every wrap, new entries are the ones whose phase matches the
+ * current pass. The driver writes the CQ index it consumed up to into
+ * QP_REG_CQ_HEAD, the device never overwrites unconsumed completions.
+ *
+ * Writing a base address or the size resets the queue pair.
+ *
+ * Entries can also be pushed through the submission BAR instead of guest
+ * memory, see C_PCI_PUSH_BAR.
+ */
+#define REG_QP_BASE             0x100
+#define QP_STRIDE               0x20
+#define QP_MAX                  4
+#define QP_DEFAULT              2
+#define QP_MAX_ENTRIES          4096
+
+#define QP_REG_SQ_BASE          0x00
+#define QP_REG_CQ_BASE          0x08
+#define QP_REG_SIZE             0x10
+#define QP_REG_SQ_TAIL          0x14
+#define QP_REG_SQ_HEAD          0x18
+#define QP_REG_CQ_HEAD          0x1C
+
+/**
+ * SQE flags:
+ * Bit 0 is vector, the entry is a batch: `len` lanes from arrays at `src`
+ *      (op1) and `aux` (op2), results to `dst`. Without it the entry computes
+ *      `op1` <opcode> `op2`.
+ */
+#define SQE_F_VECTOR            (1 << 0)
+#define SQE_F_SGL               (1 << 1)
+#define SQE_F_DEVMEM            (1 << 2)
+
+/**
+ * Engine opcodes, only on the queue pairs:
+ * OPCODE_SHA256: SHA-256 digest of `len` bytes at `src`, or with SQE_F_SGL of
+ *      the `len` entries of the `c_pci_sg` gather list at `src`. The 32 byte
+ *      digest is written to `dst`, the CQE result is the number of bytes
+ *      hashed.
+ * OPCODE_PROG_LOAD: verify the `len` instructions (`c_pci_insn`) at `src` and
+ *      store them as program `op1`. A program which does not verify fails
+ *      with CQE_STS_INVALID_FIELD, the slot keeps its previous program.
+ * OPCODE_PROG_RUN: stream the `len` little endian uint32_t elements at `src`
+ *      through program `op1`. Emitted elements are packed at `dst`, at most
+ *      `len` of them, the CQE result is their number. The 64 bit little
+ *      endian accumulator of the reduction is at `aux`, it starts from the
+ *      identity of the reduction, or from the value at `aux` with
+ *      PROG_RUN_F_CONTINUE in `op2`, so a stream can be split in several
+ *      runs.
+ * OPCODE_SEARCH: find the patterns of the `c_pci_pattern` table at `aux` in
+ *      the `len` bytes at `src`, or with SQE_F_DEVMEM at offset `src` of
+ *      device memory. Bits 15..0 of `op1` are the number of patterns, bits
+ *      31..16 the number of bytes after `len` which may be read, so a match
+ *      starting before `len` can end past it and a stream can be split in
+ *      several searches. The first `op2` matches (`c_pci_match`) are written
+ *      to `dst`, in order of offset then pattern. The CQE result is the
+ *      number of matches, which may be more than `op2`.
+ */
+#define OPCODE_SHA256           0x10
+#define OPCODE_PROG_LOAD        0x11
+#define OPCODE_PROG_RUN         0x12
+#define OPCODE_SEARCH           0x13
+
+#define HASH_MAX_SEGMENTS       1024
+#define HASH_MAX_BYTES          (64 * MiB)
+
+typedef struct QEMU_PACKED c_pci_sg {
+    uint64_t _addr;
+    uint32_t _len;
+    uint32_t _reserved;
+} c_pci_sg;
+
+/**
+ * Programs of the filter/map/reduce engine:
+ * A program is a straight list of instructions applied to every element `x`
+ * of the input in turn, there are no jumps so every program terminates after
+ * `len` instructions per element. Each instruction is an opcode and a 32 bit
+ * immediate `imm`, all arithmetic is unsigned 32 bit and wraps.
+ *
+ * PROG_MAP_*: `x = x <op> imm`, MIN and MAX keep the smaller or larger one.
+ * PROG_FILTER_*: drop the element unless `x <cmp> imm`, or for ANY unless
+ *      `x & imm` is not 0. Later instructions do not see dropped elements.
+ * PROG_EMIT: append `x` to the output.
+ * PROG_REDUCE_*: fold `x` into the accumulator, a 64 bit sum, the minimum,
+ *      the maximum or the number of elements.
+ *
+ * The verifier accepts 1 to PROG_MAX_INSNS known instructions with zero
+ * reserved bytes and shifts below 32, at most one EMIT and at most one
+ * reduction, which must be the last instruction. A program has an EMIT or a
+ * reduction, otherwise it has no effect.
+ */
+#define PROG_SLOTS              8
+#define PROG_MAX_INSNS          64
+
+#define PROG_MAP_ADD            0x01
+#define PROG_MAP_SUB            0x02
+#define PROG_MAP_MUL            0x03
+#define PROG_MAP_AND            0x04
+#define PROG_MAP_OR             0x05
+#define PROG_MAP_XOR            0x06
+#define PROG_MAP_SHL            0x07
+#define PROG_MAP_SHR            0x08
+#define PROG_MAP_MIN            0x09
+#define PROG_MAP_MAX            0x0A
+#define PROG_FILTER_EQ          0x10
+#define PROG_FILTER_NE          0x11
+#define PROG_FILTER_LT          0x12
+#define PROG_FILTER_LE          0x13
+#define PROG_FILTER_GT          0x14
+#define PROG_FILTER_GE          0x15
+#define PROG_FILTER_ANY         0x16
+#define PROG_EMIT               0x20
+#define PROG_REDUCE_SUM         0x30
+#define PROG_REDUCE_MIN         0x31
+#define PROG_REDUCE_MAX         0x32
+#define PROG_REDUCE_COUNT       0x33
+
+#define PROG_RUN_F_CONTINUE     (1 << 0)
+
+typedef struct QEMU_PACKED c_pci_insn {
+    uint8_t _op;
+    uint8_t _reserved[3];
+    uint32_t _imm;
+} c_pci_insn;
+
+QEMU_BUILD_BUG_ON(sizeof(c_pci_insn) != 8);
+
+#define SEARCH_MAX_PATTERNS     16
+#define SEARCH_MAX_PATTERN_LEN  56
+/* Bytes scanned per step, guest buffers are fetched a step at a time. */
+#define SEARCH_CHUNK            (64 * KiB)
+/* Matches written back at once. */
+#define SEARCH_MATCH_BATCH      256
+
+typedef struct QEMU_PACKED c_pci_pattern {
+    uint8_t _len;
+    uint8_t _reserved[7];
+    uint8_t _bytes[SEARCH_MAX_PATTERN_LEN];
+} c_pci_pattern;
+
+typedef struct QEMU_PACKED c_pci_match {
+    uint32_t _offset;
+    uint32_t _pattern;
+} c_pci_match;
+
+QEMU_BUILD_BUG_ON(sizeof(c_pci_pattern) != 64);
+QEMU_BUILD_BUG_ON(sizeof(c_pci_match) != 8);
+
+/* A verified program, host endian. `_len` is 0 for an empty slot. */
+typedef struct c_pci_prog {
+    uint32_t _len;
+    uint8_t _op[PROG_MAX_INSNS];
+    uint32_t _imm[PROG_MAX_INSNS];
+} c_pci_prog;
+
+/**
+ * CQE status: bit 0 is the phase bit, bits 15..1 are the status code.
+ */
+#define CQE_STS_SUCCESS         0
+#define CQE_STS_INVALID_OPCODE  1
+#define CQE_STS_DIV_ZERO        2
+#define CQE_STS_DMA_ERROR       3
+#define CQE_STS_INVALID_FIELD   4
+
+#define CQE_STATUS(code, phase) (((code) << 1) | (phase))
+
+typedef struct QEMU_PACKED c_pci_sqe {
+    uint8_t _opcode;
+    uint8_t _flags;
+    uint16_t _cid;
+    uint32_t _op1;
+    uint32_t _op2;
+    uint32_t _len;
+    uint64_t _src;
+    uint64_t _dst;
+    uint64_t _aux;
+    uint8_t _reserved[24];
+} c_pci_sqe;
+
+typedef struct QEMU_PACKED c_pci_cqe {
+    uint32_t _result;
+    uint32_t _reserved;
+    uint16_t _sq_head;
+    uint16_t _reserved2;
+    uint16_t _cid;
+    uint16_t _status;
+} c_pci_cqe;
+
+QEMU_BUILD_BUG_ON(sizeof(c_pci_sqe) != 64);
+QEMU_BUILD_BUG_ON(sizeof(c_pci_cqe) != 16);
+
+/**
+ * Submission BAR:
+ * Every queue pair owns a QP_PUSH_STRIDE bytes window, slot N of the window
+ * is SQ entry N. It is a prefetchable BAR, the driver maps it write combined
+ * and writes a whole entry in one burst, no SQ in guest memory and no
+ * doorbell: an entry is complete once all its bytes arrived, and SQ tail
+ * moves over the complete entries at the tail. Bursts may be split or
+ * reordered on the way, entries and their bytes can arrive in any order.
+ * Reads return 0.
+ */
+#define QP_PUSH_STRIDE          (QP_MAX_ENTRIES * sizeof(c_pci_sqe))
+#define QP_PUSH_SIZE            (QP_MAX * QP_PUSH_STRIDE)
+
+/* One bit per 4 bytes of a pushed entry. */
+#define QP_PUSH_FULL            0xFFFF
+
+/**
+ * MSI-X vector layout, the table lives in its own BAR:
+ * Vector 0 is compute done.
+ * Vector 1 is error, details in REG_ERROR.
+ * Vector 2.. are DMA done, one per channel.
+ * The `vectors` property sets the table size, by default one vector per
+ * event.
+ */
+#define C_PCI_MSIX_BAR          4
+#define C_PCI_VEC_COMPUTE       0
+#define C_PCI_VEC_ERROR         1
+#define C_PCI_VEC_DMA_BASE      2
+#define C_PCI_MAX_VECTORS       (C_PCI_VEC_DMA_BASE + DMA_MAX_CHANNELS)
+
+/**
+ * Interrupt sources, one bit each in REG_IRQ_STATUS and REG_IRQ_MASK:
+ * Bit 0 is compute done, bit 1 is error, bit 2 + N is DMA channel N done.
+ *
+ * REG_IRQ_STATUS: sources with events since the last acknowledge, write 1 to
+ *      clear. Acknowledging a DMA channel through its STATUS register clears
+ *      its bit too.
+ * REG_IRQ_MASK: masked sources keep their events but are not signalled, they
+ *      are signalled when unmasked.
+ * REG_IRQ_COAL_COUNT, REG_IRQ_COAL_USEC: interrupt moderation. A completion
+ *      source is signalled once it has REG_IRQ_COAL_COUNT events or its
+ *      oldest event waited REG_IRQ_COAL_USEC microseconds, whichever comes
+ *      first. A count below 2 or a time of 0 signals every event. Errors are
+ *      always signalled at once.
+ */
+#define IRQ_SRC_COMPUTE         C_PCI_VEC_COMPUTE
+#define IRQ_SRC_ERROR           C_PCI_VEC_ERROR
+#define IRQ_SRC_DMA_BASE        C_PCI_VEC_DMA_BASE
+#define IRQ_SRC_NR              C_PCI_MAX_VECTORS
+
+#define IRQ_COAL_MAX_USEC       (1000 * 1000)
+
+/**
+ * BAR layout:
+ * BAR0 is registers of the arithmetic unit.
+ * BAR1 is device memory, plain RAM mapped as a 64 bit prefetchable BAR (it
+ *      also takes the BAR2 slot), guest accesses never trap. Its size is the
+ *      `bar1-size` property, a power of 2 between 4 KiB and 1 GiB. With the
+ *      `memdev` property it is the RAM of that memory backend instead, of
+ *      the size of the backend, which a host process can map too.
+ * BAR3 is DMA controller registers.
+ * BAR4 is MSI-X table and PBA.
+ * BAR5 is the submission BAR of the queue pairs, prefetchable.
+ */
+#define C_PCI_MMIO_BAR          0
+#define C_PCI_MEM_BAR           1
+#define C_PCI_DMA_BAR           3
+#define C_PCI_PUSH_BAR          5
+
+#define C_PCI_MMIO_SIZE         (4 * KiB)
+
+#define BIG_BAR_SIZE            (4 * KiB)
+#define BIG_BAR_MAX_SIZE        (1 * GiB)
+
+/**
+ * The DMA controller has several independent channels. Every channel owns a
+ * DMA_CHAN_STRIDE bytes register window in BAR3 (channel N starts at offset
+ * N * DMA_CHAN_STRIDE), its own request state and its own interrupt vector.
+ * The registers below are offsets inside a channel window.
+ */
+#define DMA_MAX_CHANNELS        8
+#define DMA_CHAN_STRIDE         0x80
+#define DMA_DEFAULT_CHANNELS    4
 
 #define DMA_REG_CMD             0x00
 #define DMA_REG_SRC             0x04
 #define DMA_REG_DST             0x08
 #define DMA_REG_LEN             0x0C
+#define DMA_REG_RING_BASE       0x10
+#define DMA_REG_RING_SIZE       0x14
+#define DMA_REG_RING_HEAD       0x18
+#define DMA_REG_RING_TAIL       0x1C
+#define DMA_REG_STATUS          0x20
+#define DMA_REG_COMPLETED       0x24
+#define DMA_REG_CSUM            0x28
+#define DMA_REG_SRC64           0x30
+#define DMA_REG_DST64           0x38
+#define DMA_REG_LEN64           0x40
+#define DMA_REG_RING_BASE64     0x48
+
+/**
+ * SRC, DST, LEN and RING_BASE are the low halves of the 64 bit SRC64, DST64,
+ * LEN64 and RING_BASE64, writing one of them clears the high half. The 64 bit
+ * registers take one 8 byte access or two 4 byte accesses (low half first),
+ * like the 64 bit registers of BAR0.
+ */
 
 /**
  * our CMD register:
  * Bit 0 is run DMA or not.
  * Bit 1 are DMA direction: to device or from device.
+ * Bits 5..4 are checksum: none, CRC32C or CRC32 (IEEE, zlib) over the
+ *      transferred bytes, computed during the copy. The result is latched in
+ *      the CSUM register.
+ * Bits 10..8 are operation:
+ *      DMA_OP_XFER moves between guest memory and device memory, bit 1 tells
+ *      which way.
+ *      DMA_OP_COPY copies guest memory `src` to guest memory `dst`, the ranges
+ *      must not overlap.
+ *      DMA_OP_DEV_COPY copies device memory `src` to device memory `dst`, the
+ *      ranges may overlap.
+ *      DMA_OP_FILL fills guest memory `dst` with the 8 byte little endian
+ *      pattern in `src`, a zero fill is a fill with pattern 0.
+ *      DMA_OP_DEV_FILL is the same for device memory `dst`.
+ *      DMA_OP_COMPRESS compresses guest memory `src` into an LZ4 block at
+ *      guest memory `dst`, DMA_OP_DECOMPRESS does the reverse. Both take a
+ *      descriptor, it holds the room at `dst` and gets the output length.
+ *      Device memory takes part through its bus address, data staged in BAR1
+ *      is compressed in place of the guest.
+ *      For all of them the checksum covers the bytes written to `dst`.
+ *      The SRC register is 32 bit, patterns wider than that take a
+ *      descriptor.
  */
 #define DMA_CMD_RUN                 1
 #define DMA_DIRECTION_TO_DEVICE     0
 #define DMA_DIRECTION_FROM_DEVICE   1
 
-#define DMA_GET_DIR(cmd) ((cmd & 0b10) >> 1)
+#define DMA_GET_DIR(cmd) ((cmd & 0b10) >> 1)
+
+#define DMA_CSUM_NONE               0
+#define DMA_CSUM_CRC32C             1
+#define DMA_CSUM_CRC32              2
+
+#define DMA_GET_CSUM(cmd) ((cmd >> 4) & 0b11)
+
+#define DMA_OP_XFER                 0
+#define DMA_OP_COPY                 1
+#define DMA_OP_DEV_COPY             2
+#define DMA_OP_FILL                 3
+#define DMA_OP_DEV_FILL             4
+#define DMA_OP_COMPRESS             5
+#define DMA_OP_DECOMPRESS           6
+
+#define DMA_GET_OP(cmd) ((cmd >> 8) & 0b111)
+
+/* Guest to guest copies and fills go through a per channel buffer when the
+ * guest range is not plain RAM, one chunk at a time. */
+#define DMA_COPY_CHUNK              (64 * KiB)
+
+/* Largest input and output of one compress or decompress, LZ4 works on whole
+ * blocks held in host memory. */
+#define DMA_LZ4_MAX_LEN             (4 * MiB)
+
+/* The checksum runs on every chunk right after its copy, while the chunk is
+ * still in the CPU cache. */
+#define DMA_CSUM_CHUNK              (16 * KiB)
+
+/**
+ * our STATUS register:
+ * Bit 0 is busy, a doorbell was received and the transfer is not finished yet.
+ * Bit 1 is done, set when the transfer finished. Write 1 to clear.
+ * Bit 2 is error, set when the transfer failed. Write 1 to clear.
+ *
+ * The COMPLETED register counts finished requests (one per CMD doorbell and
+ * one per descriptor chain), the device raises an interrupt for every batch of
+ * completions.
+ */
+#define DMA_STS_BUSY                (1 << 0)
+#define DMA_STS_DONE                (1 << 1)
+#define DMA_STS_ERROR               (1 << 2)
+
+/**
+ * Descriptor ring mode:
+ * The guest places an array of `dma_desc` in its memory, writes the ring
+ * address to RING_BASE and the number of entries to RING_SIZE. After filling
+ * descriptors it writes the index of the next free slot to RING_TAIL, that is
+ * the doorbell. The device walks from RING_HEAD to RING_TAIL, executes every
+ * descriptor, writes back its status and advances RING_HEAD.
+ *
+ * Descriptor flags:
+ * Bit 1 is DMA direction, same as the CMD register.
+ * Bit 2 is chain, the next descriptor belongs to the same request. If one
+ * segment of a chain fails, the remaining segments are not executed.
+ * Bits 5..4 are checksum, same as the CMD register. The checksum covers the
+ * whole chain, the type of its first descriptor counts, the result is written
+ * to `_csum` of its last descriptor.
+ * Bits 10..8 are operation, same as the CMD register. `_src` and `_dst` are 64
+ * bit, a descriptor moves or fills up to 4 GiB - 1.
+ *
+ * With its status the device writes three REG_TIMESTAMP values to the
+ * descriptor: `_ts_submit` when the RING_TAIL write published it, `_ts_start`
+ * when the engine started it and `_ts_complete` when it finished, and
+ * `_out_len`, the number of bytes written to `_dst`. `_dst_len` is the room
+ * at `_dst` of a compress or decompress. Data which does not compress into
+ * it is common and not an error, the compress completes with `_out_len` 0. A
+ * decompress which does not fit, or of a corrupt block, fails.
+ */
+#define DMA_RING_MAX_ENTRIES        4096
+
+#define DMA_DESC_F_CHAIN            (1 << 2)
+
+#define DMA_DESC_STS_DONE           (1 << 0)
+#define DMA_DESC_STS_ERROR          (1 << 1)
+
+typedef struct QEMU_PACKED dma_desc {
+    uint64_t _src;
+    uint64_t _dst;
+    uint32_t _len;
+    uint32_t _flags;
+    uint32_t _status;
+    uint32_t _csum;
+    uint64_t _ts_submit;
+    uint64_t _ts_start;
+    uint64_t _ts_complete;
+    uint32_t _dst_len;
+    uint32_t _out_len;
+} dma_desc;
+
+QEMU_BUILD_BUG_ON(sizeof(dma_desc) != 64);
+
+/**
+ * Status write-back:
+ * The driver writes the address of a `c_pci_wb` in its memory to REG_WB_BASE
+ * (64 bit, 64 byte aligned) with bit 0 (WB_ENABLE) set. From then on the
+ * device copies its status registers there every time an event is raised and
+ * every time the driver acknowledges one, before the interrupt. Polling
+ * consumers spin on that memory instead of reading registers. The area must be
+ * RAM, write-backs elsewhere (device registers) are dropped.
+ *
+ * `_seq` is written last and incremented on every write-back, a consumer
+ * reads `_seq`, then the fields (read barrier in between), and sees a
+ * consistent snapshot of at least that sequence number.
+ */
+#define WB_ENABLE               (1 << 0)
+#define WB_ADDR_MASK            (~(uint64_t)0x3f)
+
+typedef struct QEMU_PACKED c_pci_wb_dma {
+    uint32_t _status;
+    uint32_t _completed;
+    uint32_t _csum;
+    uint32_t _ring_head;
+} c_pci_wb_dma;
+
+typedef struct QEMU_PACKED c_pci_wb {
+    uint32_t _seq;
+    uint32_t _result;
+    uint32_t _error;
+    uint32_t _batch_status;
+    uint32_t _irq_status;
+    uint32_t _tag_done;
+    uint32_t _tag_error;
+    uint32_t _reserved;
+    c_pci_wb_dma _dma[DMA_MAX_CHANNELS];
+    uint32_t _tag_result[TAG_NR];
+} c_pci_wb;
+
+QEMU_BUILD_BUG_ON(sizeof(c_pci_wb) != 288);
+
+typedef struct _pci_device_object _pci_device_object;
+
+/**
+ * @brief Timing model. By default every engine completes its work as fast as
+ * the host runs it. With the `dma-bandwidth`, `cmd-latency-ns` or
+ * `op-latency-ns` properties set, an engine executes a command only when the
+ * command is due on the virtual clock:
+ *
+ *   cost = cmd-latency-ns + bytes / dma-bandwidth + ops * op-latency-ns
+ *
+ * Commands of one engine are served in order, back to back. The device
+ * fetches `queue-depth` commands at a time, only the first of each group
+ * waits the command latency, the others overlap it.
+ */
+#define TIMING_MAX_DEPTH        4096
+/* No command takes longer than an hour, keeps the clock arithmetic sane. */
+#define TIMING_MAX_COST         (3600 * NANOSECONDS_PER_SECOND)
+
+typedef struct c_pci_timing {
+    QEMUTimer *_timer;
+    /* Virtual time the last charged command is due, ns. */
+    int64_t _busy_until;
+    /* Commands since the engine was last idle. */
+    uint32_t _burst;
+    /* The command at the head of the engine is charged. */
+    bool _armed;
+    uint64_t _tag;
+} c_pci_timing;
+
+/**
+ * @brief State of one DMA channel.
+ */
+typedef struct dma_channel {
+    _pci_device_object *_owner;
+    uint32_t _index;
+
+    dma_addr_t _cmd;
+    dma_addr_t _src;
+    dma_addr_t _dst;
+    dma_addr_t _len;
+
+    /* Descriptor ring. */
+    dma_addr_t _ring_base;
+    uint32_t _ring_size;
+    uint32_t _ring_head;
+    uint32_t _ring_tail;
+    uint32_t _ring_gen;
+    /* REG_TIMESTAMP of the RING_TAIL write which published each entry. */
+    uint64_t *_submit_ts;
+
+    /* Completion. */
+    uint32_t _status;
+    uint32_t _completed;
+    uint32_t _csum;
+    bool _cmd_pending;
+    QEMUBH *_bh;
+    c_pci_timing _timing;
+
+    /* Chain the ring walk is in, kept across runs of the bottom half since
+     * the timing model may stop the walk in the middle of a chain. */
+    bool _chain_open;
+    bool _chain_failed;
+    uint32_t _chain_gen;
+    uint32_t _chain_csum_type;
+    uint32_t _chain_csum;
+
+    /* DMA_COPY_CHUNK bytes, bounce buffer of copies and pattern of fills. */
+    uint8_t *_scratch;
+} dma_channel;
+
+/**
+ * @brief State of one queue pair.
+ */
+typedef struct c_pci_qp {
+    _pci_device_object *_owner;
+    uint32_t _index;
+
+    uint64_t _sq_base;
+    uint64_t _cq_base;
+    uint32_t _size;
+    uint32_t _sq_head;
+    uint32_t _sq_tail;
+    uint32_t _cq_head;
+    uint32_t _cq_tail;
+    uint32_t _gen;
+    bool _phase;
+    QEMUBH *_bh;
+    c_pci_timing _timing;
+
+    /* Entries pushed through the submission BAR, with the 4 byte words of
+     * each entry received so far. */
+    c_pci_sqe *_push_sq;
+    uint16_t *_push_mask;
+} c_pci_qp;
+
+/**
+ * @brief Always on counters, cheap enough to keep in the fast path. They are
+ * exported as read only `stat-*` QOM properties, e.g.
+ * `qom-get /machine/peripheral/<id> stat-dma-bytes-to-device`.
+ *
+ * BAR1 is RAM, guest accesses to it never reach the device, so there is no
+ * counter for it.
+ */
+typedef struct _pci_dev_stats {
+    Stat64 _mmio_reads;
+    Stat64 _mmio_writes;
+    Stat64 _dma_mmio_reads;
+    Stat64 _dma_mmio_writes;
+    Stat64 _dma_bytes_to_device;
+    Stat64 _dma_bytes_from_device;
+    Stat64 _dma_bytes_copied;
+    Stat64 _dma_bytes_filled;
+    Stat64 _ops[OPCODE_NR];
+    Stat64 _compute_errors;
+    Stat64 _dma_errors;
+    Stat64 _hash_bytes;
+    Stat64 _prog_elements;
+    Stat64 _search_bytes;
+    Stat64 _lz4_bytes_in;
+    Stat64 _lz4_bytes_out;
+    Stat64 _irq_events;
+    Stat64 _irqs;
+} _pci_dev_stats;
+
+/**
+ * @brief Construct a new declare instance checker object.
+ * @InstanceType: instance struct name.
+ * @OBJ_NAME: the object name is uppercase with underscore separtors.
+ * @TYPENAME: type name.
+ * 
+ * Direct usage of this macro should be avoided, and the complete 
+ * OBJECT_DECLARE_TYPE macro is recommended instead.
+ * 
+ * This macro will provide the instance type cast functions for a QOM type.
+ */
+DECLARE_INSTANCE_CHECKER(_pci_device_object, C_PCI_DEV, TYPE_PCI_CUSTOM_DEVICE);
+
+/**
+ * @brief This struct defining/descring the state of our pci device.
+ *
+ * Locking: MMIO callbacks run on vCPU threads under the BQL. Bottom halves
+ * (DMA, batch, queue pairs) run in the AioContext of the `iothread` property,
+ * or of the main loop without one, and do not hold the BQL in an iothread.
+ * `_lock` protects the registers and the ring/queue indexes, bottom halves
+ * only hold it to pick up work and to publish progress, never while moving
+ * data. Interrupts are raised under the BQL, which is taken before `_lock`.
+ *
+ * Ring and queue pair geometry writes bump a generation counter, a bottom
+ * half which sees it change drops the work it picked up before.
+ *
+ * The timing state of an engine belongs to its bottom half, its timer runs in
+ * the same AioContext. The compute timing state is protected by `_lock`.
+ */
+struct _pci_device_object {
+    PCIDevice _pci_dev;
+
+    QemuMutex _lock;
+    IOThread *_iothread;
+
+    /* Test read/write large memory and also this region is used by 
+     * DMA controller like a device memory region. `_big_mem` is
+     * `_big_mem_region`, or the region of `_memdev`. */
+    MemoryRegion _big_mem_region;
+    MemoryRegion *_big_mem;
+    HostMemoryBackend *_memdev;
+    uint8_t *_big_mem_bar;
+    uint64_t _big_mem_size;
+
+    /* Test operators and interrupt. */
+    MemoryRegion _mmio;
+    uint32_t _operand_1;
+    uint32_t _operand_2;
+    uint32_t _opcode;
+    uint32_t _result;
+    uint32_t _error;
+    c_pci_timing _compute_timing;
+
+    /* Batch mode of the arithmetic unit. */
+    uint64_t _batch_op1;
+    uint64_t _batch_op2;
+    uint64_t _batch_res;
+    uint32_t _batch_count;
+    uint32_t _batch_opcode;
+    uint32_t _batch_status;
+    uint32_t *_batch_buf[3];
+    QEMUBH *_batch_bh;
+    c_pci_timing _batch_timing;
+
+    /* Tagged operations. `_tag_head` and `_tag_tail` run free, the queue is
+     * `_tag_ops[head % TAG_NR]` up to tail. */
+    uint64_t _tag_operands;
+    c_pci_tag_op _tag_ops[TAG_NR];
+    uint32_t _tag_head;
+    uint32_t _tag_tail;
+    uint32_t _tag_busy;
+    uint32_t _tag_done;
+    uint32_t _tag_error;
+    uint32_t _tag_result[TAG_NR];
+    QEMUBH *_tag_bh;
+    c_pci_timing _tag_timing;
+
+    /* Programs of the filter/map/reduce engine, loaded and run through the
+     * queue pairs. */
+    c_pci_prog _progs[PROG_SLOTS];
+
+    /* Queue pairs. */
+    uint32_t _nr_qps;
+    c_pci_qp _qp[QP_MAX];
+    MemoryRegion _push;
+
+    /* Test DMA, to receive DMA command. */
+    MemoryRegion _dma;
+    uint32_t _dma_channels;
+    dma_channel _dma_chan[DMA_MAX_CHANNELS];
+
+    /* Number of MSI-X vectors. */
+    uint32_t _vectors;
+
+    /* Interrupt status, mask and moderation. `_irq_pending` are sources with
+     * events not signalled yet, `_irq_events` counts them per source. */
+    uint32_t _irq_status;
+    uint32_t _irq_mask;
+    uint32_t _irq_pending;
+    uint32_t _irq_coal_count;
+    uint32_t _irq_coal_usec;
+    uint32_t _irq_events[IRQ_SRC_NR];
+    QEMUTimer *_coal_timer;
+
+    /* Status write-back, REG_WB_BASE. */
+    uint64_t _wb_base;
+    uint32_t _wb_seq;
+
+    /* Timing model, see c_pci_timing. */
+    uint64_t _dma_bandwidth;
+    uint32_t _cmd_latency_ns;
+    uint32_t _op_latency_ns;
+    uint32_t _queue_depth;
+
+    _pci_dev_stats _stats;
+};
+
+/**
+ * @brief True if the write-back area at @base is guest RAM. The write-back
+ * runs under `_lock`, a write to MMIO (our own BARs, in iothread mode without
+ * the re-entrancy guard) could call back into the device and deadlock.
+ * Called with the BQL held, so the memory map can not change until the write.
+ */
+static bool _pci_dev_wb_is_ram(_pci_device_object *_pci_dev, dma_addr_t base)
+{
+    MemoryRegion *mr = NULL;
+    hwaddr xlat = 0;
+    hwaddr len = sizeof(c_pci_wb);
+
+    RCU_READ_LOCK_GUARD();
+    mr = address_space_translate(pci_get_address_space(&_pci_dev->_pci_dev),
+                                 base, &xlat, &len, true,
+                                 MEMTXATTRS_UNSPECIFIED);
+
+    return memory_region_is_ram(mr) && len >= sizeof(c_pci_wb);
+}
+
+/**
+ * @brief Copy the status registers to the write-back area, if the driver set
+ * one up. Called with the BQL and `_lock` held.
+ */
+static void _pci_dev_writeback(_pci_device_object *_pci_dev)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    dma_addr_t base = _pci_dev->_wb_base & WB_ADDR_MASK;
+    c_pci_wb wb;
+    uint32_t i;
+
+    if (!(_pci_dev->_wb_base & WB_ENABLE)) {
+        return;
+    }
+
+    if (!_pci_dev_wb_is_ram(_pci_dev, base)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: status write-back to 0x%" PRIx64
+                      " is not RAM\n", base);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return;
+    }
+
+    memset(&wb, 0, sizeof(wb));
+    wb._result = cpu_to_le32(_pci_dev->_result);
+    wb._error = cpu_to_le32(_pci_dev->_error);
+    wb._batch_status = cpu_to_le32(_pci_dev->_batch_status);
+    wb._irq_status = cpu_to_le32(_pci_dev->_irq_status);
+    wb._tag_done = cpu_to_le32(_pci_dev->_tag_done);
+    wb._tag_error = cpu_to_le32(_pci_dev->_tag_error);
+    for (i = 0; i < TAG_NR; i++) {
+        wb._tag_result[i] = cpu_to_le32(_pci_dev->_tag_result[i]);
+    }
+    for (i = 0; i < _pci_dev->_dma_channels; i++) {
+        dma_channel *ch = &_pci_dev->_dma_chan[i];
+
+        wb._dma[i]._status = cpu_to_le32(ch->_status);
+        wb._dma[i]._completed = cpu_to_le32(ch->_completed);
+        wb._dma[i]._csum = cpu_to_le32(ch->_csum);
+        wb._dma[i]._ring_head = cpu_to_le32(ch->_ring_head);
+    }
+
+    /* Body first, the sequence number tells the snapshot is complete. */
+    if (pci_dma_write(dev,
+                      base + offsetof(c_pci_wb, _result),
+                      &wb._result,
+                      sizeof(wb) - offsetof(c_pci_wb, _result)) != MEMTX_OK ||
+        stl_le_pci_dma(dev,
+                       base + offsetof(c_pci_wb, _seq),
+                       ++_pci_dev->_wb_seq,
+                       MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: status write-back to 0x%" PRIx64 " failed\n",
+                      base);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+    }
+}
+
+/**
+ * @brief MSI-X vector of a DMA channel. If the table is smaller than the
+ * number of channels, channels share the DMA vectors round robin.
+ */
+static unsigned _pci_dev_dma_vector(_pci_device_object *_pci_dev, uint32_t chan)
+{
+    return C_PCI_VEC_DMA_BASE + chan % (_pci_dev->_vectors - C_PCI_VEC_DMA_BASE);
+}
+
+/**
+ * @brief INTx is up while a DMA source is signalled, not masked and not
+ * acknowledged yet.
+ */
+static void _pci_dev_update_intx(_pci_device_object *_pci_dev)
+{
+    uint32_t level = _pci_dev->_irq_status & ~_pci_dev->_irq_pending &
+                     ~_pci_dev->_irq_mask & ~(BIT(IRQ_SRC_DMA_BASE) - 1);
+
+    if (msix_enabled(&_pci_dev->_pci_dev) || msi_enabled(&_pci_dev->_pci_dev)) {
+        return;
+    }
+
+    pci_set_irq(&_pci_dev->_pci_dev, level != 0);
+}
+
+/**
+ * @brief Signal the driver that @source has events.
+ *
+ * MSI-X: every source has its vector of the layout above.
+ * MSI: only DMA completions are signalled, channel N on vector N, folded on
+ *      vector 0 if the guest enabled less vectors.
+ * INTx: only DMA completions are signalled, the line stays up until the
+ *      driver acknowledged every signalled source.
+ */
+static void _pci_dev_fire_irq(_pci_device_object *_pci_dev, unsigned source)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    unsigned vector = source;
+
+    _pci_dev->_irq_pending &= ~BIT(source);
+    _pci_dev->_irq_events[source] = 0;
+    stat64_inc(&_pci_dev->_stats._irqs);
+
+    if (source >= IRQ_SRC_DMA_BASE) {
+        vector = _pci_dev_dma_vector(_pci_dev, source - IRQ_SRC_DMA_BASE);
+    }
+
+    trace_c_pci_dev_irq(vector);
+
+    if (msix_enabled(dev)) {
+        msix_notify(dev, vector);
+        return;
+    }
+
+    if (source < IRQ_SRC_DMA_BASE) {
+        return;
+    }
+    vector = source - IRQ_SRC_DMA_BASE;
+
+    if (msi_enabled(dev)) {
+        msi_notify(dev, vector < msi_nr_vectors_allocated(dev) ? vector : 0);
+    } else {
+        _pci_dev_update_intx(_pci_dev);
+    }
+}
+
+/**
+ * @brief Fire every source with held back events which is not masked.
+ */
+static void _pci_dev_flush_irqs(_pci_device_object *_pci_dev)
+{
+    uint32_t ready = _pci_dev->_irq_pending & ~_pci_dev->_irq_mask;
+
+    while (ready) {
+        unsigned source = ctz32(ready);
+
+        ready &= ~BIT(source);
+        _pci_dev_fire_irq(_pci_dev, source);
+    }
+}
+
+/**
+ * @brief Coalescing timer, the oldest held back event waited REG_IRQ_COAL_USEC.
+ */
+static void _pci_dev_coal_timer(void *opaque)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+    _pci_dev_flush_irqs(_pci_dev);
+}
+
+/**
+ * @brief Record an event of @source (IRQ_SRC_*) in REG_IRQ_STATUS and signal
+ * it, now or, with coalescing, once REG_IRQ_COAL_COUNT events are held back or
+ * REG_IRQ_COAL_USEC passed. Errors are never held back. Masked sources keep
+ * their events until they are unmasked.
+ *
+ * Called with the BQL and `_lock` held.
+ */
+static void _pci_dev_raise_irq(_pci_device_object *_pci_dev, unsigned source)
+{
+    bool coalesce = _pci_dev->_irq_coal_count > 1 &&
+                    _pci_dev->_irq_coal_usec > 0 &&
+                    source != IRQ_SRC_ERROR;
+
+    _pci_dev->_irq_status |= BIT(source);
+    _pci_dev->_irq_pending |= BIT(source);
+    _pci_dev->_irq_events[source]++;
+    stat64_inc(&_pci_dev->_stats._irq_events);
+
+    _pci_dev_writeback(_pci_dev);
+
+    if (_pci_dev->_irq_mask & BIT(source)) {
+        return;
+    }
+
+    if (!coalesce || _pci_dev->_irq_events[source] >= _pci_dev->_irq_coal_count) {
+        _pci_dev_fire_irq(_pci_dev, source);
+        return;
+    }
+
+    /* First held back event starts the clock. */
+    if (!timer_pending(_pci_dev->_coal_timer)) {
+        timer_mod(_pci_dev->_coal_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + _pci_dev->_irq_coal_usec);
+    }
+}
+
+/**
+ * @brief Latch an error cause in REG_ERROR and report it on the error vector.
+ */
+static void _pci_dev_set_error(_pci_device_object *_pci_dev, uint32_t error)
+{
+    trace_c_pci_dev_error(error);
+    _pci_dev->_error |= error;
+    _pci_dev_raise_irq(_pci_dev, IRQ_SRC_ERROR);
+}
+
+/**
+ * @brief Report the end of bottom half work: latch @error (0 for none) and
+ * raise @source (< 0 for none). Takes the BQL, so it is called without
+ * `_lock`.
+ */
+static void _pci_dev_notify(_pci_device_object *_pci_dev,
+                            uint32_t error,
+                            int source)
+{
+    QEMU_IOTHREAD_LOCK_GUARD();
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    if (error) {
+        _pci_dev_set_error(_pci_dev, error);
+    }
+    if (source >= 0) {
+        _pci_dev_raise_irq(_pci_dev, source);
+    }
+}
+
+/**
+ * @brief True if any timing property is set, engines complete instantly
+ * otherwise.
+ */
+static bool _timing_enabled(_pci_device_object *_pci_dev)
+{
+    return _pci_dev->_dma_bandwidth ||
+           _pci_dev->_cmd_latency_ns ||
+           _pci_dev->_op_latency_ns;
+}
+
+/**
+ * @brief Charge a command moving @bytes and running @ops operations to an
+ * engine, see c_pci_timing.
+ *
+ * @return virtual time the command is due, ns.
+ */
+static int64_t _timing_charge(_pci_device_object *_pci_dev,
+                              c_pci_timing *t,
+                              uint64_t bytes,
+                              uint64_t ops)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint64_t cost = ops * _pci_dev->_op_latency_ns;
+
+    if (t->_burst % _pci_dev->_queue_depth == 0) {
+        cost += _pci_dev->_cmd_latency_ns;
+    }
+    t->_burst++;
+
+    if (_pci_dev->_dma_bandwidth) {
+        uint64_t lo, hi;
+
+        mulu64(&lo, &hi, bytes, NANOSECONDS_PER_SECOND);
+        divu128(&lo, &hi, _pci_dev->_dma_bandwidth);
+        cost += hi ? TIMING_MAX_COST : MIN(lo, TIMING_MAX_COST);
+    }
+
+    t->_busy_until = MAX(now, t->_busy_until) + MIN(cost, TIMING_MAX_COST);
+    return t->_busy_until;
+}
+
+/**
+ * @brief Timing gate, an engine calls it before it executes the command at
+ * its head. @tag names the command, a different command at the head (the
+ * ring was reset) is charged again.
+ *
+ * @return true if the command is due. Otherwise the engine stops, the timer
+ * schedules it again when the command is due.
+ */
+static bool _timing_due(_pci_device_object *_pci_dev,
+                        c_pci_timing *t,
+                        uint64_t tag,
+                        uint64_t bytes,
+                        uint64_t ops)
+{
+    if (!_timing_enabled(_pci_dev)) {
+        return true;
+    }
+
+    if (!t->_armed || t->_tag != tag) {
+        _timing_charge(_pci_dev, t, bytes, ops);
+        t->_armed = true;
+        t->_tag = tag;
+    }
+
+    if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < t->_busy_until) {
+        timer_mod(t->_timer, t->_busy_until);
+        return false;
+    }
+
+    t->_armed = false;
+    return true;
+}
+
+/**
+ * @brief The engine ran out of commands, the next one starts a new burst and
+ * waits the command latency again.
+ */
+static void _timing_idle(c_pci_timing *t)
+{
+    t->_burst = 0;
+}
+
+/**
+ * @brief Engine timer, the command at the head of the engine is due.
+ */
+static void _timing_kick(void *opaque)
+{
+    qemu_bh_schedule((QEMUBH *)opaque);
+}
+
+/**
+ * @brief Arithmetic unit shared by the register interface and the queue pairs.
+ *
+ * @return CQE_STS_SUCCESS, or the error code, then @result is 0.
+ */
+static uint16_t _pci_dev_alu(_pci_device_object *_pci_dev,
+                             uint32_t opcode,
+                             uint32_t op1,
+                             uint32_t op2,
+                             uint32_t *result)
+{
+    uint16_t status = CQE_STS_SUCCESS;
+
+    *result = 0x00;
+
+    switch (opcode) {
+        case OPCODE_ADD:
+            *result = op1 + op2;
+            break;
+        case OPCODE_SUB:
+            *result = op1 - op2;
+            break;
+        case OPCODE_DIV:
+            if (op2 == 0) {
+                status = CQE_STS_DIV_ZERO;
+                break;
+            }
+            *result = op1 / op2;
+            break;
+        case OPCODE_MUL:
+            *result = op1 * op2;
+            break;
+        default:
+            status = CQE_STS_INVALID_OPCODE;
+            break;
+    }
+
+    if (status != CQE_STS_SUCCESS) {
+        stat64_inc(&_pci_dev->_stats._compute_errors);
+        return status;
+    }
+
+    stat64_inc(&_pci_dev->_stats._ops[opcode]);
+    trace_c_pci_dev_compute(opcode, op1, op2, *result);
+
+    return status;
+}
+
+/**
+ * @brief Run the arithmetic unit. The guest writes the operands then the
+ * opcode, the opcode write executes the operation, latches REG_RESULT and
+ * signals the compute vector.
+ */
+static void _pci_dev_compute(_pci_device_object *_pci_dev)
+{
+    if (_pci_dev_alu(_pci_dev,
+                     _pci_dev->_opcode,
+                     _pci_dev->_operand_1,
+                     _pci_dev->_operand_2,
+                     &_pci_dev->_result) != CQE_STS_SUCCESS) {
+        _pci_dev_set_error(_pci_dev, ERR_COMPUTE);
+        return;
+    }
+
+    /* We fire interrupt when result ready. */
+    _pci_dev_raise_irq(_pci_dev, IRQ_SRC_COMPUTE);
+}
+
+/**
+ * @brief Compute timer of the timing model, the operation written to
+ * REG_OPCODE is due.
+ */
+static void _pci_dev_compute_timer(void *opaque)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+
+    QEMU_IOTHREAD_LOCK_GUARD();
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+    _pci_dev_compute(_pci_dev);
+}
+
+/**
+ * @brief Queue a tagged operation, REG_TAG_CMD was written. Called with the
+ * BQL and `_lock` held.
+ */
+static void _tag_push(_pci_device_object *_pci_dev, uint32_t cmd)
+{
+    uint32_t tag = cmd & TAG_CMD_TAG_MASK;
+    c_pci_tag_op *op;
+
+    /* At most one operation per tag, the queue never overflows. */
+    if (_pci_dev->_tag_busy & BIT(tag)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "c_pci_dev: tag %u is busy\n", tag);
+        _pci_dev_set_error(_pci_dev, ERR_COMPUTE);
+        return;
+    }
+
+    op = &_pci_dev->_tag_ops[_pci_dev->_tag_tail % TAG_NR];
+    op->_op1 = extract64(_pci_dev->_tag_operands, 0, 32);
+    op->_op2 = extract64(_pci_dev->_tag_operands, 32, 32);
+    op->_opcode = extract32(cmd, TAG_CMD_OPCODE_SHIFT, 8);
+    op->_tag = tag;
+
+    _pci_dev->_tag_busy |= BIT(tag);
+    _pci_dev->_tag_done &= ~BIT(tag);
+    _pci_dev->_tag_error &= ~BIT(tag);
+    _pci_dev->_tag_tail++;
+
+    qemu_bh_schedule(_pci_dev->_tag_bh);
+}
+
+/**
+ * @brief Tagged operations bottom half, runs the queue in order and signals
+ * the compute vector once it drained.
+ */
+static void _tag_bh(void *opaque)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+    bool drained = false;
+    bool ran = false;
+
+    for (;;)
+    {
+        c_pci_tag_op op;
+        uint32_t head;
+        uint32_t result = 0;
+        uint16_t status;
+
+        qemu_mutex_lock(&_pci_dev->_lock);
+        if (_pci_dev->_tag_head == _pci_dev->_tag_tail) {
+            qemu_mutex_unlock(&_pci_dev->_lock);
+            _timing_idle(&_pci_dev->_tag_timing);
+            drained = ran;
+            break;
+        }
+        head = _pci_dev->_tag_head;
+        op = _pci_dev->_tag_ops[head % TAG_NR];
+        qemu_mutex_unlock(&_pci_dev->_lock);
+
+        if (!_timing_due(_pci_dev, &_pci_dev->_tag_timing, head, 0, 1)) {
+            break;
+        }
+
+        status = _pci_dev_alu(_pci_dev, op._opcode, op._op1, op._op2, &result);
+
+        WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+            _pci_dev->_tag_result[op._tag] = result;
+            _pci_dev->_tag_done |= BIT(op._tag);
+            if (status != CQE_STS_SUCCESS) {
+                _pci_dev->_tag_error |= BIT(op._tag);
+            }
+            _pci_dev->_tag_busy &= ~BIT(op._tag);
+            _pci_dev->_tag_head++;
+        }
+        ran = true;
+    }
+
+    if (drained) {
+        _pci_dev_notify(_pci_dev, 0, IRQ_SRC_COMPUTE);
+    }
+}
+
+/**
+ * @brief Host vector of uint32_t lanes, the compiler emits SIMD instructions
+ * of the host (SSE, NEON, ...) for the operators on this type.
+ */
+typedef uint32_t batch_vec __attribute__((vector_size(16)));
+
+#define BATCH_LANES (sizeof(batch_vec) / sizeof(uint32_t))
+
+#define BATCH_KERNEL(NAME, OP)                                              \
+static void NAME(const uint32_t *a, const uint32_t *b, uint32_t *r,         \
+                 uint32_t n)                                                \
+{                                                                           \
+    uint32_t i;                                                             \
+                                                                            \
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {                   \
+        *(batch_vec *)(r + i) = *(const batch_vec *)(a + i) OP              \
+                                *(const batch_vec *)(b + i);                \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+        r[i] = a[i] OP b[i];                                                \
+    }                                                                       \
+}
+
+BATCH_KERNEL(_batch_add, +)
+BATCH_KERNEL(_batch_sub, -)
+BATCH_KERNEL(_batch_mul, *)
+
+/**
+ * @brief Hosts have no SIMD integer division, and every lane has to be checked
+ * for zero anyway.
+ *
+ * @return true if at least one lane divided by zero.
+ */
+static bool _batch_div(const uint32_t *a, const uint32_t *b, uint32_t *r,
+                       uint32_t n)
+{
+    bool div_zero = false;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        if (b[i] == 0) {
+            r[i] = 0;
+            div_zero = true;
+        } else {
+            r[i] = a[i] / b[i];
+        }
+    }
+
+    return div_zero;
+}
+
+/**
+ * @brief Guest arrays are little endian, swap in place on big endian hosts.
+ */
+static void _batch_swap(uint32_t *buf, uint32_t n)
+{
+#if HOST_BIG_ENDIAN
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        bswap32s(&buf[i]);
+    }
+#endif
+}
+
+/**
+ * @brief 64 bit registers take one 8 byte access or two 4 byte accesses, the
+ * low half at the register address and the high half 4 bytes above.
+ */
+static uint64_t _pci_dev_reg64_read(uint64_t reg, hwaddr addr, unsigned size)
+{
+    if (size == 8) {
+        return reg;
+    }
+
+    return extract64(reg, (addr & 4) * 8, 32);
+}
+
+static void _pci_dev_reg64_write(uint64_t *reg, hwaddr addr, uint64_t val,
+                                 unsigned size)
+{
+    if (size == 8) {
+        *reg = val;
+        return;
+    }
+
+    *reg = deposit64(*reg, (addr & 4) * 8, 32, val);
+}
+
+/**
+ * @brief Compute @count lanes of `res[i] = op1[i] <opcode> op2[i]`, the arrays
+ * are guest addresses. Runs BATCH_CHUNK lanes at a time.
+ *
+ * @done: number of lanes computed and written back.
+ * @return BATCH_STS_DONE plus BATCH_STS_ERROR and BATCH_STS_DIV_ZERO.
+ */
+static uint32_t _batch_exec(_pci_device_object *_pci_dev,
+                            uint32_t opcode,
+                            dma_addr_t op1,
+                            dma_addr_t op2,
+                            dma_addr_t res,
+                            uint32_t count,
+                            uint32_t *done)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    uint32_t *a = _pci_dev->_batch_buf[0];
+    uint32_t *b = _pci_dev->_batch_buf[1];
+    uint32_t *r = _pci_dev->_batch_buf[2];
+    uint32_t status = BATCH_STS_DONE;
+
+    *done = 0;
+
+    if (opcode >= OPCODE_NR) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: unknown batch opcode %u\n", opcode);
+        stat64_inc(&_pci_dev->_stats._compute_errors);
+        return status | BATCH_STS_ERROR;
+    }
+
+    while (*done < count) {
+        uint32_t n = MIN(count - *done, BATCH_CHUNK);
+        dma_addr_t offset = (dma_addr_t)*done * sizeof(uint32_t);
+        dma_addr_t len = (dma_addr_t)n * sizeof(uint32_t);
+
+        if (pci_dma_read(dev, op1 + offset, a, len) != MEMTX_OK ||
+            pci_dma_read(dev, op2 + offset, b, len) != MEMTX_OK) {
+            status |= BATCH_STS_ERROR;
+            break;
+        }
+
+        _batch_swap(a, n);
+        _batch_swap(b, n);
+
+        switch (opcode) {
+            case OPCODE_ADD:
+                _batch_add(a, b, r, n);
+                break;
+            case OPCODE_SUB:
+                _batch_sub(a, b, r, n);
+                break;
+            case OPCODE_MUL:
+                _batch_mul(a, b, r, n);
+                break;
+            case OPCODE_DIV:
+                if (_batch_div(a, b, r, n)) {
+                    status |= BATCH_STS_DIV_ZERO;
+                }
+                break;
+        }
+
+        _batch_swap(r, n);
+
+        if (pci_dma_write(dev, res + offset, r, len) != MEMTX_OK) {
+            status |= BATCH_STS_ERROR;
+            break;
+        }
+
+        stat64_add(&_pci_dev->_stats._dma_bytes_to_device, 2 * len);
+        stat64_add(&_pci_dev->_stats._dma_bytes_from_device, len);
+        *done += n;
+    }
+
+    if (*done) {
+        stat64_add(&_pci_dev->_stats._ops[opcode], *done);
+    }
+    if (status & BATCH_STS_ERROR) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+    }
+    if (status & BATCH_STS_DIV_ZERO) {
+        stat64_inc(&_pci_dev->_stats._compute_errors);
+    }
+
+    trace_c_pci_dev_batch_done(opcode, *done, status);
+
+    return status;
+}
+
+/**
+ * @brief Batch bottom half, runs the batch programmed in the BATCH registers.
+ */
+static void _batch_bh(void *opaque)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+    uint32_t opcode, count;
+    dma_addr_t op1, op2, res;
+    uint32_t error = 0;
+    uint32_t status;
+    uint32_t done;
+
+    /* The guest may rewrite the registers while the batch runs, read them
+     * once. */
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        opcode = _pci_dev->_batch_opcode;
+        op1 = _pci_dev->_batch_op1;
+        op2 = _pci_dev->_batch_op2;
+        res = _pci_dev->_batch_res;
+        count = _pci_dev->_batch_count;
+    }
+
+    /* Two operand arrays in, one result array out. */
+    if (!_timing_due(_pci_dev,
+                     &_pci_dev->_batch_timing,
+                     0,
+                     (uint64_t)count * 3 * sizeof(uint32_t),
+                     count)) {
+        return;
+    }
+    _timing_idle(&_pci_dev->_batch_timing);
+
+    status = _batch_exec(_pci_dev, opcode, op1, op2, res, count, &done);
+
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        _pci_dev->_batch_status = status;
+    }
+
+    if ((status & BATCH_STS_ERROR) && opcode < OPCODE_NR) {
+        error = ERR_DMA;
+    } else if (status & (BATCH_STS_ERROR | BATCH_STS_DIV_ZERO)) {
+        error = ERR_COMPUTE;
+    }
+
+    _pci_dev_notify(_pci_dev, error, IRQ_SRC_COMPUTE);
+}
+
+/**
+ * @brief Hash engine, the guest buffer is mapped segment by segment and hashed
+ * in place. Segments which can not be mapped directly (not RAM) go through a
+ * bounce buffer.
+ *
+ * @result: number of bytes hashed.
+ * @return CQE status code.
+ */
+static uint16_t _hash_exec(_pci_device_object *_pci_dev,
+                           const c_pci_sqe *sqe,
+                           uint32_t *result)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    g_autofree c_pci_sg *sgl = NULL;
+    g_autofree struct iovec *iov = NULL;
+    g_autofree bool *bounced = NULL;
+    g_autofree uint8_t *digest = NULL;
+    size_t digest_len = 0;
+    uint32_t nsegs = 1;
+    uint64_t total = 0;
+    uint16_t status = CQE_STS_SUCCESS;
+    uint32_t i;
+
+    *result = 0;
+
+    if (sqe->_flags & SQE_F_SGL) {
+        nsegs = le32_to_cpu(sqe->_len);
+        if (nsegs == 0 || nsegs > HASH_MAX_SEGMENTS) {
+            return CQE_STS_INVALID_FIELD;
+        }
+
+        sgl = g_new(c_pci_sg, nsegs);
+        if (pci_dma_read(dev, le64_to_cpu(sqe->_src), sgl,
+                         nsegs * sizeof(c_pci_sg)) != MEMTX_OK) {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            return CQE_STS_DMA_ERROR;
+        }
+    } else {
+        sgl = g_new(c_pci_sg, 1);
+        sgl[0]._addr = sqe->_src;
+        sgl[0]._len = sqe->_len;
+    }
+
+    iov = g_new0(struct iovec, nsegs);
+    bounced = g_new0(bool, nsegs);
+
+    for (i = 0; i < nsegs; i++) {
+        dma_addr_t addr = le64_to_cpu(sgl[i]._addr);
+        dma_addr_t len = le32_to_cpu(sgl[i]._len);
+        dma_addr_t plen = len;
+
+        total += len;
+        if (total > HASH_MAX_BYTES) {
+            status = CQE_STS_INVALID_FIELD;
+            break;
+        }
+
+        iov[i].iov_len = len;
+        if (len == 0) {
+            continue;
+        }
+
+        iov[i].iov_base = pci_dma_map(dev, addr, &plen, DMA_DIRECTION_TO_DEVICE);
+        if (iov[i].iov_base && plen == len) {
+            continue;
+        }
+
+        if (iov[i].iov_base) {
+            pci_dma_unmap(dev, iov[i].iov_base, plen, DMA_DIRECTION_TO_DEVICE, 0);
+        }
+
+        iov[i].iov_base = g_malloc(len);
+        bounced[i] = true;
+        if (pci_dma_read(dev, addr, iov[i].iov_base, len) != MEMTX_OK) {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            status = CQE_STS_DMA_ERROR;
+            i++;
+            break;
+        }
+    }
+
+    if (status == CQE_STS_SUCCESS &&
+        qcrypto_hash_bytesv(QCRYPTO_HASH_ALG_SHA256, iov, nsegs,
+                            &digest, &digest_len, NULL) < 0) {
+        status = CQE_STS_INVALID_OPCODE;
+    }
+
+    /* Release the first @i segments, the ones we mapped or bounced. */
+    while (i--) {
+        if (bounced[i]) {
+            g_free(iov[i].iov_base);
+        } else if (iov[i].iov_base) {
+            pci_dma_unmap(dev, iov[i].iov_base, iov[i].iov_len,
+                          DMA_DIRECTION_TO_DEVICE, iov[i].iov_len);
+        }
+    }
+
+    if (status != CQE_STS_SUCCESS) {
+        return status;
+    }
+
+    if (pci_dma_write(dev, le64_to_cpu(sqe->_dst), digest, digest_len) != MEMTX_OK) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return CQE_STS_DMA_ERROR;
+    }
+
+    stat64_add(&_pci_dev->_stats._hash_bytes, total);
+    trace_c_pci_dev_hash(total, nsegs);
+    *result = total;
+
+    return status;
+}
+
+/**
+ * @brief Verify the program in @insns and decode it to @prog.
+ *
+ * @return true if the program is valid.
+ */
+static bool _prog_verify(const c_pci_insn *insns, uint32_t len,
+                         c_pci_prog *prog)
+{
+    bool emit = false;
+    bool reduce = false;
+    uint32_t i;
+
+    if (len == 0 || len > PROG_MAX_INSNS) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t op = insns[i]._op;
+        uint32_t imm = le32_to_cpu(insns[i]._imm);
+
+        if (insns[i]._reserved[0] || insns[i]._reserved[1] ||
+            insns[i]._reserved[2] || reduce) {
+            return false;
+        }
+
+        switch (op) {
+        case PROG_MAP_SHL:
+        case PROG_MAP_SHR:
+            if (imm >= 32) {
+                return false;
+            }
+            break;
+        case PROG_MAP_ADD:
+        case PROG_MAP_SUB:
+        case PROG_MAP_MUL:
+        case PROG_MAP_AND:
+        case PROG_MAP_OR:
+        case PROG_MAP_XOR:
+        case PROG_MAP_MIN:
+        case PROG_MAP_MAX:
+        case PROG_FILTER_EQ:
+        case PROG_FILTER_NE:
+        case PROG_FILTER_LT:
+        case PROG_FILTER_LE:
+        case PROG_FILTER_GT:
+        case PROG_FILTER_GE:
+        case PROG_FILTER_ANY:
+            break;
+        case PROG_EMIT:
+            if (emit) {
+                return false;
+            }
+            emit = true;
+            break;
+        case PROG_REDUCE_SUM:
+        case PROG_REDUCE_MIN:
+        case PROG_REDUCE_MAX:
+        case PROG_REDUCE_COUNT:
+            reduce = true;
+            break;
+        default:
+            return false;
+        }
+
+        prog->_op[i] = op;
+        prog->_imm[i] = imm;
+    }
+
+    prog->_len = len;
+    return emit || reduce;
+}
+
+/**
+ * @brief OPCODE_PROG_LOAD, fetch and verify a program, then store it in its
+ * slot.
+ *
+ * @result: number of instructions loaded.
+ * @return CQE status code.
+ */
+static uint16_t _prog_load(_pci_device_object *_pci_dev,
+                           const c_pci_sqe *sqe,
+                           uint32_t *result)
+{
+    uint32_t slot = le32_to_cpu(sqe->_op1);
+    uint32_t len = le32_to_cpu(sqe->_len);
+    c_pci_insn insns[PROG_MAX_INSNS];
+    c_pci_prog prog;
+
+    *result = 0;
+
+    if (slot >= PROG_SLOTS || len == 0 || len > PROG_MAX_INSNS) {
+        return CQE_STS_INVALID_FIELD;
+    }
+
+    if (pci_dma_read(&_pci_dev->_pci_dev, le64_to_cpu(sqe->_src), insns,
+                     len * sizeof(c_pci_insn)) != MEMTX_OK) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return CQE_STS_DMA_ERROR;
+    }
+
+    if (!_prog_verify(insns, len, &prog)) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: program %u does not verify\n", slot);
+        stat64_inc(&_pci_dev->_stats._compute_errors);
+        return CQE_STS_INVALID_FIELD;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        _pci_dev->_progs[slot] = prog;
+    }
+
+    *result = len;
+    return CQE_STS_SUCCESS;
+}
+
+#define PROG_MAP_KERNEL(NAME, OP)                                           \
+static void NAME(uint32_t *x, uint32_t imm, uint32_t n)                     \
+{                                                                           \
+    uint32_t i;                                                             \
+                                                                            \
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {                   \
+        *(batch_vec *)(x + i) = *(batch_vec *)(x + i) OP imm;               \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+        x[i] = x[i] OP imm;                                                 \
+    }                                                                       \
+}
+
+PROG_MAP_KERNEL(_prog_add, +)
+PROG_MAP_KERNEL(_prog_sub, -)
+PROG_MAP_KERNEL(_prog_mul, *)
+PROG_MAP_KERNEL(_prog_and, &)
+PROG_MAP_KERNEL(_prog_or, |)
+PROG_MAP_KERNEL(_prog_xor, ^)
+PROG_MAP_KERNEL(_prog_shl, <<)
+PROG_MAP_KERNEL(_prog_shr, >>)
+
+/* Vector compares give -1 in the lanes where they hold, 0 elsewhere. */
+#define PROG_FILTER_KERNEL(NAME, CMP)                                       \
+static void NAME(const uint32_t *x, uint32_t *keep, uint32_t imm,           \
+                 uint32_t n)                                                \
+{                                                                           \
+    uint32_t i;                                                             \
+                                                                            \
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {                   \
+        *(batch_vec *)(keep + i) &=                                         \
+            (batch_vec)(*(const batch_vec *)(x + i) CMP imm);               \
+    }                                                                       \
+    for (; i < n; i++) {                                                    \
+        keep[i] &= -(uint32_t)(x[i] CMP imm);                               \
+    }                                                                       \
+}
+
+PROG_FILTER_KERNEL(_prog_eq, ==)
+PROG_FILTER_KERNEL(_prog_ne, !=)
+PROG_FILTER_KERNEL(_prog_lt, <)
+PROG_FILTER_KERNEL(_prog_le, <=)
+PROG_FILTER_KERNEL(_prog_gt, >)
+PROG_FILTER_KERNEL(_prog_ge, >=)
+
+static void _prog_any(const uint32_t *x, uint32_t *keep, uint32_t imm,
+                      uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {
+        *(batch_vec *)(keep + i) &=
+            (batch_vec)((*(const batch_vec *)(x + i) & imm) != 0);
+    }
+    for (; i < n; i++) {
+        keep[i] &= -(uint32_t)((x[i] & imm) != 0);
+    }
+}
+
+/**
+ * @brief MIN and MAX maps, select through the compare mask.
+ */
+static void _prog_min_max(uint32_t *x, uint32_t imm, bool max, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i + BATCH_LANES <= n; i += BATCH_LANES) {
+        batch_vec v = *(batch_vec *)(x + i);
+        batch_vec lt = (batch_vec)(v < imm);
+
+        if (max) {
+            lt = ~lt;
+        }
+        *(batch_vec *)(x + i) = (v & lt) | (imm & ~lt);
+    }
+    for (; i < n; i++) {
+        x[i] = max ? MAX(x[i], imm) : MIN(x[i], imm);
+    }
+}
+
+/**
+ * @brief Pack the kept elements of @x at @out.
+ *
+ * @return number of elements packed.
+ */
+static uint32_t _prog_emit(const uint32_t *x, const uint32_t *keep,
+                           uint32_t *out, uint32_t n)
+{
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        out[count] = x[i];
+        count += keep[i] & 1;
+    }
+
+    return count;
+}
+
+static uint64_t _prog_reduce(uint8_t op, const uint32_t *x,
+                             const uint32_t *keep, uint64_t acc, uint32_t n)
+{
+    uint32_t i;
+
+    switch (op) {
+    case PROG_REDUCE_SUM:
+        for (i = 0; i < n; i++) {
+            acc += x[i] & keep[i];
+        }
+        break;
+    case PROG_REDUCE_MIN:
+        for (i = 0; i < n; i++) {
+            acc = MIN(acc, x[i] | ~keep[i]);
+        }
+        break;
+    case PROG_REDUCE_MAX:
+        for (i = 0; i < n; i++) {
+            acc = MAX(acc, x[i] & keep[i]);
+        }
+        break;
+    case PROG_REDUCE_COUNT:
+        for (i = 0; i < n; i++) {
+            acc += keep[i] & 1;
+        }
+        break;
+    }
+
+    return acc;
+}
+
+/**
+ * @brief Run @prog over @n elements of @x, an instruction at a time over the
+ * whole chunk so every step is a vector loop. Dropped elements stay in @x
+ * with their @keep lane cleared.
+ *
+ * @emitted: number of elements packed at @out.
+ */
+static void _prog_exec(const c_pci_prog *prog, uint32_t *x, uint32_t *keep,
+                       uint32_t *out, uint32_t n, uint64_t *acc,
+                       uint32_t *emitted)
+{
+    uint32_t i;
+
+    memset(keep, 0xff, n * sizeof(uint32_t));
+    *emitted = 0;
+
+    for (i = 0; i < prog->_len; i++) {
+        uint32_t imm = prog->_imm[i];
+
+        switch (prog->_op[i]) {
+        case PROG_MAP_ADD:
+            _prog_add(x, imm, n);
+            break;
+        case PROG_MAP_SUB:
+            _prog_sub(x, imm, n);
+            break;
+        case PROG_MAP_MUL:
+            _prog_mul(x, imm, n);
+            break;
+        case PROG_MAP_AND:
+            _prog_and(x, imm, n);
+            break;
+        case PROG_MAP_OR:
+            _prog_or(x, imm, n);
+            break;
+        case PROG_MAP_XOR:
+            _prog_xor(x, imm, n);
+            break;
+        case PROG_MAP_SHL:
+            _prog_shl(x, imm, n);
+            break;
+        case PROG_MAP_SHR:
+            _prog_shr(x, imm, n);
+            break;
+        case PROG_MAP_MIN:
+        case PROG_MAP_MAX:
+            _prog_min_max(x, imm, prog->_op[i] == PROG_MAP_MAX, n);
+            break;
+        case PROG_FILTER_EQ:
+            _prog_eq(x, keep, imm, n);
+            break;
+        case PROG_FILTER_NE:
+            _prog_ne(x, keep, imm, n);
+            break;
+        case PROG_FILTER_LT:
+            _prog_lt(x, keep, imm, n);
+            break;
+        case PROG_FILTER_LE:
+            _prog_le(x, keep, imm, n);
+            break;
+        case PROG_FILTER_GT:
+            _prog_gt(x, keep, imm, n);
+            break;
+        case PROG_FILTER_GE:
+            _prog_ge(x, keep, imm, n);
+            break;
+        case PROG_FILTER_ANY:
+            _prog_any(x, keep, imm, n);
+            break;
+        case PROG_EMIT:
+            *emitted = _prog_emit(x, keep, out, n);
+            break;
+        default:
+            *acc = _prog_reduce(prog->_op[i], x, keep, *acc, n);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief OPCODE_PROG_RUN, stream the input through a program BATCH_CHUNK
+ * elements at a time, using the batch buffers.
+ *
+ * @result: number of elements emitted.
+ * @return CQE status code.
+ */
+static uint16_t _prog_run(_pci_device_object *_pci_dev,
+                          const c_pci_sqe *sqe,
+                          uint32_t *result)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    uint32_t slot = le32_to_cpu(sqe->_op1);
+    uint32_t count = le32_to_cpu(sqe->_len);
+    dma_addr_t src = le64_to_cpu(sqe->_src);
+    dma_addr_t dst = le64_to_cpu(sqe->_dst);
+    dma_addr_t aux = le64_to_cpu(sqe->_aux);
+    uint32_t *x = _pci_dev->_batch_buf[0];
+    uint32_t *keep = _pci_dev->_batch_buf[1];
+    uint32_t *out = _pci_dev->_batch_buf[2];
+    uint8_t reduce = 0;
+    uint32_t done = 0;
+    c_pci_prog prog;
+    uint64_t acc = 0;
+
+    *result = 0;
+
+    if (slot >= PROG_SLOTS) {
+        return CQE_STS_INVALID_FIELD;
+    }
+
+    /* A load may replace the program while we run, take a copy. */
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        prog = _pci_dev->_progs[slot];
+    }
+    if (prog._len == 0) {
+        return CQE_STS_INVALID_FIELD;
+    }
+
+    if (prog._op[prog._len - 1] >= PROG_REDUCE_SUM) {
+        reduce = prog._op[prog._len - 1];
+        if (le32_to_cpu(sqe->_op2) & PROG_RUN_F_CONTINUE) {
+            if (pci_dma_read(dev, aux, &acc, sizeof(acc)) != MEMTX_OK) {
+                stat64_inc(&_pci_dev->_stats._dma_errors);
+                return CQE_STS_DMA_ERROR;
+            }
+            acc = le64_to_cpu(acc);
+        } else if (reduce == PROG_REDUCE_MIN) {
+            acc = UINT32_MAX;
+        }
+    }
+
+    while (done < count) {
+        uint32_t n = MIN(count - done, BATCH_CHUNK);
+        uint32_t emitted;
+
+        if (pci_dma_read(dev, src + (dma_addr_t)done * sizeof(uint32_t), x,
+                         n * sizeof(uint32_t)) != MEMTX_OK) {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            return CQE_STS_DMA_ERROR;
+        }
+        _batch_swap(x, n);
+
+        _prog_exec(&prog, x, keep, out, n, &acc, &emitted);
+
+        _batch_swap(out, emitted);
+        if (emitted &&
+            pci_dma_write(dev, dst + (dma_addr_t)*result * sizeof(uint32_t),
+                          out, emitted * sizeof(uint32_t)) != MEMTX_OK) {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            return CQE_STS_DMA_ERROR;
+        }
+
+        stat64_add(&_pci_dev->_stats._dma_bytes_to_device,
+                   n * sizeof(uint32_t));
+        stat64_add(&_pci_dev->_stats._dma_bytes_from_device,
+                   emitted * sizeof(uint32_t));
+        *result += emitted;
+        done += n;
+    }
+
+    if (reduce && stq_le_pci_dma(dev, aux, acc,
+                                 MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return CQE_STS_DMA_ERROR;
+    }
+
+    stat64_add(&_pci_dev->_stats._prog_elements, count);
+    trace_c_pci_dev_prog_run(slot, count, *result, acc);
+
+    return CQE_STS_SUCCESS;
+}
+
+/**
+ * @brief Host vector of bytes, one lane per position scanned.
+ */
+typedef uint8_t search_vec __attribute__((vector_size(16)));
+
+#define SEARCH_LANES sizeof(search_vec)
+
+/**
+ * @brief Matches of a search, written back to the guest SEARCH_MATCH_BATCH
+ * at a time.
+ */
+typedef struct c_pci_search_out {
+    PCIDevice *_dev;
+    dma_addr_t _dst;
+    uint32_t _room;
+    uint32_t _written;
+    uint32_t _pending;
+    uint32_t _found;
+    bool _failed;
+    c_pci_match _buf[SEARCH_MATCH_BATCH];
+} c_pci_search_out;
+
+static void _search_flush(c_pci_search_out *out)
+{
+    if (out->_pending &&
+        pci_dma_write(out->_dev,
+                      out->_dst + (dma_addr_t)out->_written * sizeof(c_pci_match),
+                      out->_buf,
+                      out->_pending * sizeof(c_pci_match)) != MEMTX_OK) {
+        out->_failed = true;
+    }
+
+    out->_written += out->_pending;
+    out->_pending = 0;
+}
+
+static void _search_report(c_pci_search_out *out, uint32_t offset,
+                           uint32_t pattern)
+{
+    if (out->_written + out->_pending < out->_room) {
+        out->_buf[out->_pending]._offset = cpu_to_le32(offset);
+        out->_buf[out->_pending]._pattern = cpu_to_le32(pattern);
+        if (++out->_pending == SEARCH_MATCH_BATCH) {
+            _search_flush(out);
+        }
+    }
+
+    if (out->_found < UINT32_MAX) {
+        out->_found++;
+    }
+}
+
+/**
+ * @brief Prefilter of @pat over the SEARCH_LANES positions at @p: bit N is
+ * set if the first and the last byte of @pat match at position N. Two vector
+ * compares reject most positions, the survivors are checked in full.
+ * SEARCH_LANES + the pattern length - 1 bytes at @p must be readable.
+ */
+static uint32_t _search_candidates(const uint8_t *p, const c_pci_pattern *pat)
+{
+    search_vec head, tail, hit;
+    uint64_t any[2];
+    uint32_t mask = 0;
+    uint32_t i;
+
+    memcpy(&head, p, SEARCH_LANES);
+    memcpy(&tail, p + pat->_len - 1, SEARCH_LANES);
+    hit = (search_vec)(head == pat->_bytes[0]) &
+          (search_vec)(tail == pat->_bytes[pat->_len - 1]);
+
+    memcpy(any, &hit, sizeof(any));
+    if (!(any[0] | any[1])) {
+        return 0;
+    }
+
+    for (i = 0; i < SEARCH_LANES; i++) {
+        mask |= (uint32_t)(hit[i] & 1) << i;
+    }
+
+    return mask;
+}
+
+/**
+ * @brief Report the matches starting in the first @scan of the @n bytes at
+ * @buf, @base is the offset of @buf in the searched buffer.
+ */
+static void _search_scan(const uint8_t *buf, uint32_t n, uint32_t scan,
+                         const c_pci_pattern *pats, uint32_t npat,
+                         uint32_t maxlen, uint32_t base,
+                         c_pci_search_out *out)
+{
+    uint32_t cand[SEARCH_MAX_PATTERNS];
+    uint32_t p = 0;
+    uint32_t i;
+
+    for (; p < scan && p + SEARCH_LANES + maxlen - 1 <= n; p += SEARCH_LANES) {
+        uint32_t any = 0;
+
+        for (i = 0; i < npat; i++) {
+            cand[i] = _search_candidates(buf + p, &pats[i]);
+            any |= cand[i];
+        }
+        if (scan - p < SEARCH_LANES) {
+            any &= (1u << (scan - p)) - 1;
+        }
+
+        while (any) {
+            uint32_t lane = ctz32(any);
+
+            any &= any - 1;
+            for (i = 0; i < npat; i++) {
+                if ((cand[i] & BIT(lane)) &&
+                    memcmp(buf + p + lane, pats[i]._bytes, pats[i]._len) == 0) {
+                    _search_report(out, base + p + lane, i);
+                }
+            }
+        }
+    }
+
+    /* Tail, too close to the end of @buf for the vector loads. */
+    for (; p < scan; p++) {
+        for (i = 0; i < npat; i++) {
+            if (p + pats[i]._len <= n &&
+                memcmp(buf + p, pats[i]._bytes, pats[i]._len) == 0) {
+                _search_report(out, base + p, i);
+            }
+        }
+    }
+}
+
+/**
+ * @brief OPCODE_SEARCH. Device memory is scanned in place, guest memory
+ * SEARCH_CHUNK bytes at a time through a bounce buffer, each step with the
+ * bytes a match starting in it can reach.
+ *
+ * @result: number of matches.
+ * @return CQE status code.
+ */
+static uint16_t _search_exec(_pci_device_object *_pci_dev,
+                             const c_pci_sqe *sqe,
+                             uint32_t *result)
+{
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    bool devmem = sqe->_flags & SQE_F_DEVMEM;
+    uint32_t npat = extract32(le32_to_cpu(sqe->_op1), 0, 16);
+    uint64_t avail = le32_to_cpu(sqe->_len) +
+                     (uint64_t)extract32(le32_to_cpu(sqe->_op1), 16, 16);
+    uint64_t len = le32_to_cpu(sqe->_len);
+    dma_addr_t src = le64_to_cpu(sqe->_src);
+    g_autofree c_pci_pattern *pats = NULL;
+    g_autofree uint8_t *bounce = NULL;
+    g_autofree c_pci_search_out *out = NULL;
+    uint32_t maxlen = 0;
+    uint64_t off;
+    uint32_t i;
+
+    *result = 0;
+
+    if (npat == 0 || npat > SEARCH_MAX_PATTERNS) {
+        return CQE_STS_INVALID_FIELD;
+    }
+
+    pats = g_new(c_pci_pattern, npat);
+    if (pci_dma_read(dev, le64_to_cpu(sqe->_aux), pats,
+                     npat * sizeof(c_pci_pattern)) != MEMTX_OK) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return CQE_STS_DMA_ERROR;
+    }
+
+    for (i = 0; i < npat; i++) {
+        if (pats[i]._len == 0 || pats[i]._len > SEARCH_MAX_PATTERN_LEN) {
+            return CQE_STS_INVALID_FIELD;
+        }
+        maxlen = MAX(maxlen, pats[i]._len);
+    }
+
+    /* Bytes past `len` only matter up to the longest pattern. */
+    avail = MIN(avail, len + maxlen - 1);
+
+    if (devmem) {
+        if (src > _pci_dev->_big_mem_size ||
+            avail > _pci_dev->_big_mem_size - src) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: search of 0x%" PRIx64 " bytes at 0x%"
+                          PRIx64 " out of device memory\n", avail, src);
+            return CQE_STS_INVALID_FIELD;
+        }
+    } else {
+        bounce = g_malloc(SEARCH_CHUNK + SEARCH_MAX_PATTERN_LEN - 1);
+    }
+
+    out = g_new0(c_pci_search_out, 1);
+    out->_dev = dev;
+    out->_dst = le64_to_cpu(sqe->_dst);
+    out->_room = le32_to_cpu(sqe->_op2);
+
+    for (off = 0; off < len; off += SEARCH_CHUNK) {
+        uint32_t scan = MIN(len - off, SEARCH_CHUNK);
+        uint32_t n = MIN(avail - off, scan + maxlen - 1);
+        const uint8_t *buf = bounce;
+
+        if (devmem) {
+            buf = _pci_dev->_big_mem_bar + src + off;
+        } else if (pci_dma_read(dev, src + off, bounce, n) != MEMTX_OK) {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            return CQE_STS_DMA_ERROR;
+        }
+
+        _search_scan(buf, n, scan, pats, npat, maxlen, off, out);
+    }
+
+    _search_flush(out);
+    if (out->_failed) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return CQE_STS_DMA_ERROR;
+    }
+
+    stat64_add(&_pci_dev->_stats._search_bytes, len);
+    trace_c_pci_dev_search(len, npat, out->_found);
+    *result = out->_found;
+
+    return CQE_STS_SUCCESS;
+}
+
+/**
+ * @brief Execute one submission queue entry.
+ *
+ * @result: CQE result, the scalar result or the number of computed lanes.
+ * @return CQE status code.
+ */
+static uint16_t _qp_exec(_pci_device_object *_pci_dev,
+                         const c_pci_sqe *sqe,
+                         uint32_t *result)
+{
+    uint32_t status;
+
+    switch (sqe->_opcode) {
+    case OPCODE_SHA256:
+        return _hash_exec(_pci_dev, sqe, result);
+    case OPCODE_PROG_LOAD:
+        return _prog_load(_pci_dev, sqe, result);
+    case OPCODE_PROG_RUN:
+        return _prog_run(_pci_dev, sqe, result);
+    case OPCODE_SEARCH:
+        return _search_exec(_pci_dev, sqe, result);
+    default:
+        break;
+    }
+
+    if (!(sqe->_flags & SQE_F_VECTOR)) {
+        return _pci_dev_alu(_pci_dev,
+                            sqe->_opcode,
+                            le32_to_cpu(sqe->_op1),
+                            le32_to_cpu(sqe->_op2),
+                            result);
+    }
+
+    status = _batch_exec(_pci_dev,
+                         sqe->_opcode,
+                         le64_to_cpu(sqe->_src),
+                         le64_to_cpu(sqe->_aux),
+                         le64_to_cpu(sqe->_dst),
+                         le32_to_cpu(sqe->_len),
+                         result);
+
+    if (sqe->_opcode >= OPCODE_NR) {
+        return CQE_STS_INVALID_OPCODE;
+    }
+    if (status & BATCH_STS_ERROR) {
+        return CQE_STS_DMA_ERROR;
+    }
+    if (status & BATCH_STS_DIV_ZERO) {
+        return CQE_STS_DIV_ZERO;
+    }
+
+    return CQE_STS_SUCCESS;
+}
+
+/**
+ * @brief Bytes moved and operations run by a submission entry, for the timing
+ * model.
+ */
+static void _qp_cost(_pci_device_object *_pci_dev,
+                     const c_pci_sqe *sqe,
+                     uint64_t *bytes,
+                     uint64_t *ops)
+{
+    uint32_t len = le32_to_cpu(sqe->_len);
+    g_autofree c_pci_sg *sgl = NULL;
+    uint32_t i;
+
+    *bytes = 0;
+    *ops = 1;
+
+    /* Programs: elements in and out, one operation per element. */
+    switch (sqe->_opcode) {
+    case OPCODE_PROG_LOAD:
+        *bytes = (uint64_t)len * sizeof(c_pci_insn);
+        return;
+    case OPCODE_PROG_RUN:
+        *bytes = (uint64_t)len * 2 * sizeof(uint32_t);
+        *ops = len;
+        return;
+    case OPCODE_SEARCH:
+        *bytes = len;
+        return;
+    default:
+        break;
+    }
+
+    if (sqe->_opcode != OPCODE_SHA256) {
+        if (sqe->_flags & SQE_F_VECTOR) {
+            *bytes = (uint64_t)len * 3 * sizeof(uint32_t);
+            *ops = len;
+        }
+        return;
+    }
+
+    if (!(sqe->_flags & SQE_F_SGL)) {
+        *bytes = len;
+        return;
+    }
+
+    /* Invalid lists are rejected by the hash engine, they cost the command
+     * latency only. */
+    if (len == 0 || len > HASH_MAX_SEGMENTS) {
+        return;
+    }
+
+    sgl = g_new(c_pci_sg, len);
+    if (pci_dma_read(&_pci_dev->_pci_dev, le64_to_cpu(sqe->_src), sgl,
+                     len * sizeof(*sgl)) != MEMTX_OK) {
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        *bytes += le32_to_cpu(sgl[i]._len);
+    }
+}
+
+/**
+ * @brief Queue pair bottom half. Executes entries from SQ head to SQ tail in
+ * order and posts one completion per entry, as long as the completion queue
+ * has room. The compute vector is signalled once per run.
+ */
+static void _qp_bh(void *opaque)
+{
+    c_pci_qp *qp = (c_pci_qp *)opaque;
+    _pci_device_object *_pci_dev = qp->_owner;
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    uint32_t error = 0;
+    bool posted = false;
+
+    for (;;)
+    {
+        dma_addr_t sq_base, cq_base;
+        uint32_t sq_idx, sq_head, cq_tail, cq_next, gen;
+        bool phase;
+        c_pci_sqe sqe;
+        c_pci_cqe cqe;
+        uint32_t result = 0;
+        uint64_t bytes, ops;
+        uint16_t status;
+        bool pushed;
+
+        /* Pick up the next entry. Completion queue full, we go on when the
+         * driver moves CQ head. */
+        qemu_mutex_lock(&_pci_dev->_lock);
+        if (qp->_size == 0 || qp->_sq_head == qp->_sq_tail ||
+            (qp->_cq_tail + 1) % qp->_size == qp->_cq_head) {
+            qemu_mutex_unlock(&_pci_dev->_lock);
+            _timing_idle(&qp->_timing);
+            break;
+        }
+        sq_base = qp->_sq_base;
+        cq_base = qp->_cq_base;
+        sq_idx = qp->_sq_head;
+        sq_head = (sq_idx + 1) % qp->_size;
+        cq_tail = qp->_cq_tail;
+        cq_next = (cq_tail + 1) % qp->_size;
+        phase = qp->_phase;
+        gen = qp->_gen;
+        pushed = qp->_push_mask[sq_idx] == QP_PUSH_FULL;
+        if (pushed) {
+            sqe = qp->_push_sq[sq_idx];
+        }
+        qemu_mutex_unlock(&_pci_dev->_lock);
+
+        if (!pushed &&
+            pci_dma_read(dev,
+                         sq_base + (dma_addr_t)sq_idx * sizeof(sqe),
+                         &sqe,
+                         sizeof(sqe)) != MEMTX_OK)
+        {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: failed to fetch SQE %u of queue %u\n",
+                          sq_idx, qp->_index);
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            error = ERR_DMA;
+            break;
+        }
+
+        if (_timing_enabled(_pci_dev)) {
+            _qp_cost(_pci_dev, &sqe, &bytes, &ops);
+            if (!_timing_due(_pci_dev,
+                             &qp->_timing,
+                             (uint64_t)gen << 32 | sq_idx,
+                             bytes,
+                             ops)) {
+                break;
+            }
+        }
+
+        status = _qp_exec(_pci_dev, &sqe, &result);
+
+        memset(&cqe, 0, sizeof(cqe));
+        cqe._result = cpu_to_le32(result);
+        cqe._sq_head = cpu_to_le16(sq_head);
+        cqe._cid = sqe._cid;
+        cqe._status = cpu_to_le16(CQE_STATUS(status, phase));
+
+        if (pci_dma_write(dev,
+                          cq_base + (dma_addr_t)cq_tail * sizeof(cqe),
+                          &cqe,
+                          sizeof(cqe)) != MEMTX_OK)
+        {
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            error = ERR_DMA;
+            break;
+        }
+
+        trace_c_pci_dev_qp_complete(qp->_index, le16_to_cpu(sqe._cid), status);
+
+        /* The phase bit flips every time the completion queue wraps, so the
+         * driver tells new entries from old ones without reading a register.
+         * A reset while we ran discards the entry. */
+        WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+            if (qp->_gen == gen) {
+                qp->_push_mask[sq_idx] = 0;
+                qp->_sq_head = sq_head;
+                qp->_cq_tail = cq_next;
+                if (qp->_cq_tail == 0) {
+                    qp->_phase = !qp->_phase;
+                }
+                posted = true;
+            }
+        }
+    }
+
+    if (posted || error) {
+        _pci_dev_notify(_pci_dev, error, posted ? IRQ_SRC_COMPUTE : -1);
+    }
+}
+
+/**
+ * @brief Reset a queue pair, after a change of its geometry.
+ */
+static void _qp_reset(c_pci_qp *qp)
+{
+    qp->_sq_head = 0;
+    qp->_sq_tail = 0;
+    qp->_cq_head = 0;
+    qp->_cq_tail = 0;
+    qp->_phase = true;
+    qp->_gen++;
+    memset(qp->_push_mask, 0, QP_MAX_ENTRIES * sizeof(uint16_t));
+}
+
+static uint64_t _qp_mmio_read(_pci_device_object *_pci_dev, hwaddr addr,
+                              unsigned size)
+{
+    c_pci_qp *qp = &_pci_dev->_qp[(addr - REG_QP_BASE) / QP_STRIDE];
+    hwaddr reg = (addr - REG_QP_BASE) % QP_STRIDE;
+
+    switch (reg)
+    {
+    case QP_REG_SQ_BASE:
+    case QP_REG_SQ_BASE + 4:
+        return _pci_dev_reg64_read(qp->_sq_base, reg, size);
+    case QP_REG_CQ_BASE:
+    case QP_REG_CQ_BASE + 4:
+        return _pci_dev_reg64_read(qp->_cq_base, reg, size);
+    case QP_REG_SIZE:
+        return qp->_size;
+    case QP_REG_SQ_TAIL:
+        return qp->_sq_tail;
+    case QP_REG_SQ_HEAD:
+        return qp->_sq_head;
+    case QP_REG_CQ_HEAD:
+        return qp->_cq_head;
+    default:
+        break;
+    }
+
+    return ~0ULL;
+}
+
+static void _qp_mmio_write(_pci_device_object *_pci_dev, hwaddr addr,
+                           uint64_t val, unsigned size)
+{
+    c_pci_qp *qp = &_pci_dev->_qp[(addr - REG_QP_BASE) / QP_STRIDE];
+    hwaddr reg = (addr - REG_QP_BASE) % QP_STRIDE;
+
+    switch (reg)
+    {
+    case QP_REG_SQ_BASE:
+    case QP_REG_SQ_BASE + 4:
+        _pci_dev_reg64_write(&qp->_sq_base, reg, val, size);
+        _qp_reset(qp);
+        break;
+    case QP_REG_CQ_BASE:
+    case QP_REG_CQ_BASE + 4:
+        _pci_dev_reg64_write(&qp->_cq_base, reg, val, size);
+        _qp_reset(qp);
+        break;
+    case QP_REG_SIZE:
+        if (val == 1 || val > QP_MAX_ENTRIES) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: queue size %" PRIu64 " invalid\n", val);
+            break;
+        }
+        qp->_size = val;
+        _qp_reset(qp);
+        break;
+    case QP_REG_SQ_TAIL:
+        if (val >= qp->_size) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: SQ tail %" PRIu64 " out of queue\n", val);
+            break;
+        }
+        qp->_sq_tail = val;
+        qemu_bh_schedule(qp->_bh);
+        break;
+    case QP_REG_CQ_HEAD:
+        if (val >= qp->_size) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: CQ head %" PRIu64 " out of queue\n", val);
+            break;
+        }
+        qp->_cq_head = val;
+        /* Room in the completion queue, resume a stalled submission queue. */
+        if (qp->_sq_head != qp->_sq_tail) {
+            qemu_bh_schedule(qp->_bh);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static uint64_t _pci_dev_push_read(void *opaque, hwaddr addr, unsigned size)
+{
+    return 0;
+}
+
+/**
+ * @brief Store a part of an entry pushed through the submission BAR. Once the
+ * entry at SQ tail is complete, the tail moves over it and every complete
+ * entry behind it, as if the driver had rung the doorbell.
+ */
+static void _pci_dev_push_write(void *opaque, hwaddr addr, uint64_t val,
+                                unsigned size)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+    uint32_t index = addr / QP_PUSH_STRIDE;
+    uint32_t slot = (addr % QP_PUSH_STRIDE) / sizeof(c_pci_sqe);
+    uint32_t offset = addr % sizeof(c_pci_sqe);
+    uint32_t tail;
+    c_pci_qp *qp;
+
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    stat64_inc(&_pci_dev->_stats._mmio_writes);
+
+    if (index >= _pci_dev->_nr_qps || slot >= _pci_dev->_qp[index]._size) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: push to slot %u of queue %u out of queue\n",
+                      slot, index);
+        return;
+    }
+
+    qp = &_pci_dev->_qp[index];
+    stn_le_p((uint8_t *)&qp->_push_sq[slot] + offset, size, val);
+    qp->_push_mask[slot] |= ((1 << (size / 4)) - 1) << (offset / 4);
+
+    /* One slot stays free, a full queue must not look empty. */
+    tail = qp->_sq_tail;
+    while (qp->_push_mask[tail] == QP_PUSH_FULL &&
+           (tail + 1) % qp->_size != qp->_sq_head) {
+        tail = (tail + 1) % qp->_size;
+    }
+
+    if (tail != qp->_sq_tail) {
+        qp->_sq_tail = tail;
+        qemu_bh_schedule(qp->_bh);
+    }
+}
+
+static uint64_t _pci_dev_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+    uint64_t res = ~0ULL;
+
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    if (addr >= REG_QP_BASE &&
+        addr < REG_QP_BASE + _pci_dev->_nr_qps * QP_STRIDE) {
+        res = _qp_mmio_read(_pci_dev, addr, size);
+        stat64_inc(&_pci_dev->_stats._mmio_reads);
+        trace_c_pci_dev_mmio_read(addr, size, res);
+        return res;
+    }
+
+    if (addr >= REG_TAG_RESULT && addr < REG_TAG_RESULT + TAG_NR * 4) {
+        res = _pci_dev->_tag_result[(addr - REG_TAG_RESULT) / 4];
+        stat64_inc(&_pci_dev->_stats._mmio_reads);
+        trace_c_pci_dev_mmio_read(addr, size, res);
+        return res;
+    }
+
+    switch (addr)
+    {
+    case REG_OP1:
+        res = _pci_dev->_operand_1;
+        break;
+    case REG_OP2:
+        res = _pci_dev->_operand_2;
+        break;
+    case REG_OPCODE:
+        res = _pci_dev->_opcode;
+        break;
+    case REG_RESULT:
+        res = _pci_dev->_result;
+        break;
+    case REG_ERROR:
+        res = _pci_dev->_error;
+        break;
+    case REG_DMA_CHANNELS:
+        res = _pci_dev->_dma_channels;
+        break;
+    case REG_BATCH_STATUS:
+        res = _pci_dev->_batch_status;
+        break;
+    case REG_QUEUES:
+        res = _pci_dev->_nr_qps;
+        break;
+    case REG_BATCH_OP1:
+    case REG_BATCH_OP1 + 4:
+        res = _pci_dev_reg64_read(_pci_dev->_batch_op1, addr, size);
+        break;
+    case REG_BATCH_OP2:
+    case REG_BATCH_OP2 + 4:
+        res = _pci_dev_reg64_read(_pci_dev->_batch_op2, addr, size);
+        break;
+    case REG_BATCH_RES:
+    case REG_BATCH_RES + 4:
+        res = _pci_dev_reg64_read(_pci_dev->_batch_res, addr, size);
+        break;
+    case REG_BATCH_COUNT:
+        res = _pci_dev->_batch_count;
+        break;
+    case REG_BATCH_OPCODE:
+        res = _pci_dev->_batch_opcode;
+        break;
+    case REG_IRQ_STATUS:
+        res = _pci_dev->_irq_status;
+        break;
+    case REG_IRQ_MASK:
+        res = _pci_dev->_irq_mask;
+        break;
+    case REG_IRQ_COAL_COUNT:
+        res = _pci_dev->_irq_coal_count;
+        break;
+    case REG_IRQ_COAL_USEC:
+        res = _pci_dev->_irq_coal_usec;
+        break;
+    case REG_WB_BASE:
+    case REG_WB_BASE + 4:
+        res = _pci_dev_reg64_read(_pci_dev->_wb_base, addr, size);
+        break;
+    case REG_TIMESTAMP:
+    case REG_TIMESTAMP + 4:
+        res = _pci_dev_reg64_read(qemu_clock_get_ns(TIMESTAMP_CLOCK),
+                                  addr,
+                                  size);
+        break;
+    case REG_TAG_OPS:
+    case REG_TAG_OPS + 4:
+        res = _pci_dev_reg64_read(_pci_dev->_tag_operands, addr, size);
+        break;
+    case REG_TAG_DONE:
+        res = _pci_dev->_tag_done;
+        break;
+    case REG_TAG_ERROR:
+        res = _pci_dev->_tag_error;
+        break;
+    default:
+
+        break;
+    }
+
+    stat64_inc(&_pci_dev->_stats._mmio_reads);
+    trace_c_pci_dev_mmio_read(addr, size, res);
+    return res;
+}
+
+static void _pci_dev_mmio_write(void *opaque, hwaddr addr, uint64_t val,
+                unsigned size)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    stat64_inc(&_pci_dev->_stats._mmio_writes);
+    trace_c_pci_dev_mmio_write(addr, size, val);
+
+    if (addr >= REG_QP_BASE &&
+        addr < REG_QP_BASE + _pci_dev->_nr_qps * QP_STRIDE) {
+        _qp_mmio_write(_pci_dev, addr, val, size);
+        return;
+    }
+
+    switch (addr)
+    {
+    case REG_OP1:
+        _pci_dev->_operand_1 = val;
+        break;
+    case REG_OP2:
+        _pci_dev->_operand_2 = val;
+        break;
+    case REG_OPCODE:
+        _pci_dev->_opcode = val;
+        if (_timing_enabled(_pci_dev)) {
+            /* The registers hold one operation, a new opcode replaces the
+             * pending one. The operands are read when it is due. */
+            _pci_dev->_compute_timing._busy_until = 0;
+            _timing_idle(&_pci_dev->_compute_timing);
+            timer_mod(_pci_dev->_compute_timing._timer,
+                      _timing_charge(_pci_dev,
+                                     &_pci_dev->_compute_timing,
+                                     0,
+                                     1));
+            break;
+        }
+        _pci_dev_compute(_pci_dev);
+        break;
+    case REG_ERROR:
+        _pci_dev->_error &= ~val;
+        _pci_dev_writeback(_pci_dev);
+        break;
+    case REG_BATCH_STATUS:
+        _pci_dev->_batch_status &= ~(val & (BATCH_STS_DONE |
+                                            BATCH_STS_ERROR |
+                                            BATCH_STS_DIV_ZERO));
+        _pci_dev_writeback(_pci_dev);
+        break;
+    case REG_BATCH_OP1:
+    case REG_BATCH_OP1 + 4:
+        _pci_dev_reg64_write(&_pci_dev->_batch_op1, addr, val, size);
+        break;
+    case REG_BATCH_OP2:
+    case REG_BATCH_OP2 + 4:
+        _pci_dev_reg64_write(&_pci_dev->_batch_op2, addr, val, size);
+        break;
+    case REG_BATCH_RES:
+    case REG_BATCH_RES + 4:
+        _pci_dev_reg64_write(&_pci_dev->_batch_res, addr, val, size);
+        break;
+    case REG_BATCH_COUNT:
+        _pci_dev->_batch_count = val;
+        break;
+    case REG_BATCH_OPCODE:
+        if (_pci_dev->_batch_status & BATCH_STS_BUSY) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: batch doorbell while busy\n");
+            break;
+        }
+        _pci_dev->_batch_opcode = val;
+        _pci_dev->_batch_status = BATCH_STS_BUSY;
+        qemu_bh_schedule(_pci_dev->_batch_bh);
+        break;
+    case REG_IRQ_STATUS:
+        /* Acknowledged events are consumed, held back ones included. */
+        _pci_dev->_irq_status &= ~val;
+        _pci_dev->_irq_pending &= ~val;
+        _pci_dev_update_intx(_pci_dev);
+        _pci_dev_writeback(_pci_dev);
+        break;
+    case REG_IRQ_MASK:
+        _pci_dev->_irq_mask = val & MAKE_64BIT_MASK(0, IRQ_SRC_NR);
+        _pci_dev_flush_irqs(_pci_dev);
+        _pci_dev_update_intx(_pci_dev);
+        break;
+    case REG_IRQ_COAL_COUNT:
+        _pci_dev->_irq_coal_count = val;
+        _pci_dev_flush_irqs(_pci_dev);
+        break;
+    case REG_IRQ_COAL_USEC:
+        _pci_dev->_irq_coal_usec = MIN(val, IRQ_COAL_MAX_USEC);
+        _pci_dev_flush_irqs(_pci_dev);
+        break;
+    case REG_WB_BASE:
+    case REG_WB_BASE + 4:
+        _pci_dev_reg64_write(&_pci_dev->_wb_base, addr, val, size);
+        _pci_dev_writeback(_pci_dev);
+        break;
+    case REG_TAG_OPS:
+    case REG_TAG_OPS + 4:
+        _pci_dev_reg64_write(&_pci_dev->_tag_operands, addr, val, size);
+        break;
+    case REG_TAG_CMD:
+        _tag_push(_pci_dev, val);
+        break;
+    case REG_TAG_DONE:
+        _pci_dev->_tag_done &= ~val;
+        _pci_dev_writeback(_pci_dev);
+        break;
+    case REG_TAG_ERROR:
+        _pci_dev->_tag_error &= ~val;
+        _pci_dev_writeback(_pci_dev);
+        break;
+    }
+}
+
+static uint64_t _pci_dev_dma_mmio_read(void *opaque, hwaddr addr, unsigned size)
+{
+    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
+    uint32_t chan = addr / DMA_CHAN_STRIDE;
+    dma_channel *ch = &_pci_dev->_dma_chan[chan];
+    uint64_t res = 0xffffffffffffffL;
+
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    stat64_inc(&_pci_dev->_stats._dma_mmio_reads);
+
+    if (chan >= _pci_dev->_dma_channels) {
+        return res;
+    }
+
+    switch (addr % DMA_CHAN_STRIDE)
+    {
+    case DMA_REG_RING_BASE:
+        res = ch->_ring_base;
+        break;
+    case DMA_REG_RING_SIZE:
+        res = ch->_ring_size;
+        break;
+    case DMA_REG_RING_HEAD:
+        res = ch->_ring_head;
+        break;
+    case DMA_REG_RING_TAIL:
+        res = ch->_ring_tail;
+        break;
+    case DMA_REG_STATUS:
+        res = ch->_status;
+        break;
+    case DMA_REG_COMPLETED:
+        res = ch->_completed;
+        break;
+    case DMA_REG_CSUM:
+        res = ch->_csum;
+        break;
+    case DMA_REG_SRC64:
+    case DMA_REG_SRC64 + 4:
+        res = _pci_dev_reg64_read(ch->_src, addr, size);
+        break;
+    case DMA_REG_DST64:
+    case DMA_REG_DST64 + 4:
+        res = _pci_dev_reg64_read(ch->_dst, addr, size);
+        break;
+    case DMA_REG_LEN64:
+    case DMA_REG_LEN64 + 4:
+        res = _pci_dev_reg64_read(ch->_len, addr, size);
+        break;
+    case DMA_REG_RING_BASE64:
+    case DMA_REG_RING_BASE64 + 4:
+        res = _pci_dev_reg64_read(ch->_ring_base, addr, size);
+        break;
+    default:
+        break;
+    }
+
+    trace_c_pci_dev_dma_mmio_read(chan, addr % DMA_CHAN_STRIDE, res);
+    return res;
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief CRC32C with the SSE4.2 crc32 instruction, 8 bytes per instruction.
+ */
+static uint32_t __attribute__((target("sse4.2")))
+_crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t crc64 = crc;
+
+    while (len >= sizeof(uint64_t)) {
+        crc64 = _mm_crc32_u64(crc64, ldq_le_p(buf));
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    crc = crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *buf++);
+    }
+
+    return crc;
+}
+#endif
+
+/* Host CPU has the SSE4.2 crc32 instruction, probed once in class_init. */
+static bool _have_crc32c_insn;
+
+/**
+ * @brief Running CRC32C (Castagnoli), without the final inversion, like
+ * crc32c() of QEMU which is the fallback.
+ */
+static uint32_t _crc32c(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#if defined(__x86_64__)
+    if (_have_crc32c_insn) {
+        return _crc32c_sse42(crc, buf, len);
+    }
+#endif
+
+    return crc32c(crc, buf, len);
+}
+
+static uint32_t _dma_csum_init(uint32_t type)
+{
+    return type == DMA_CSUM_CRC32C ? 0xffffffff : crc32(0L, Z_NULL, 0);
+}
+
+static uint32_t _dma_csum_update(uint32_t type, uint32_t csum,
+                                 const uint8_t *buf, size_t len)
+{
+    switch (type) {
+    case DMA_CSUM_CRC32C:
+        return _crc32c(csum, buf, len);
+    case DMA_CSUM_CRC32:
+        /* zlib picks the fastest implementation for the host. */
+        return crc32(csum, buf, len);
+    default:
+        return csum;
+    }
+}
+
+static uint32_t _dma_csum_final(uint32_t type, uint32_t csum)
+{
+    return type == DMA_CSUM_CRC32C ? ~csum : csum;
+}
+
+/**
+ * @brief Check that [@offset, @offset + @len) is inside device memory.
+ */
+static bool _dma_dev_range_ok(_pci_device_object *_pci_dev,
+                              dma_addr_t offset,
+                              dma_addr_t len,
+                              const char *what)
+{
+    if (len > _pci_dev->_big_mem_size || offset > _pci_dev->_big_mem_size - len)
+    {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: DMA %s device memory out of bound, "
+                      "offset 0x%" PRIx64 " len 0x%" PRIx64 "\n",
+                      what, offset, len);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Move @len bytes between guest memory and the device memory.
+ *
+ * @dir: DMA_DIRECTION_TO_DEVICE: @src is a guest address, @dst is an offset in
+ *      device memory. DMA_DIRECTION_FROM_DEVICE: @src is an offset in device
+ *      memory, @dst is a guest address.
+ * @csum_type: DMA_CSUM_*, with a checksum the copy runs DMA_CSUM_CHUNK bytes
+ *      at a time and every chunk is checksummed right after its copy, so the
+ *      data is only brought into the cache once.
+ * @csum: running checksum, updated with the transferred bytes.
+ *
+ * @return true on success, false if the device memory range is out of bound or
+ *      the guest address could not be accessed.
+ */
+static bool _dma_do_transfer(_pci_device_object *_pci_dev,
+                             dma_addr_t src,
+                             dma_addr_t dst,
+                             dma_addr_t len,
+                             int dir,
+                             uint32_t csum_type,
+                             uint32_t *csum)
+{
+    dma_addr_t mem = dir == DMA_DIRECTION_TO_DEVICE ? dst : src;
+    dma_addr_t chunk = csum_type == DMA_CSUM_NONE ? len : DMA_CSUM_CHUNK;
+    dma_addr_t done = 0;
+    MemTxResult res = MEMTX_OK;
+
+    if (!_dma_dev_range_ok(_pci_dev, mem, len,
+                           dir == DMA_DIRECTION_TO_DEVICE ? "to" : "from")) {
+        return false;
+    }
+
+    while (done < len && res == MEMTX_OK)
+    {
+        dma_addr_t n = MIN(len - done, chunk);
+        uint8_t *buf = _pci_dev->_big_mem_bar + mem + done;
+
+        if (dir == DMA_DIRECTION_TO_DEVICE)
+        {
+            /* Read from address and store in buffer. This function start
+             * transfer from physical memory to device memory. */
+            res = pci_dma_read(&_pci_dev->_pci_dev,  // Device.
+                               src + done,           // Physical Memory Address.
+                               buf,                  // Device Memory Buffer Address.
+                               n);                   // Length.
+        } else
+        {
+            /* Write data in buffer to address. This function start transfer
+             * from device memory to physical memory (defined by dest). */
+            res = pci_dma_write(&_pci_dev->_pci_dev, // Device.
+                                dst + done,          // Physical Address.
+                                buf,                 // Device Memory Buffer Address.
+                                n);                  // Length.
+        }
+
+        if (csum_type != DMA_CSUM_NONE) {
+            *csum = _dma_csum_update(csum_type, *csum, buf, n);
+        }
+
+        done += n;
+    }
+
+    /* BAR1 is guest visible RAM, keep dirty tracking (migration, display)
+     * in sync with our writes. */
+    if (dir == DMA_DIRECTION_TO_DEVICE) {
+        memory_region_set_dirty(_pci_dev->_big_mem, dst, len);
+    }
+
+    if (res != MEMTX_OK) {
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
+
+    stat64_add(dir == DMA_DIRECTION_TO_DEVICE ?
+               &_pci_dev->_stats._dma_bytes_to_device :
+               &_pci_dev->_stats._dma_bytes_from_device,
+               len);
+    return true;
+}
+
+/**
+ * @brief Copy @len bytes from guest memory @src to guest memory @dst.
+ *
+ * RAM on both sides is mapped and copied directly, anything else (MMIO, a
+ * mapping cut short) goes through the scratch buffer of the channel.
+ */
+static bool _dma_do_copy(dma_channel *ch,
+                         dma_addr_t src,
+                         dma_addr_t dst,
+                         dma_addr_t len,
+                         uint32_t csum_type,
+                         uint32_t *csum)
+{
+    _pci_device_object *_pci_dev = ch->_owner;
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    dma_addr_t done = 0;
+
+    while (done < len)
+    {
+        dma_addr_t n = MIN(len - done, DMA_COPY_CHUNK);
+        dma_addr_t slen = n;
+        dma_addr_t dlen = n;
+        void *s = pci_dma_map(dev, src + done, &slen, DMA_DIRECTION_TO_DEVICE);
+        void *d = pci_dma_map(dev, dst + done, &dlen, DMA_DIRECTION_FROM_DEVICE);
+        bool mapped = s && d;
+
+        if (mapped) {
+            n = MIN(slen, dlen);
+            memcpy(d, s, n);
+            if (csum_type != DMA_CSUM_NONE) {
+                *csum = _dma_csum_update(csum_type, *csum, d, n);
+            }
+        }
+
+        if (s) {
+            pci_dma_unmap(dev, s, slen, DMA_DIRECTION_TO_DEVICE, mapped ? n : 0);
+        }
+        if (d) {
+            pci_dma_unmap(dev, d, dlen, DMA_DIRECTION_FROM_DEVICE, mapped ? n : 0);
+        }
+
+        if (!mapped)
+        {
+            if (pci_dma_read(dev, src + done, ch->_scratch, n) != MEMTX_OK ||
+                pci_dma_write(dev, dst + done, ch->_scratch, n) != MEMTX_OK) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "c_pci_dev: DMA copy 0x%" PRIx64 " -> 0x%" PRIx64
+                              " failed\n", src + done, dst + done);
+                stat64_inc(&_pci_dev->_stats._dma_errors);
+                return false;
+            }
+            if (csum_type != DMA_CSUM_NONE) {
+                *csum = _dma_csum_update(csum_type, *csum, ch->_scratch, n);
+            }
+        }
+
+        done += n;
+    }
+
+    stat64_add(&_pci_dev->_stats._dma_bytes_copied, len);
+    return true;
+}
+
+/**
+ * @brief Copy @len bytes inside device memory, the ranges may overlap.
+ */
+static bool _dma_do_dev_copy(_pci_device_object *_pci_dev,
+                             dma_addr_t src,
+                             dma_addr_t dst,
+                             dma_addr_t len,
+                             uint32_t csum_type,
+                             uint32_t *csum)
+{
+    uint8_t *mem = _pci_dev->_big_mem_bar;
+    dma_addr_t chunk = DMA_CSUM_CHUNK;
+    dma_addr_t done = 0;
+
+    if (!_dma_dev_range_ok(_pci_dev, src, len, "copy from") ||
+        !_dma_dev_range_ok(_pci_dev, dst, len, "copy to")) {
+        return false;
+    }
+
+    /* Chunks only keep the checksum cache hot, an overlapping move has to be
+     * done at once. */
+    if (csum_type == DMA_CSUM_NONE || ranges_overlap(src, len, dst, len)) {
+        chunk = len;
+    }
 
+    while (done < len)
+    {
+        dma_addr_t n = MIN(len - done, chunk);
 
-typedef struct _pci_device_object _pci_device_object;
+        memmove(mem + dst + done, mem + src + done, n);
+        if (csum_type != DMA_CSUM_NONE) {
+            *csum = _dma_csum_update(csum_type, *csum, mem + dst + done, n);
+        }
+        done += n;
+    }
 
-/**
- * @brief Construct a new declare instance checker object.
- * @InstanceType: instance struct name.
- * @OBJ_NAME: the object name is uppercase with underscore separtors.
- * @TYPENAME: type name.
- * 
- * Direct usage of this macro should be avoided, and the complete 
- * OBJECT_DECLARE_TYPE macro is recommended instead.
- * 
- * This macro will provide the instance type cast functions for a QOM type.
- */
-DECLARE_INSTANCE_CHECKER(_pci_device_object, C_PCI_DEV, TYPE_PCI_CUSTOM_DEVICE);
+    memory_region_set_dirty(_pci_dev->_big_mem, dst, len);
+    stat64_add(&_pci_dev->_stats._dma_bytes_copied, len);
+    return true;
+}
 
 /**
- * @brief This struct defining/descring the state of our pci device.
- * 
+ * @brief Fill @len bytes at @dst, guest memory or with @device device memory,
+ * with the 8 byte @pattern.
  */
-struct _pci_device_object {
-    PCIDevice _pci_dev;
+static bool _dma_do_fill(dma_channel *ch,
+                         uint64_t pattern,
+                         dma_addr_t dst,
+                         dma_addr_t len,
+                         bool device,
+                         uint32_t csum_type,
+                         uint32_t *csum)
+{
+    _pci_device_object *_pci_dev = ch->_owner;
+    dma_addr_t done = 0;
+    size_t i;
 
-    /* Test read/write large memory and also this region is used by 
-     * DMA controller like a device memory region. */
-    MemoryRegion _big_mem_region;
-    uint8_t _big_mem_bar[BIG_BAR_SIZE];
+    if (device && !_dma_dev_range_ok(_pci_dev, dst, len, "fill")) {
+        return false;
+    }
 
-    /* Test operators and interrupt. */
-    MemoryRegion _mmio;
-    uint32_t _operand_1;
-    uint32_t _operand_2;
-    uint32_t _opcode;
-    uint32_t _result;
-    uint32_t _error;
+    /* Chunks are a multiple of the pattern size, so every chunk starts at the
+     * first byte of the pattern. */
+    for (i = 0; i < DMA_COPY_CHUNK; i += sizeof(pattern)) {
+        stq_le_p(ch->_scratch + i, pattern);
+    }
 
-    /* Test DMA, to receive DMA command. */
-    MemoryRegion _dma;
-    struct dma_state {
-        dma_addr_t _cmd;
-        dma_addr_t _src;
-        dma_addr_t _dst;
-        dma_addr_t _len;
-    } _dma_state;
-};
+    while (done < len)
+    {
+        dma_addr_t n = MIN(len - done, DMA_COPY_CHUNK);
 
-static uint64_t _pci_dev_mmio_read(void *opaque, hwaddr addr, unsigned size)
+        if (device) {
+            memcpy(_pci_dev->_big_mem_bar + dst + done, ch->_scratch, n);
+        } else if (pci_dma_write(&_pci_dev->_pci_dev,
+                                 dst + done, ch->_scratch, n) != MEMTX_OK) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: DMA fill 0x%" PRIx64 " failed\n",
+                          dst + done);
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            return false;
+        }
+
+        if (csum_type != DMA_CSUM_NONE) {
+            *csum = _dma_csum_update(csum_type, *csum, ch->_scratch, n);
+        }
+        done += n;
+    }
+
+    if (device) {
+        memory_region_set_dirty(_pci_dev->_big_mem, dst, len);
+    }
+    stat64_add(&_pci_dev->_stats._dma_bytes_filled, len);
+    return true;
+}
+
+/**
+ * @brief LZ4 block compress (@compress) or decompress @len bytes of guest
+ * memory at @src into at most @dst_len bytes at @dst.
+ *
+ * @out_len: number of bytes written to @dst.
+ */
+static bool _dma_do_lz4(dma_channel *ch,
+                        bool compress,
+                        dma_addr_t src,
+                        dma_addr_t dst,
+                        dma_addr_t len,
+                        uint32_t dst_len,
+                        uint32_t *out_len,
+                        uint32_t csum_type,
+                        uint32_t *csum)
 {
-    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
-    uint64_t res = ~0ULL;
-    printf("_PCI_DEV: _pci_dev_mmio_read() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_mmio_read() size 0x%x\n", size);
+    _pci_device_object *_pci_dev = ch->_owner;
+#ifdef CONFIG_LZ4
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    g_autofree char *in = NULL;
+    g_autofree char *out = NULL;
+    int n;
 
-    switch (addr)
-    {
-    case 0x00:
-        printf("BAR\n");
-        break;
-    case REG_OP1:
-        res = _pci_dev->_operand_1;
-        break;
-    case REG_OP2:
-        res = _pci_dev->_operand_2;
-        break;
-    case REG_OPCODE:
-        res = _pci_dev->_opcode;
-        break;
-    case REG_RESULT:
-        switch (_pci_dev->_opcode) {
-            case OPCODE_ADD:
-                _pci_dev->_result = _pci_dev->_operand_1 + _pci_dev->_operand_2;
-                break;
-            case OPCODE_SUB:
-                _pci_dev->_result = _pci_dev->_operand_1 - _pci_dev->_operand_2;
-                break;
-            case OPCODE_DIV:
-                _pci_dev->_result = _pci_dev->_operand_1 / _pci_dev->_operand_2;
-                break;
-            case OPCODE_MUL:
-                _pci_dev->_result = _pci_dev->_operand_1 * _pci_dev->_operand_2;
-                break;
-            default:
-                _pci_dev->_result = 0x00;
-                _pci_dev->_error = 0x01;
-                break;
+    if (len == 0 || len > DMA_LZ4_MAX_LEN ||
+        dst_len == 0 || dst_len > DMA_LZ4_MAX_LEN) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: LZ4 of %" PRIu64 " bytes into %u bytes "
+                      "out of range\n", (uint64_t)len, dst_len);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
+
+    in = g_malloc(len);
+    out = g_malloc(dst_len);
+    if (pci_dma_read(dev, src, in, len) != MEMTX_OK) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: LZ4 read from 0x%" PRIx64 " failed\n", src);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
+
+    /* Compression returns 0 when the block does not fit, decompression < 0
+     * when it does not fit or the block is corrupt. */
+    if (compress) {
+        n = LZ4_compress_default(in, out, len, dst_len);
+        if (n == 0) {
+            *out_len = 0;
+            stat64_add(&_pci_dev->_stats._lz4_bytes_in, len);
+            return true;
         }
-        res = _pci_dev->_result;
+    } else {
+        n = LZ4_decompress_safe(in, out, len, dst_len);
+    }
+    if (n < 0) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: LZ4 decompress of %" PRIu64 " bytes failed\n",
+                      (uint64_t)len);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
 
-        /* We fire interrupt when result ready. */
-        pci_set_irq(&_pci_dev->_pci_dev, 1);
-        break;
-    case REG_ERROR:
-        res = _pci_dev->_error;
-        break;
-    default:
+    if (pci_dma_write(dev, dst, out, n) != MEMTX_OK) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: LZ4 write to 0x%" PRIx64 " failed\n", dst);
+        stat64_inc(&_pci_dev->_stats._dma_errors);
+        return false;
+    }
 
-        break;
+    if (csum_type != DMA_CSUM_NONE) {
+        *csum = _dma_csum_update(csum_type, *csum, (uint8_t *)out, n);
     }
 
-    return res;
+    *out_len = n;
+    stat64_add(&_pci_dev->_stats._lz4_bytes_in, len);
+    stat64_add(&_pci_dev->_stats._lz4_bytes_out, n);
+    return true;
+#else
+    qemu_log_mask(LOG_UNIMP, "c_pci_dev: built without LZ4\n");
+    stat64_inc(&_pci_dev->_stats._dma_errors);
+    return false;
+#endif
 }
 
-static void _pci_dev_mmio_write(void *opaque, hwaddr addr, uint64_t val,
-                unsigned size)
+/**
+ * @brief Execute one request (CMD doorbell or descriptor) of @ch, @cmd is the
+ * CMD register or the descriptor flags.
+ *
+ * @dst_len: room at @dst of a compress or decompress, from the descriptor.
+ * @out_len: NULL for the CMD doorbell, it can not run compress or
+ *      decompress. Otherwise gets the number of bytes written to @dst.
+ */
+static bool _dma_do_op(dma_channel *ch,
+                       uint32_t cmd,
+                       dma_addr_t src,
+                       dma_addr_t dst,
+                       dma_addr_t len,
+                       uint32_t dst_len,
+                       uint32_t *out_len,
+                       uint32_t csum_type,
+                       uint32_t *csum)
 {
-    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
-    printf("_PCI_DEV: _pci_dev_mmio_write() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_mmio_write() val 0x%lx\n", val);
+    if (out_len) {
+        *out_len = len;
+    }
 
-    switch (addr)
+    switch (DMA_GET_OP(cmd))
     {
-    case REG_OP1:
-        _pci_dev->_operand_1 = val;
-        break;
-    case REG_OP2:
-        _pci_dev->_operand_2 = val;
-        break;
-    case REG_OPCODE:
-        _pci_dev->_opcode = val;
-        break;
+    case DMA_OP_XFER:
+        return _dma_do_transfer(ch->_owner, src, dst, len,
+                                DMA_GET_DIR(cmd), csum_type, csum);
+    case DMA_OP_COPY:
+        return _dma_do_copy(ch, src, dst, len, csum_type, csum);
+    case DMA_OP_DEV_COPY:
+        return _dma_do_dev_copy(ch->_owner, src, dst, len, csum_type, csum);
+    case DMA_OP_FILL:
+        return _dma_do_fill(ch, src, dst, len, false, csum_type, csum);
+    case DMA_OP_DEV_FILL:
+        return _dma_do_fill(ch, src, dst, len, true, csum_type, csum);
+    case DMA_OP_COMPRESS:
+    case DMA_OP_DECOMPRESS:
+        if (out_len == NULL) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: LZ4 needs a descriptor on channel %u\n",
+                          ch->_index);
+            stat64_inc(&ch->_owner->_stats._dma_errors);
+            return false;
+        }
+        return _dma_do_lz4(ch, DMA_GET_OP(cmd) == DMA_OP_COMPRESS,
+                           src, dst, len, dst_len, out_len, csum_type, csum);
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "c_pci_dev: unknown DMA operation %u on channel %u\n",
+                      DMA_GET_OP(cmd), ch->_index);
+        stat64_inc(&ch->_owner->_stats._dma_errors);
+        return false;
     }
 }
 
-static uint64_t _pci_dev_big_mem_mmio_read(void *opaque, hwaddr addr, unsigned size)
+static bool fire_dma(dma_channel *ch)
 {
-    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
-    printf("_PCI_DEV: _pci_dev_big_mem_mmio_read() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_big_mem_mmio_read() size 0x%x\n", size);
+    _pci_device_object *_pci_dev = ch->_owner;
+    dma_addr_t src, dst, len;
+    uint32_t cmd, csum_type, csum;
+    bool ok;
 
-    if (size == 1) {
-        return _pci_dev->_big_mem_bar[addr];
-    } else if (size == 2) {
-        uint16_t *ptr = (uint16_t *) &_pci_dev->_big_mem_bar[addr];
-        return *ptr;
-    } else if (size == 4) {
-        uint32_t *ptr = (uint32_t *) &_pci_dev->_big_mem_bar[addr];
-        return *ptr;
-    } else if (size == 8) {
-        uint64_t *ptr = (uint64_t *) &_pci_dev->_big_mem_bar[addr];
-        return *ptr;
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        cmd = ch->_cmd;
+        src = ch->_src;
+        dst = ch->_dst;
+        len = ch->_len;
+        ch->_cmd_pending = false;
     }
 
-    return 0xffffffffffffffL;
-}
+    csum_type = DMA_GET_CSUM(cmd);
+    csum = _dma_csum_init(csum_type);
 
-static void _pci_dev_big_mem_mmio_write(void *opaque, hwaddr addr, uint64_t val,
-                unsigned size)
-{
-    _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
-    printf("_PCI_DEV: _pci_dev_big_mem_mmio_write() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_big_mem_mmio_write() val 0x%lx\n", val);
+    trace_c_pci_dev_dma_run(ch->_index,
+                            src,
+                            dst,
+                            len,
+                            DMA_GET_DIR(cmd),
+                            DMA_GET_OP(cmd));
 
-    if (size == 1) {
-        _pci_dev->_big_mem_bar[addr] = (uint8_t)val;
-    } else if (size == 2) {
-        uint16_t *ptr = (uint16_t *) &_pci_dev->_big_mem_bar[addr];
-        *ptr = (uint16_t) val;
-    } else if (size == 4) {
-        uint32_t *ptr = (uint32_t *) &_pci_dev->_big_mem_bar[addr];
-        *ptr = (uint32_t) val;
-    } else if (size == 8) {
-        uint64_t *ptr = (uint64_t *) &_pci_dev->_big_mem_bar[addr];
-        *ptr = (uint64_t) val;
-    }
-}
+    ok = _dma_do_op(ch,
+                    cmd,
+                    src,
+                    dst,
+                    len,
+                    0,
+                    NULL,
+                    csum_type,
+                    &csum);
 
-static uint64_t _pci_dev_dma_mmio_read(void *opaque, hwaddr addr, unsigned size)
-{
-    printf("_PCI_DEV: _pci_dev_dma_mmio_read() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_dma_mmio_read() size 0x%x\n", size);
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        ch->_csum = _dma_csum_final(csum_type, csum);
+        ch->_completed++;
+    }
 
-    return 0xffffffffffffffL;
+    return ok;
 }
 
-static void fire_dma(_pci_device_object *_pci_dev)
+/**
+ * @brief Walk the descriptor ring of a channel from head to tail. Every
+ * descriptor is executed and its status is written back to guest memory.
+ * The tail is read again after every descriptor, so doorbells rung while we
+ * run are served by this walk.
+ *
+ * @done: incremented for every chain completed.
+ * @return false if any descriptor failed.
+ */
+static bool _dma_ring_process(dma_channel *ch, uint32_t *done)
 {
-        printf("pci_dma_*: src: %lx, dst: %lx, len: %ld, cmd: %lx\n",
-               _pci_dev->_dma_state._src,
-               _pci_dev->_dma_state._dst,
-               _pci_dev->_dma_state._len,
-               _pci_dev->_dma_state._cmd);
+    _pci_device_object *_pci_dev = ch->_owner;
+    PCIDevice *dev = &_pci_dev->_pci_dev;
+    bool ok = true;
 
-    if (DMA_GET_DIR(_pci_dev->_dma_state._cmd) == DMA_DIRECTION_TO_DEVICE)
+    for (;;)
     {
-        if ((_pci_dev->_dma_state._dst + _pci_dev->_dma_state._len) > BIG_BAR_SIZE)
+        dma_addr_t desc_addr;
+        dma_desc desc;
+        uint32_t head, next, gen;
+        uint64_t submit_ts;
+        uint32_t flags;
+        uint32_t status = DMA_DESC_STS_DONE;
+        uint32_t out_len = 0;
+        bool chain_end;
+
+        qemu_mutex_lock(&_pci_dev->_lock);
+        if (ch->_ring_size == 0 || ch->_ring_head == ch->_ring_tail) {
+            qemu_mutex_unlock(&_pci_dev->_lock);
+            _timing_idle(&ch->_timing);
+            break;
+        }
+        head = ch->_ring_head;
+        next = (head + 1) % ch->_ring_size;
+        desc_addr = ch->_ring_base + (dma_addr_t)head * sizeof(dma_desc);
+        gen = ch->_ring_gen;
+        submit_ts = ch->_submit_ts[head];
+        qemu_mutex_unlock(&_pci_dev->_lock);
+
+        if (pci_dma_read(dev, desc_addr, &desc, sizeof(desc)) != MEMTX_OK)
         {
-            printf("Buffer overflow!\n");
-            return;
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: failed to fetch descriptor %u of channel %u\n",
+                          head, ch->_index);
+            stat64_inc(&_pci_dev->_stats._dma_errors);
+            ok = false;
+            break;
+        }
+
+        if (!_timing_due(_pci_dev,
+                         &ch->_timing,
+                         (uint64_t)gen << 32 | head,
+                         le32_to_cpu(desc._len),
+                         0)) {
+            break;
         }
 
-        /* Read from address and store in buffer. This function start transfer
-         * from physical memory to device memory. */
-        pci_dma_read(&_pci_dev->_pci_dev,                                // Device.
-                     _pci_dev->_dma_state._src,                          // Physical Memory Address.
-                     _pci_dev->_big_mem_bar + _pci_dev->_dma_state._dst, // Device Memory Buffer Address.
-                     _pci_dev->_dma_state._len);                         // Length.
+        desc._ts_submit = cpu_to_le64(submit_ts);
+        desc._ts_start = cpu_to_le64(qemu_clock_get_ns(TIMESTAMP_CLOCK));
 
-    } else if (DMA_GET_DIR(_pci_dev->_dma_state._cmd) == DMA_DIRECTION_FROM_DEVICE)
-    {
-        if ((_pci_dev->_dma_state._src + _pci_dev->_dma_state._len) > BIG_BAR_SIZE)
+        flags = le32_to_cpu(desc._flags);
+        chain_end = !(flags & DMA_DESC_F_CHAIN);
+
+        trace_c_pci_dev_dma_desc(ch->_index,
+                                 head,
+                                 le64_to_cpu(desc._src),
+                                 le64_to_cpu(desc._dst),
+                                 le32_to_cpu(desc._len),
+                                 flags);
+
+        /* The checksum runs over the whole chain. A chain of a ring reset
+         * since is dropped. */
+        if (!ch->_chain_open || ch->_chain_gen != gen) {
+            ch->_chain_csum_type = DMA_GET_CSUM(flags);
+            ch->_chain_csum = _dma_csum_init(ch->_chain_csum_type);
+            ch->_chain_failed = false;
+            ch->_chain_gen = gen;
+            ch->_chain_open = true;
+        }
+
+        if (ch->_chain_failed || !_dma_do_op(ch,
+                                             flags,
+                                             le64_to_cpu(desc._src),
+                                             le64_to_cpu(desc._dst),
+                                             le32_to_cpu(desc._len),
+                                             le32_to_cpu(desc._dst_len),
+                                             &out_len,
+                                             ch->_chain_csum_type,
+                                             &ch->_chain_csum))
         {
-            printf("Buffer overflow!\n");
+            status |= DMA_DESC_STS_ERROR;
+            ch->_chain_failed = true;
+            ok = false;
+        }
+
+        if (chain_end && ch->_chain_csum_type != DMA_CSUM_NONE) {
+            stl_le_pci_dma(dev,
+                           desc_addr + offsetof(dma_desc, _csum),
+                           _dma_csum_final(ch->_chain_csum_type,
+                                           ch->_chain_csum),
+                           MEMTXATTRS_UNSPECIFIED);
+        }
+
+        /* Timestamps and output length before the status, a driver polling
+         * the status sees them. */
+        desc._ts_complete = cpu_to_le64(qemu_clock_get_ns(TIMESTAMP_CLOCK));
+        desc._out_len = cpu_to_le32(out_len);
+        pci_dma_write(dev,
+                      desc_addr + offsetof(dma_desc, _ts_submit),
+                      &desc._ts_submit,
+                      sizeof(desc) - offsetof(dma_desc, _ts_submit));
+
+        stl_le_pci_dma(dev,
+                       desc_addr + offsetof(dma_desc, _status),
+                       status,
+                       MEMTXATTRS_UNSPECIFIED);
+
+        /* A ring reset while we ran drops the chain we were in. */
+        qemu_mutex_lock(&_pci_dev->_lock);
+        if (ch->_ring_gen != gen) {
+            chain_end = true;
+        } else {
+            ch->_ring_head = next;
+            if (chain_end) {
+                ch->_completed++;
+                if (ch->_chain_csum_type != DMA_CSUM_NONE) {
+                    ch->_csum = _dma_csum_final(ch->_chain_csum_type,
+                                                ch->_chain_csum);
+                }
+            }
+        }
+        qemu_mutex_unlock(&_pci_dev->_lock);
+
+        /* A failed segment only poisons the rest of its own chain. */
+        if (chain_end) {
+            ch->_chain_open = false;
+            (*done)++;
+        }
+    }
+
+    return ok;
+}
+
+/**
+ * @brief DMA bottom half, one per channel. Doorbell writes only latch the
+ * request and schedule this function, so the vCPU returns from the MMIO exit
+ * immediately and the copy runs in the iothread of the device (or the main
+ * loop).
+ */
+static void _dma_bh(void *opaque)
+{
+    dma_channel *ch = (dma_channel *)opaque;
+    _pci_device_object *_pci_dev = ch->_owner;
+    dma_addr_t len;
+    uint32_t done = 0;
+    bool pending;
+    bool ok = true;
+
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        pending = ch->_cmd_pending;
+        len = ch->_len;
+    }
+
+    /* The register command goes before the ring. Ring tags have a generation
+     * in the high half and an index below DMA_RING_MAX_ENTRIES. */
+    if (pending) {
+        if (!_timing_due(_pci_dev, &ch->_timing, UINT64_MAX, len, 0)) {
             return;
         }
+        ok = fire_dma(ch);
+        done++;
+    }
+
+    if (!_dma_ring_process(ch, &done)) {
+        ok = false;
+    }
 
-        /* Write data in buffer to address. This function start transfer from 
-         * device memory to physical memory (defined by dest). */
-        pci_dma_write(&_pci_dev->_pci_dev,                                // Device.
-                      _pci_dev->_dma_state._dst,                          // Physical Address.
-                      _pci_dev->_big_mem_bar + _pci_dev->_dma_state._src, // Device Memory Buffer Address.
-                      _pci_dev->_dma_state._len);                         // Length.
+    /* Waiting for the timing model with nothing completed, there is nothing
+     * to report yet. */
+    if (ok && done == 0 && timer_pending(ch->_timing._timer)) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&_pci_dev->_lock) {
+        /* A doorbell rung after our last look scheduled us again, we stay
+         * busy for it. */
+        if (!ch->_cmd_pending && ch->_ring_head == ch->_ring_tail) {
+            ch->_status &= ~DMA_STS_BUSY;
+        }
+        ch->_status |= DMA_STS_DONE;
+        if (!ok) {
+            ch->_status |= DMA_STS_ERROR;
+        }
+        trace_c_pci_dev_dma_done(ch->_index, ch->_status, ch->_completed);
     }
+
+    _pci_dev_notify(_pci_dev,
+                    ok ? 0 : ERR_DMA,
+                    IRQ_SRC_DMA_BASE + ch->_index);
 }
 
 static void _pci_dev_dma_mmio_write(void *opaque, hwaddr addr, uint64_t val,
                 unsigned size)
 {
     _pci_device_object *_pci_dev = (_pci_device_object *)opaque;
-    printf("_PCI_DEV: _pci_dev_dma_mmio_write() addr 0x%lx\n", addr);
-    printf("_PCI_DEV: _pci_dev_dma_mmio_write() val 0x%lx\n", val);
+    uint32_t chan = addr / DMA_CHAN_STRIDE;
+    dma_channel *ch = &_pci_dev->_dma_chan[chan];
+    int64_t now;
+    uint32_t i;
 
-    switch (addr)
+    QEMU_LOCK_GUARD(&_pci_dev->_lock);
+
+    stat64_inc(&_pci_dev->_stats._dma_mmio_writes);
+    trace_c_pci_dev_dma_mmio_write(chan, addr % DMA_CHAN_STRIDE, val);
+
+    if (chan >= _pci_dev->_dma_channels) {
+        return;
+    }
+
+    switch (addr % DMA_CHAN_STRIDE)
     {
     case DMA_REG_CMD:
-        _pci_dev->_dma_state._cmd = val;
+        ch->_cmd = val;
         if (val & DMA_CMD_RUN)
         {
-            printf("_PCI_DEV: fire dma!\n");
-            fire_dma(_pci_dev);
+            ch->_cmd_pending = true;
+            ch->_status |= DMA_STS_BUSY;
+            qemu_bh_schedule(ch->_bh);
         }
         break;
     case DMA_REG_SRC:
-        _pci_dev->_dma_state._src = val;
+        ch->_src = val;
         break;
     case DMA_REG_DST:
-        _pci_dev->_dma_state._dst = val;
+        ch->_dst = val;
         break;
     case DMA_REG_LEN:
-        _pci_dev->_dma_state._len = val;
+        ch->_len = val;
+        break;
+    case DMA_REG_SRC64:
+    case DMA_REG_SRC64 + 4:
+        _pci_dev_reg64_write(&ch->_src, addr, val, size);
+        break;
+    case DMA_REG_DST64:
+    case DMA_REG_DST64 + 4:
+        _pci_dev_reg64_write(&ch->_dst, addr, val, size);
+        break;
+    case DMA_REG_LEN64:
+    case DMA_REG_LEN64 + 4:
+        _pci_dev_reg64_write(&ch->_len, addr, val, size);
+        break;
+    case DMA_REG_RING_BASE:
+        /* Changing ring geometry resets the ring. */
+        ch->_ring_base = val;
+        ch->_ring_head = 0;
+        ch->_ring_tail = 0;
+        ch->_ring_gen++;
+        break;
+    case DMA_REG_RING_BASE64:
+    case DMA_REG_RING_BASE64 + 4:
+        _pci_dev_reg64_write(&ch->_ring_base, addr, val, size);
+        ch->_ring_head = 0;
+        ch->_ring_tail = 0;
+        ch->_ring_gen++;
+        break;
+    case DMA_REG_RING_SIZE:
+        if (val > DMA_RING_MAX_ENTRIES) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: ring size %" PRIu64 " too big\n", val);
+            break;
+        }
+        ch->_ring_size = val;
+        ch->_ring_head = 0;
+        ch->_ring_tail = 0;
+        ch->_ring_gen++;
+        break;
+    case DMA_REG_RING_TAIL:
+        if (val >= ch->_ring_size) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "c_pci_dev: ring tail %" PRIu64 " out of ring\n", val);
+            break;
+        }
+        now = qemu_clock_get_ns(TIMESTAMP_CLOCK);
+        for (i = ch->_ring_tail; i != val; i = (i + 1) % ch->_ring_size) {
+            ch->_submit_ts[i] = now;
+        }
+        ch->_ring_tail = val;
+        ch->_status |= DMA_STS_BUSY;
+        qemu_bh_schedule(ch->_bh);
+        break;
+    case DMA_REG_STATUS:
+        /* Done and error bits are write 1 to clear, the driver acknowledges
+         * the interrupt this way. */
+        ch->_status &= ~(val & (DMA_STS_DONE | DMA_STS_ERROR));
+        if (!(ch->_status & (DMA_STS_DONE | DMA_STS_ERROR))) {
+            _pci_dev->_irq_status &= ~BIT(IRQ_SRC_DMA_BASE + chan);
+            _pci_dev->_irq_pending &= ~BIT(IRQ_SRC_DMA_BASE + chan);
+        }
+        _pci_dev_update_intx(_pci_dev);
+        _pci_dev_writeback(_pci_dev);
         break;
     default:
         break;
@@ -311,16 +3815,17 @@ static const MemoryRegionOps _pci_dev_mmio_ops = {
     },
 };
 
-static const MemoryRegionOps _pci_dev_big_mem_mmio_ops = {
-    .read = _pci_dev_big_mem_mmio_read,
-    .write = _pci_dev_big_mem_mmio_write,
-    .endianness = DEVICE_NATIVE_ENDIAN,
+/* Entries are byte streams, stored as they arrive. */
+static const MemoryRegionOps _pci_dev_push_ops = {
+    .read = _pci_dev_push_read,
+    .write = _pci_dev_push_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
     .valid = {
-        .min_access_size = 1,
+        .min_access_size = 4,
         .max_access_size = 8,
     },
     .impl = {
-        .min_access_size = 1,
+        .min_access_size = 4,
         .max_access_size = 8,
     },
 };
@@ -341,16 +3846,111 @@ static const MemoryRegionOps _pci_dev_dma_mmio_ops = {
 
 static void _pci_dev_realize(PCIDevice *dev, Error **errp)
 {
+    ERRP_GUARD();
     _pci_device_object *_pci_dev = C_PCI_DEV(dev);
     uint8_t *pci_conf = dev->config;
+    MemReentrancyGuard *guard = &DEVICE(dev)->mem_reentrancy_guard;
+    AioContext *ctx;
+    uint32_t i;
+
+    /* A memory backend brings its own size. */
+    if (_pci_dev->_memdev) {
+        if (host_memory_backend_is_mapped(_pci_dev->_memdev)) {
+            error_setg(errp, "can't use already busy memdev: %s",
+                       object_get_canonical_path_component(
+                           OBJECT(_pci_dev->_memdev)));
+            return;
+        }
+        _pci_dev->_big_mem_size = memory_region_size(
+            host_memory_backend_get_memory(_pci_dev->_memdev));
+    }
+
+    if (_pci_dev->_big_mem_size < BIG_BAR_SIZE ||
+        _pci_dev->_big_mem_size > BIG_BAR_MAX_SIZE ||
+        !is_power_of_2(_pci_dev->_big_mem_size)) {
+        error_setg(errp, "%s must be a power of 2 between 4K and 1G",
+                   _pci_dev->_memdev ? "memdev size" : "bar1-size");
+        return;
+    }
+
+    if (_pci_dev->_dma_channels == 0 ||
+        _pci_dev->_dma_channels > DMA_MAX_CHANNELS) {
+        error_setg(errp, "dma-channels must be between 1 and %d",
+                   DMA_MAX_CHANNELS);
+        return;
+    }
+
+    if (_pci_dev->_nr_qps == 0 || _pci_dev->_nr_qps > QP_MAX) {
+        error_setg(errp, "queues must be between 1 and %d", QP_MAX);
+        return;
+    }
+
+    if (_pci_dev->_queue_depth == 0 ||
+        _pci_dev->_queue_depth > TIMING_MAX_DEPTH) {
+        error_setg(errp, "queue-depth must be between 1 and %d",
+                   TIMING_MAX_DEPTH);
+        return;
+    }
+
+    if (_pci_dev->_vectors == 0) {
+        _pci_dev->_vectors = C_PCI_VEC_DMA_BASE + _pci_dev->_dma_channels;
+    }
+
+    if (_pci_dev->_vectors <= C_PCI_VEC_DMA_BASE ||
+        _pci_dev->_vectors > C_PCI_MAX_VECTORS) {
+        error_setg(errp, "vectors must be between %d and %d",
+                   C_PCI_VEC_DMA_BASE + 1, C_PCI_MAX_VECTORS);
+        return;
+    }
+
+    /* Device memory is host RAM mapped straight into the guest, loads and
+     * stores through the BAR never leave the guest. A memory backend (a file
+     * or memfd with share=on) is RAM a host process maps as well, both sides
+     * exchange data in place, like ivshmem. */
+    if (_pci_dev->_memdev) {
+        if (!_pci_dev->_memdev->share) {
+            warn_report("c_pci_dev: memdev %s is not shared, host processes "
+                        "do not see the guest writes",
+                        object_get_canonical_path_component(
+                            OBJECT(_pci_dev->_memdev)));
+        }
+        _pci_dev->_big_mem = host_memory_backend_get_memory(_pci_dev->_memdev);
+    } else {
+        memory_region_init_ram(&_pci_dev->_big_mem_region,
+                               OBJECT(_pci_dev),
+                               "_pci_dev-bar1",
+                               _pci_dev->_big_mem_size,
+                               errp);
+        if (*errp) {
+            return;
+        }
+        _pci_dev->_big_mem = &_pci_dev->_big_mem_region;
+    }
+
+    _pci_dev->_big_mem_bar = memory_region_get_ram_ptr(_pci_dev->_big_mem);
 
     pci_config_set_interrupt_pin(pci_conf, 1);
 
-    if (msi_init(dev, 0, 1, true, false, errp)) {
+    /* MSI-X is the main interrupt mechanism, the table and PBA get their own
+     * BAR. MSI (one vector per DMA channel, power of 2) and INTx stay as
+     * fallback for guests without MSI-X. */
+    if (msix_init_exclusive_bar(dev, _pci_dev->_vectors, C_PCI_MSIX_BAR, errp)) {
+        return;
+    }
+
+    for (i = 0; i < _pci_dev->_vectors; i++) {
+        msix_vector_use(dev, i);
+    }
+
+    if (msi_init(dev, 0, pow2ceil(_pci_dev->_dma_channels), true, false, errp)) {
+        msix_uninit_exclusive_bar(dev);
         return;
     }
 
-    memset(_pci_dev->_big_mem_bar, 0, BIG_BAR_SIZE);
+    /* Nothing fails from here on, the backend is ours. */
+    if (_pci_dev->_memdev) {
+        host_memory_backend_set_mapped(_pci_dev->_memdev, true);
+    }
 
     _pci_dev->_operand_1 = 0x02;
     _pci_dev->_operand_2 = 0x04;
@@ -358,6 +3958,89 @@ static void _pci_dev_realize(PCIDevice *dev, Error **errp)
     _pci_dev->_result = 0xBB;
     _pci_dev->_error = 0x00;
 
+    /* Bottom halves run where the work should go, doorbells only schedule
+     * them, which is thread safe. */
+    qemu_mutex_init(&_pci_dev->_lock);
+    _pci_dev->_coal_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                         _pci_dev_coal_timer,
+                                         _pci_dev);
+    _pci_dev->_compute_timing._timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                    _pci_dev_compute_timer,
+                                                    _pci_dev);
+    ctx = qemu_get_aio_context();
+    if (_pci_dev->_iothread) {
+        ctx = iothread_get_aio_context(_pci_dev->_iothread);
+        /* The guard is checked on every MMIO access, a bottom half engaged in
+         * another thread would make vCPU accesses fail. A DMA pointed at our
+         * BARs is safe here anyway: it takes the BQL and `_lock`, which
+         * bottom halves do not hold while moving data. */
+        guard = NULL;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(_pci_dev->_batch_buf); i++) {
+        _pci_dev->_batch_buf[i] = qemu_memalign(sizeof(batch_vec),
+                                                BATCH_CHUNK * sizeof(uint32_t));
+    }
+    _pci_dev->_batch_bh = aio_bh_new_guarded(ctx,
+                                             _batch_bh,
+                                             _pci_dev,
+                                             guard);
+    _pci_dev->_batch_timing._timer = aio_timer_new(ctx,
+                                                   QEMU_CLOCK_VIRTUAL,
+                                                   SCALE_NS,
+                                                   _timing_kick,
+                                                   _pci_dev->_batch_bh);
+
+    _pci_dev->_tag_bh = aio_bh_new_guarded(ctx,
+                                           _tag_bh,
+                                           _pci_dev,
+                                           guard);
+    _pci_dev->_tag_timing._timer = aio_timer_new(ctx,
+                                                 QEMU_CLOCK_VIRTUAL,
+                                                 SCALE_NS,
+                                                 _timing_kick,
+                                                 _pci_dev->_tag_bh);
+
+    for (i = 0; i < _pci_dev->_nr_qps; i++) {
+        c_pci_qp *qp = &_pci_dev->_qp[i];
+
+        qp->_owner = _pci_dev;
+        qp->_index = i;
+        qp->_push_sq = g_new0(c_pci_sqe, QP_MAX_ENTRIES);
+        qp->_push_mask = g_new0(uint16_t, QP_MAX_ENTRIES);
+        _qp_reset(qp);
+        qp->_bh = aio_bh_new_guarded(ctx,
+                                     _qp_bh,
+                                     qp,
+                                     guard);
+        qp->_timing._timer = aio_timer_new(ctx,
+                                           QEMU_CLOCK_VIRTUAL,
+                                           SCALE_NS,
+                                           _timing_kick,
+                                           qp->_bh);
+    }
+
+    /* DMA requests are executed outside of the MMIO callbacks. The guard
+     * prevents the bottom half from re-entering our own MMIO handlers if a
+     * guest points a DMA at one of our BARs. */
+    for (i = 0; i < _pci_dev->_dma_channels; i++) {
+        dma_channel *ch = &_pci_dev->_dma_chan[i];
+
+        ch->_owner = _pci_dev;
+        ch->_index = i;
+        ch->_scratch = qemu_memalign(sizeof(uint64_t), DMA_COPY_CHUNK);
+        ch->_submit_ts = g_new0(uint64_t, DMA_RING_MAX_ENTRIES);
+        ch->_bh = aio_bh_new_guarded(ctx,
+                                     _dma_bh,
+                                     ch,
+                                     guard);
+        ch->_timing._timer = aio_timer_new(ctx,
+                                           QEMU_CLOCK_VIRTUAL,
+                                           SCALE_NS,
+                                           _timing_kick,
+                                           ch->_bh);
+    }
+
     /**
      * @brief Initialize an I/O memory region. Accesses into the region will
      * cause the callbacks in @ops to be called. If @size is nonzero, subregions
@@ -377,7 +4060,7 @@ static void _pci_dev_realize(PCIDevice *dev, Error **errp)
                             &_pci_dev_mmio_ops,
                             _pci_dev,
                             "_pci_dev-mmio",
-                            0x40); // We only need 64 bytes for registers.
+                            C_PCI_MMIO_SIZE); // One page, room for more registers.
 
     /**
      * @brief This function attach newly allocated `MemoryRegions` to the PCI
@@ -395,20 +4078,19 @@ static void _pci_dev_realize(PCIDevice *dev, Error **errp)
      * internal `moulinette` to inform the related emulated devices of their
      * possible relocation.
      */
-    pci_register_bar(dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &_pci_dev->_mmio);
-
-    /* Big memory, for mapping big region. */
-    memory_region_init_io(&_pci_dev->_big_mem_region,
-                          OBJECT(_pci_dev),
-                          &_pci_dev_big_mem_mmio_ops,
-                          _pci_dev,
-                          "_pci_dev-mmio",
-                          BIG_BAR_SIZE);
-
     pci_register_bar(dev,
-                     1,
+                     C_PCI_MMIO_BAR,
                      PCI_BASE_ADDRESS_SPACE_MEMORY,
-                     &_pci_dev->_big_mem_region);
+                     &_pci_dev->_mmio);
+
+    /* Big memory, for mapping big region. A 64 bit prefetchable BAR, so it can
+     * be placed above 4G and mapped write combined. */
+    pci_register_bar(dev,
+                     C_PCI_MEM_BAR,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH |
+                     PCI_BASE_ADDRESS_MEM_TYPE_64,
+                     _pci_dev->_big_mem);
 
     /* DMA controller. */
     memory_region_init_io(&_pci_dev->_dma,
@@ -416,24 +4098,150 @@ static void _pci_dev_realize(PCIDevice *dev, Error **errp)
                           &_pci_dev_dma_mmio_ops,
                           _pci_dev,
                           "_pci_dev-mmio",
-                          0x20);
+                          DMA_MAX_CHANNELS * DMA_CHAN_STRIDE);
 
     pci_register_bar(dev,
-                     2,
+                     C_PCI_DMA_BAR,
                      PCI_BASE_ADDRESS_SPACE_MEMORY,
                      &_pci_dev->_dma);
+
+    /* Submission BAR. Prefetchable, so the driver can map it write combined
+     * and an entry goes out as one burst instead of a store per field. */
+    memory_region_init_io(&_pci_dev->_push,
+                          OBJECT(_pci_dev),
+                          &_pci_dev_push_ops,
+                          _pci_dev,
+                          "_pci_dev-push",
+                          QP_PUSH_SIZE);
+
+    pci_register_bar(dev,
+                     C_PCI_PUSH_BAR,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY |
+                     PCI_BASE_ADDRESS_MEM_PREFETCH,
+                     &_pci_dev->_push);
 }
 
 static void _pci_dev_exit(PCIDevice *pdev)
 {
-    return;
+    _pci_device_object *_pci_dev = C_PCI_DEV(pdev);
+    uint32_t i;
+
+    for (i = 0; i < _pci_dev->_dma_channels; i++) {
+        timer_free(_pci_dev->_dma_chan[i]._timing._timer);
+        qemu_bh_delete(_pci_dev->_dma_chan[i]._bh);
+        qemu_vfree(_pci_dev->_dma_chan[i]._scratch);
+        g_free(_pci_dev->_dma_chan[i]._submit_ts);
+    }
+    timer_free(_pci_dev->_batch_timing._timer);
+    qemu_bh_delete(_pci_dev->_batch_bh);
+    timer_free(_pci_dev->_tag_timing._timer);
+    qemu_bh_delete(_pci_dev->_tag_bh);
+    for (i = 0; i < _pci_dev->_nr_qps; i++) {
+        timer_free(_pci_dev->_qp[i]._timing._timer);
+        qemu_bh_delete(_pci_dev->_qp[i]._bh);
+        g_free(_pci_dev->_qp[i]._push_sq);
+        g_free(_pci_dev->_qp[i]._push_mask);
+    }
+    for (i = 0; i < ARRAY_SIZE(_pci_dev->_batch_buf); i++) {
+        qemu_vfree(_pci_dev->_batch_buf[i]);
+    }
+    timer_free(_pci_dev->_coal_timer);
+    timer_free(_pci_dev->_compute_timing._timer);
+    qemu_mutex_destroy(&_pci_dev->_lock);
+    msi_uninit(pdev);
+    msix_unuse_all_vectors(pdev);
+    msix_uninit_exclusive_bar(pdev);
+    if (_pci_dev->_memdev) {
+        host_memory_backend_set_mapped(_pci_dev->_memdev, false);
+    }
+}
+
+static void _pci_dev_get_stat(Object *obj, Visitor *v, const char *name,
+                              void *opaque, Error **errp)
+{
+    uint64_t value = stat64_get(opaque);
+
+    visit_type_uint64(v, name, &value, errp);
 }
 
+/**
+ * @brief Name of every counter in `_pci_dev_stats`, the property is
+ * `stat-<name>`.
+ */
+static const struct {
+    const char *name;
+    size_t offset;
+} _pci_dev_stat_props[] = {
+    { "mmio-reads", offsetof(_pci_dev_stats, _mmio_reads) },
+    { "mmio-writes", offsetof(_pci_dev_stats, _mmio_writes) },
+    { "dma-mmio-reads", offsetof(_pci_dev_stats, _dma_mmio_reads) },
+    { "dma-mmio-writes", offsetof(_pci_dev_stats, _dma_mmio_writes) },
+    { "dma-bytes-to-device", offsetof(_pci_dev_stats, _dma_bytes_to_device) },
+    { "dma-bytes-from-device", offsetof(_pci_dev_stats, _dma_bytes_from_device) },
+    { "dma-bytes-copied", offsetof(_pci_dev_stats, _dma_bytes_copied) },
+    { "dma-bytes-filled", offsetof(_pci_dev_stats, _dma_bytes_filled) },
+    { "ops-add", offsetof(_pci_dev_stats, _ops[OPCODE_ADD]) },
+    { "ops-mul", offsetof(_pci_dev_stats, _ops[OPCODE_MUL]) },
+    { "ops-div", offsetof(_pci_dev_stats, _ops[OPCODE_DIV]) },
+    { "ops-sub", offsetof(_pci_dev_stats, _ops[OPCODE_SUB]) },
+    { "compute-errors", offsetof(_pci_dev_stats, _compute_errors) },
+    { "dma-errors", offsetof(_pci_dev_stats, _dma_errors) },
+    { "hash-bytes", offsetof(_pci_dev_stats, _hash_bytes) },
+    { "prog-elements", offsetof(_pci_dev_stats, _prog_elements) },
+    { "search-bytes", offsetof(_pci_dev_stats, _search_bytes) },
+    { "lz4-bytes-in", offsetof(_pci_dev_stats, _lz4_bytes_in) },
+    { "lz4-bytes-out", offsetof(_pci_dev_stats, _lz4_bytes_out) },
+    { "irq-events", offsetof(_pci_dev_stats, _irq_events) },
+    { "irqs", offsetof(_pci_dev_stats, _irqs) },
+};
+
 static void _pci_dev_instance_init(Object *obj)
 {
-    return;
+    _pci_device_object *_pci_dev = C_PCI_DEV(obj);
+    uint32_t i;
+
+    for (i = 0; i < ARRAY_SIZE(_pci_dev_stat_props); i++) {
+        g_autofree char *name = g_strdup_printf("stat-%s",
+                                                _pci_dev_stat_props[i].name);
+
+        object_property_add(obj, name, "uint64",
+                            _pci_dev_get_stat, NULL, NULL,
+                            (uint8_t *)&_pci_dev->_stats +
+                            _pci_dev_stat_props[i].offset);
+    }
 }
 
+/**
+ * @brief User configurable properties, e.g. `-device c_pci_dev,dma-channels=8`.
+ * `iothread` runs DMA, batches and queue pairs in that iothread, e.g.
+ * `-object iothread,id=io0 -device c_pci_dev,iothread=io0`.
+ * `dma-bandwidth` (bytes/s), `cmd-latency-ns`, `op-latency-ns` and
+ * `queue-depth` set the timing model, e.g.
+ * `-device c_pci_dev,dma-bandwidth=2G,cmd-latency-ns=5000,queue-depth=8`.
+ * `memdev` backs BAR1 with a memory backend, whose size replaces `bar1-size`,
+ * e.g. `-object memory-backend-memfd,id=mb1,size=64M,share=on
+ * -device c_pci_dev,memdev=mb1`, or `memory-backend-file` with a `mem-path`
+ * in /dev/shm for a host process to mmap().
+ */
+static Property _pci_dev_properties[] = {
+    DEFINE_PROP_UINT32("dma-channels", _pci_device_object, _dma_channels,
+                       DMA_DEFAULT_CHANNELS),
+    DEFINE_PROP_UINT32("vectors", _pci_device_object, _vectors, 0),
+    DEFINE_PROP_UINT32("queues", _pci_device_object, _nr_qps, QP_DEFAULT),
+    DEFINE_PROP_SIZE("bar1-size", _pci_device_object, _big_mem_size,
+                     BIG_BAR_SIZE),
+    DEFINE_PROP_LINK("memdev", _pci_device_object, _memdev,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_LINK("iothread", _pci_device_object, _iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_SIZE("dma-bandwidth", _pci_device_object, _dma_bandwidth, 0),
+    DEFINE_PROP_UINT32("cmd-latency-ns", _pci_device_object, _cmd_latency_ns,
+                       0),
+    DEFINE_PROP_UINT32("op-latency-ns", _pci_device_object, _op_latency_ns, 0),
+    DEFINE_PROP_UINT32("queue-depth", _pci_device_object, _queue_depth, 1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void _pci_dev_class_init(ObjectClass *class, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(class);
@@ -449,8 +4257,13 @@ static void _pci_dev_class_init(ObjectClass *class, void *data)
     k->revision = DEVICE_REVISION;
     k->class_id = PCI_CLASS_OTHERS;
 
+#if defined(__x86_64__)
+    _have_crc32c_insn = __builtin_cpu_supports("sse4.2");
+#endif
+
     /* Set device categories is MISC. */
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    device_class_set_props(dc, _pci_dev_properties);
 }
 
 static void pci_custom_device_register_types(void)
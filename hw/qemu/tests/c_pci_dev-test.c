@@ -0,0 +1,599 @@
+/*
+ * QTest of c_pci_dev, drives the device registers and its DMA engine from the
+ * test harness, no guest. Copy it to tests/qtest/ of the QEMU tree, next to
+ * the device in hw/misc/, build.patch adds it to the build.
+ *
+ * Functional tests run by default. Throughput tests (MMIO round trip, DMA
+ * bytes/s for a matrix of sizes) run with `-m perf`, e.g.
+ * `QTEST_QEMU_BINARY=./qemu-system-x86_64 \
+ *  ./tests/qtest/c_pci_dev-test -m perf`, their numbers are reported as test
+ * results.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci-pc.h"
+
+/* Same as in the device. */
+#define REG_OP1                 0x10
+#define REG_OP2                 0x14
+#define REG_OPCODE              0x18
+#define REG_RESULT              0x20
+#define REG_ERROR               0x24
+#define REG_DMA_CHANNELS        0x28
+#define REG_TAG_OPS             0x80
+#define REG_TAG_CMD             0x88
+#define REG_TAG_DONE            0x8C
+#define REG_TAG_ERROR           0x90
+#define REG_TAG_RESULT          0x200
+#define TAG_CMD_OPCODE_SHIFT    8
+
+#define OPCODE_ADD              0x00
+#define OPCODE_MUL              0x01
+#define OPCODE_DIV              0x02
+#define OPCODE_SUB              0x03
+
+#define ERR_COMPUTE             (1 << 0)
+#define ERR_DMA                 (1 << 1)
+
+#define C_PCI_MMIO_BAR          0
+#define C_PCI_MEM_BAR           1
+#define C_PCI_DMA_BAR           3
+
+#define DMA_CHAN_STRIDE         0x80
+#define DMA_REG_CMD             0x00
+#define DMA_REG_RING_SIZE       0x14
+#define DMA_REG_RING_HEAD       0x18
+#define DMA_REG_RING_TAIL       0x1C
+#define DMA_REG_STATUS          0x20
+#define DMA_REG_COMPLETED       0x24
+#define DMA_REG_CSUM            0x28
+#define DMA_REG_SRC64           0x30
+#define DMA_REG_DST64           0x38
+#define DMA_REG_LEN64           0x40
+#define DMA_REG_RING_BASE64     0x48
+
+#define DMA_CMD_RUN                 1
+#define DMA_DIRECTION_TO_DEVICE     0
+#define DMA_DIRECTION_FROM_DEVICE   1
+#define DMA_CSUM_CRC32C             1
+#define DMA_CSUM_SHIFT              4
+#define DMA_OP_XFER                 0
+#define DMA_OP_COPY                 1
+#define DMA_OP_DEV_FILL             4
+#define DMA_OP_COMPRESS             5
+#define DMA_OP_DECOMPRESS           6
+#define DMA_OP_SHIFT                8
+
+#define DMA_STS_BUSY                (1 << 0)
+#define DMA_STS_DONE                (1 << 1)
+#define DMA_STS_ERROR               (1 << 2)
+
+#define DMA_DESC_F_CHAIN            (1 << 2)
+#define DMA_DESC_STS_DONE           (1 << 0)
+#define DMA_DESC_STS_ERROR          (1 << 1)
+
+typedef struct QEMU_PACKED dma_desc {
+    uint64_t src;
+    uint64_t dst;
+    uint32_t len;
+    uint32_t flags;
+    uint32_t status;
+    uint32_t csum;
+    uint64_t ts_submit;
+    uint64_t ts_start;
+    uint64_t ts_complete;
+    uint32_t dst_len;
+    uint32_t out_len;
+} dma_desc;
+
+#define C_PCI_DEVFN             QPCI_DEVFN(4, 0)
+#define BAR1_SIZE               (16 * MiB)
+#define RING_ENTRIES            16
+
+/* The bottom halves of the device run between two qtest commands, a request
+ * is done after a few status reads. Generous for slow CI hosts. */
+#define DMA_TIMEOUT_US          (10 * G_USEC_PER_SEC)
+
+/* Throughput matrix, every size moves at least PERF_MIN_BYTES. */
+#define PERF_MMIO_ITERS         10000
+#define PERF_MIN_BYTES          (64 * MiB)
+
+typedef struct CPciTest {
+    QOSState *qs;
+    QPCIDevice *dev;
+    QPCIBar bar0;
+    QPCIBar bar1;
+    QPCIBar bar3;
+} CPciTest;
+
+static void c_pci_setup(CPciTest *t)
+{
+    t->qs = qtest_pc_boot("-device c_pci_dev,addr=04.0,bar1-size=%" PRIu64,
+                          (uint64_t)BAR1_SIZE);
+    t->dev = qpci_device_find(t->qs->pcibus, C_PCI_DEVFN);
+    g_assert(t->dev != NULL);
+
+    qpci_device_enable(t->dev);
+    t->bar0 = qpci_iomap(t->dev, C_PCI_MMIO_BAR, NULL);
+    t->bar1 = qpci_iomap(t->dev, C_PCI_MEM_BAR, NULL);
+    t->bar3 = qpci_iomap(t->dev, C_PCI_DMA_BAR, NULL);
+}
+
+static void c_pci_teardown(CPciTest *t)
+{
+    g_free(t->dev);
+    qtest_shutdown(t->qs);
+}
+
+static uint32_t c_pci_compute(CPciTest *t, uint32_t opcode, uint32_t op1,
+                              uint32_t op2)
+{
+    qpci_io_writel(t->dev, t->bar0, REG_OP1, op1);
+    qpci_io_writel(t->dev, t->bar0, REG_OP2, op2);
+    qpci_io_writel(t->dev, t->bar0, REG_OPCODE, opcode);
+    return qpci_io_readl(t->dev, t->bar0, REG_RESULT);
+}
+
+/*
+ * Wait for the current request of channel @chan, acknowledge it and return
+ * its status.
+ */
+static uint32_t c_pci_dma_wait(CPciTest *t, uint32_t chan)
+{
+    uint64_t reg = chan * DMA_CHAN_STRIDE + DMA_REG_STATUS;
+    gint64 end = g_get_monotonic_time() + DMA_TIMEOUT_US;
+    uint32_t status;
+
+    do {
+        status = qpci_io_readl(t->dev, t->bar3, reg);
+    } while ((status & DMA_STS_BUSY) && g_get_monotonic_time() < end);
+
+    g_assert_false(status & DMA_STS_BUSY);
+    qpci_io_writel(t->dev, t->bar3, reg,
+                   status & (DMA_STS_DONE | DMA_STS_ERROR));
+    return status;
+}
+
+/* One request through the channel registers, returns its status. */
+static uint32_t c_pci_dma_run(CPciTest *t, uint32_t chan, uint32_t op,
+                              uint32_t dir, uint64_t src, uint64_t dst,
+                              uint64_t len)
+{
+    uint64_t regs = chan * DMA_CHAN_STRIDE;
+
+    qpci_io_writeq(t->dev, t->bar3, regs + DMA_REG_SRC64, src);
+    qpci_io_writeq(t->dev, t->bar3, regs + DMA_REG_DST64, dst);
+    qpci_io_writeq(t->dev, t->bar3, regs + DMA_REG_LEN64, len);
+    qpci_io_writel(t->dev, t->bar3, regs + DMA_REG_CMD,
+                   DMA_CMD_RUN | dir << 1 | op << DMA_OP_SHIFT);
+    return c_pci_dma_wait(t, chan);
+}
+
+/* Program a ring of RING_ENTRIES descriptors on @chan, returns its address. */
+static uint64_t c_pci_ring_init(CPciTest *t, uint32_t chan)
+{
+    uint64_t regs = chan * DMA_CHAN_STRIDE;
+    uint64_t ring = guest_alloc(&t->qs->alloc, RING_ENTRIES * sizeof(dma_desc));
+
+    qtest_memset(t->qs->qts, ring, 0, RING_ENTRIES * sizeof(dma_desc));
+    qpci_io_writeq(t->dev, t->bar3, regs + DMA_REG_RING_BASE64, ring);
+    qpci_io_writel(t->dev, t->bar3, regs + DMA_REG_RING_SIZE, RING_ENTRIES);
+    return ring;
+}
+
+/* Post @n descriptors at the ring tail of @chan and wait for them. */
+static uint32_t c_pci_ring_run(CPciTest *t, uint32_t chan, uint64_t ring,
+                               const dma_desc *descs, uint32_t n)
+{
+    uint64_t regs = chan * DMA_CHAN_STRIDE;
+    uint32_t tail = qpci_io_readl(t->dev, t->bar3, regs + DMA_REG_RING_TAIL);
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        qtest_memwrite(t->qs->qts,
+                       ring + ((tail + i) % RING_ENTRIES) * sizeof(dma_desc),
+                       &descs[i], sizeof(dma_desc));
+    }
+
+    qpci_io_writel(t->dev, t->bar3, regs + DMA_REG_RING_TAIL,
+                   (tail + n) % RING_ENTRIES);
+    return c_pci_dma_wait(t, chan);
+}
+
+static void c_pci_read_desc(CPciTest *t, uint64_t ring, uint32_t index,
+                            dma_desc *desc)
+{
+    qtest_memread(t->qs->qts, ring + index * sizeof(dma_desc), desc,
+                  sizeof(*desc));
+}
+
+static void test_compute(void)
+{
+    CPciTest t;
+
+    c_pci_setup(&t);
+
+    g_assert_cmphex(c_pci_compute(&t, OPCODE_ADD, 1, 2), ==, 3);
+    g_assert_cmphex(c_pci_compute(&t, OPCODE_SUB, 2, 3), ==, 0xffffffff);
+    g_assert_cmphex(c_pci_compute(&t, OPCODE_MUL, 0x10000, 0x10001),
+                    ==, 0x10000);
+    g_assert_cmphex(c_pci_compute(&t, OPCODE_DIV, 100, 7), ==, 14);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_ERROR), ==, 0);
+
+    /* Division by zero latches the compute error, write 1 clears it. */
+    c_pci_compute(&t, OPCODE_DIV, 1, 0);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_ERROR), ==, ERR_COMPUTE);
+    qpci_io_writel(t.dev, t.bar0, REG_ERROR, ERR_COMPUTE);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_ERROR), ==, 0);
+
+    c_pci_teardown(&t);
+}
+
+static void test_tagged(void)
+{
+    gint64 end = g_get_monotonic_time() + DMA_TIMEOUT_US;
+    CPciTest t;
+    uint32_t tag;
+
+    c_pci_setup(&t);
+
+    for (tag = 0; tag < 8; tag++) {
+        qpci_io_writeq(t.dev, t.bar0, REG_TAG_OPS, (uint64_t)tag << 32 | 100);
+        qpci_io_writel(t.dev, t.bar0, REG_TAG_CMD,
+                       (tag % 2 ? OPCODE_DIV : OPCODE_ADD) <<
+                       TAG_CMD_OPCODE_SHIFT | tag);
+    }
+
+    while (qpci_io_readl(t.dev, t.bar0, REG_TAG_DONE) != 0xff &&
+           g_get_monotonic_time() < end) {
+    }
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_TAG_DONE), ==, 0xff);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_TAG_ERROR), ==, 0);
+
+    for (tag = 0; tag < 8; tag++) {
+        g_assert_cmpuint(qpci_io_readl(t.dev, t.bar0,
+                                       REG_TAG_RESULT + tag * 4),
+                         ==, tag % 2 ? 100 / tag : 100 + tag);
+    }
+
+    /* Tag 0 again, division by zero fails only that tag. */
+    qpci_io_writel(t.dev, t.bar0, REG_TAG_DONE, 0xff);
+    qpci_io_writeq(t.dev, t.bar0, REG_TAG_OPS, 1);
+    qpci_io_writel(t.dev, t.bar0, REG_TAG_CMD,
+                   OPCODE_DIV << TAG_CMD_OPCODE_SHIFT);
+    while (qpci_io_readl(t.dev, t.bar0, REG_TAG_DONE) != 1 &&
+           g_get_monotonic_time() < end) {
+    }
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_TAG_ERROR), ==, 1);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_TAG_RESULT), ==, 0);
+
+    c_pci_teardown(&t);
+}
+
+static void test_bar1(void)
+{
+    g_autofree uint8_t *in = g_malloc(64 * KiB);
+    g_autofree uint8_t *out = g_malloc(64 * KiB);
+    CPciTest t;
+    size_t i;
+
+    c_pci_setup(&t);
+
+    for (i = 0; i < 64 * KiB; i++) {
+        in[i] = i * 7;
+    }
+
+    /* Start, end and an unaligned range of device memory. */
+    qpci_memwrite(t.dev, t.bar1, 0, in, 64 * KiB);
+    qpci_memread(t.dev, t.bar1, 0, out, 64 * KiB);
+    g_assert(memcmp(in, out, 64 * KiB) == 0);
+
+    qpci_memwrite(t.dev, t.bar1, BAR1_SIZE - 4 * KiB, in, 4 * KiB);
+    qpci_memread(t.dev, t.bar1, BAR1_SIZE - 4 * KiB, out, 4 * KiB);
+    g_assert(memcmp(in, out, 4 * KiB) == 0);
+
+    qpci_memwrite(t.dev, t.bar1, 12345, in, 333);
+    qpci_memread(t.dev, t.bar1, 12345, out, 333);
+    g_assert(memcmp(in, out, 333) == 0);
+
+    c_pci_teardown(&t);
+}
+
+static void test_dma_xfer(void)
+{
+    g_autofree uint8_t *in = g_malloc(256 * KiB);
+    g_autofree uint8_t *out = g_malloc0(256 * KiB);
+    uint32_t chans, chan;
+    uint64_t buf;
+    CPciTest t;
+    size_t i;
+
+    c_pci_setup(&t);
+
+    for (i = 0; i < 256 * KiB; i++) {
+        in[i] = i ^ (i >> 8);
+    }
+    buf = guest_alloc(&t.qs->alloc, 256 * KiB);
+
+    /* Every channel, guest memory to device memory and back. */
+    chans = qpci_io_readl(t.dev, t.bar0, REG_DMA_CHANNELS);
+    g_assert_cmpuint(chans, >, 0);
+    for (chan = 0; chan < chans; chan++) {
+        qtest_memwrite(t.qs->qts, buf, in, 256 * KiB);
+        g_assert_cmphex(c_pci_dma_run(&t, chan, DMA_OP_XFER,
+                                      DMA_DIRECTION_TO_DEVICE,
+                                      buf, chan * 256 * KiB, 256 * KiB),
+                        ==, DMA_STS_DONE);
+        qpci_memread(t.dev, t.bar1, chan * 256 * KiB, out, 256 * KiB);
+        g_assert(memcmp(in, out, 256 * KiB) == 0);
+
+        qtest_memset(t.qs->qts, buf, 0, 256 * KiB);
+        g_assert_cmphex(c_pci_dma_run(&t, chan, DMA_OP_XFER,
+                                      DMA_DIRECTION_FROM_DEVICE,
+                                      chan * 256 * KiB, buf, 256 * KiB),
+                        ==, DMA_STS_DONE);
+        qtest_memread(t.qs->qts, buf, out, 256 * KiB);
+        g_assert(memcmp(in, out, 256 * KiB) == 0);
+    }
+
+    /* Out of device memory fails and latches the DMA error. */
+    g_assert_cmphex(c_pci_dma_run(&t, 0, DMA_OP_XFER, DMA_DIRECTION_TO_DEVICE,
+                                  buf, BAR1_SIZE - 4 * KiB, 8 * KiB),
+                    ==, DMA_STS_DONE | DMA_STS_ERROR);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar0, REG_ERROR) & ERR_DMA,
+                    ==, ERR_DMA);
+    qpci_io_writel(t.dev, t.bar0, REG_ERROR, ERR_DMA);
+
+    guest_free(&t.qs->alloc, buf);
+    c_pci_teardown(&t);
+}
+
+static void test_dma_ring(void)
+{
+    g_autofree uint8_t *in = g_malloc(96 * KiB);
+    g_autofree uint8_t *out = g_malloc0(96 * KiB);
+    uint64_t ring, src, dst;
+    dma_desc descs[3];
+    dma_desc done;
+    uint32_t csum;
+    CPciTest t;
+    size_t i;
+
+    c_pci_setup(&t);
+
+    for (i = 0; i < 96 * KiB; i++) {
+        in[i] = i * 13;
+    }
+    src = guest_alloc(&t.qs->alloc, 96 * KiB);
+    dst = guest_alloc(&t.qs->alloc, 96 * KiB);
+    qtest_memwrite(t.qs->qts, src, in, 96 * KiB);
+    ring = c_pci_ring_init(&t, 1);
+
+    /* A chain of three guest to guest copies with a CRC32C over all. */
+    memset(descs, 0, sizeof(descs));
+    for (i = 0; i < 3; i++) {
+        descs[i].src = cpu_to_le64(src + i * 32 * KiB);
+        descs[i].dst = cpu_to_le64(dst + i * 32 * KiB);
+        descs[i].len = cpu_to_le32(32 * KiB);
+        descs[i].flags = cpu_to_le32(DMA_OP_COPY << DMA_OP_SHIFT |
+                                     DMA_CSUM_CRC32C << DMA_CSUM_SHIFT |
+                                     (i < 2 ? DMA_DESC_F_CHAIN : 0));
+    }
+    g_assert_cmphex(c_pci_ring_run(&t, 1, ring, descs, 3), ==, DMA_STS_DONE);
+
+    qtest_memread(t.qs->qts, dst, out, 96 * KiB);
+    g_assert(memcmp(in, out, 96 * KiB) == 0);
+
+    csum = ~crc32c(0xffffffff, in, 96 * KiB);
+    for (i = 0; i < 3; i++) {
+        c_pci_read_desc(&t, ring, i, &done);
+        g_assert_cmphex(le32_to_cpu(done.status), ==, DMA_DESC_STS_DONE);
+        g_assert_cmpuint(le64_to_cpu(done.ts_start), >=,
+                         le64_to_cpu(done.ts_submit));
+        g_assert_cmpuint(le64_to_cpu(done.ts_complete), >=,
+                         le64_to_cpu(done.ts_start));
+    }
+    g_assert_cmphex(le32_to_cpu(done.csum), ==, csum);
+    g_assert_cmphex(qpci_io_readl(t.dev, t.bar3,
+                                  DMA_CHAN_STRIDE + DMA_REG_CSUM), ==, csum);
+    g_assert_cmpuint(qpci_io_readl(t.dev, t.bar3,
+                                   DMA_CHAN_STRIDE + DMA_REG_COMPLETED), ==, 1);
+    g_assert_cmpuint(qpci_io_readl(t.dev, t.bar3,
+                                   DMA_CHAN_STRIDE + DMA_REG_RING_HEAD), ==, 3);
+
+    /* A device fill with the pattern in `src`. */
+    memset(descs, 0, sizeof(descs));
+    descs[0].src = cpu_to_le64(0x0123456789abcdefULL);
+    descs[0].dst = cpu_to_le64(4 * KiB);
+    descs[0].len = cpu_to_le32(4 * KiB);
+    descs[0].flags = cpu_to_le32(DMA_OP_DEV_FILL << DMA_OP_SHIFT);
+    g_assert_cmphex(c_pci_ring_run(&t, 1, ring, descs, 1), ==, DMA_STS_DONE);
+    g_assert_cmphex(qpci_io_readq(t.dev, t.bar1, 4 * KiB + 8), ==,
+                    0x0123456789abcdefULL);
+
+    guest_free(&t.qs->alloc, src);
+    guest_free(&t.qs->alloc, dst);
+    guest_free(&t.qs->alloc, ring);
+    c_pci_teardown(&t);
+}
+
+#ifdef CONFIG_LZ4
+static void test_dma_lz4(void)
+{
+    g_autofree uint8_t *in = g_malloc(64 * KiB);
+    g_autofree uint8_t *out = g_malloc0(64 * KiB);
+    uint64_t ring, src, lz4, dst;
+    dma_desc desc;
+    uint32_t lz4_len;
+    CPciTest t;
+    size_t i;
+
+    c_pci_setup(&t);
+
+    /* Compressible, a short period. */
+    for (i = 0; i < 64 * KiB; i++) {
+        in[i] = "c_pci_dev"[i % 9];
+    }
+    src = guest_alloc(&t.qs->alloc, 64 * KiB);
+    lz4 = guest_alloc(&t.qs->alloc, 64 * KiB);
+    dst = guest_alloc(&t.qs->alloc, 64 * KiB);
+    qtest_memwrite(t.qs->qts, src, in, 64 * KiB);
+    ring = c_pci_ring_init(&t, 0);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.src = cpu_to_le64(src);
+    desc.dst = cpu_to_le64(lz4);
+    desc.len = cpu_to_le32(64 * KiB);
+    desc.flags = cpu_to_le32(DMA_OP_COMPRESS << DMA_OP_SHIFT);
+    desc.dst_len = cpu_to_le32(64 * KiB);
+    g_assert_cmphex(c_pci_ring_run(&t, 0, ring, &desc, 1), ==, DMA_STS_DONE);
+    c_pci_read_desc(&t, ring, 0, &desc);
+    lz4_len = le32_to_cpu(desc.out_len);
+    g_assert_cmpuint(lz4_len, >, 0);
+    g_assert_cmpuint(lz4_len, <, 4 * KiB);
+
+    memset(&desc, 0, sizeof(desc));
+    desc.src = cpu_to_le64(lz4);
+    desc.dst = cpu_to_le64(dst);
+    desc.len = cpu_to_le32(lz4_len);
+    desc.flags = cpu_to_le32(DMA_OP_DECOMPRESS << DMA_OP_SHIFT);
+    desc.dst_len = cpu_to_le32(64 * KiB);
+    g_assert_cmphex(c_pci_ring_run(&t, 0, ring, &desc, 1), ==, DMA_STS_DONE);
+    c_pci_read_desc(&t, ring, 1, &desc);
+    g_assert_cmpuint(le32_to_cpu(desc.out_len), ==, 64 * KiB);
+    qtest_memread(t.qs->qts, dst, out, 64 * KiB);
+    g_assert(memcmp(in, out, 64 * KiB) == 0);
+
+    /* Too little room is not an error, the output length is 0. */
+    memset(&desc, 0, sizeof(desc));
+    desc.src = cpu_to_le64(src);
+    desc.dst = cpu_to_le64(lz4);
+    desc.len = cpu_to_le32(64 * KiB);
+    desc.flags = cpu_to_le32(DMA_OP_COMPRESS << DMA_OP_SHIFT);
+    desc.dst_len = cpu_to_le32(16);
+    g_assert_cmphex(c_pci_ring_run(&t, 0, ring, &desc, 1), ==, DMA_STS_DONE);
+    c_pci_read_desc(&t, ring, 2, &desc);
+    g_assert_cmpuint(le32_to_cpu(desc.out_len), ==, 0);
+
+    guest_free(&t.qs->alloc, src);
+    guest_free(&t.qs->alloc, lz4);
+    guest_free(&t.qs->alloc, dst);
+    guest_free(&t.qs->alloc, ring);
+    c_pci_teardown(&t);
+}
+#endif
+
+/*
+ * MMIO round trip of the harness to the device model and back, for a read
+ * without side effects and for a write executing an operation.
+ */
+static void test_perf_mmio(void)
+{
+    gint64 start;
+    double ns;
+    CPciTest t;
+    uint32_t i;
+
+    c_pci_setup(&t);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PERF_MMIO_ITERS; i++) {
+        qpci_io_readl(t.dev, t.bar0, REG_DMA_CHANNELS);
+    }
+    ns = (g_get_monotonic_time() - start) * 1000.0 / PERF_MMIO_ITERS;
+    g_test_minimized_result(ns, "MMIO read: %.0f ns", ns);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < PERF_MMIO_ITERS; i++) {
+        qpci_io_writel(t.dev, t.bar0, REG_OPCODE, OPCODE_ADD);
+    }
+    ns = (g_get_monotonic_time() - start) * 1000.0 / PERF_MMIO_ITERS;
+    g_test_minimized_result(ns, "MMIO write + compute: %.0f ns", ns);
+
+    c_pci_teardown(&t);
+}
+
+/*
+ * DMA bytes/s of the register interface and of the descriptor ring, per
+ * request size. Small sizes measure the per request cost, large ones the
+ * copy.
+ */
+static void test_perf_dma(void)
+{
+    static const uint64_t sizes[] = {
+        4 * KiB, 64 * KiB, 1 * MiB, 16 * MiB,
+    };
+    uint64_t ring, buf;
+    dma_desc desc;
+    CPciTest t;
+    size_t i;
+
+    c_pci_setup(&t);
+
+    buf = guest_alloc(&t.qs->alloc, 16 * MiB);
+    ring = c_pci_ring_init(&t, 0);
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        uint64_t iters = MAX(PERF_MIN_BYTES / sizes[i], 16);
+        gint64 start;
+        double mbps;
+        uint64_t n;
+
+        start = g_get_monotonic_time();
+        for (n = 0; n < iters; n++) {
+            c_pci_dma_run(&t, 0, DMA_OP_XFER, DMA_DIRECTION_TO_DEVICE,
+                          buf, 0, sizes[i]);
+        }
+        mbps = sizes[i] * iters / (double)(g_get_monotonic_time() - start);
+        g_test_maximized_result(mbps,
+                                "DMA registers %" PRIu64 " KiB: %.1f MB/s",
+                                sizes[i] / KiB, mbps);
+
+        memset(&desc, 0, sizeof(desc));
+        desc.src = cpu_to_le64(buf);
+        desc.len = cpu_to_le32(sizes[i]);
+        desc.flags = cpu_to_le32(DMA_OP_XFER << DMA_OP_SHIFT |
+                                 DMA_DIRECTION_TO_DEVICE << 1);
+        start = g_get_monotonic_time();
+        for (n = 0; n < iters; n++) {
+            c_pci_ring_run(&t, 0, ring, &desc, 1);
+        }
+        mbps = sizes[i] * iters / (double)(g_get_monotonic_time() - start);
+        g_test_maximized_result(mbps, "DMA ring %" PRIu64 " KiB: %.1f MB/s",
+                                sizes[i] / KiB, mbps);
+    }
+
+    guest_free(&t.qs->alloc, buf);
+    guest_free(&t.qs->alloc, ring);
+    c_pci_teardown(&t);
+}
+
+int main(int argc, char **argv)
+{
+    const char *arch = qtest_get_arch();
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (strcmp(arch, "i386") && strcmp(arch, "x86_64")) {
+        return g_test_run();
+    }
+
+    qtest_add_func("/c_pci_dev/compute", test_compute);
+    qtest_add_func("/c_pci_dev/tagged", test_tagged);
+    qtest_add_func("/c_pci_dev/bar1", test_bar1);
+    qtest_add_func("/c_pci_dev/dma/xfer", test_dma_xfer);
+    qtest_add_func("/c_pci_dev/dma/ring", test_dma_ring);
+#ifdef CONFIG_LZ4
+    qtest_add_func("/c_pci_dev/dma/lz4", test_dma_lz4);
+#endif
+    if (g_test_perf()) {
+        qtest_add_func("/c_pci_dev/perf/mmio", test_perf_mmio);
+        qtest_add_func("/c_pci_dev/perf/dma", test_perf_dma);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define OPCODE_ADD              0x00
+#define OPCODE_MUL              0x01
+#define OPCODE_DIV              0x02
+#define OPCODE_SUB              0x03
+
+/* Same as `struct c_pci_batch` in the driver. */
+struct c_pci_batch {
+    uint64_t op1;
+    uint64_t op2;
+    uint64_t result;
+    uint32_t count;
+    uint32_t opcode;
+    uint32_t flags;
+    uint32_t done;
+};
+
+#define C_PCI_BATCH_F_DIV_ZERO  (1 << 0)
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_BATCH       _IOWR(C_PCI_IOCTL_MAGIC, 1, struct c_pci_batch)
+
+#define NR_OPS                  (4 * 1024 * 1024)
+
+int main()
+{
+    struct timespec start, end;
+    uint32_t i;
+    double sec = 0;
+
+    int fd = open("/dev/c_pci_dev", O_RDWR);
+    if (fd < 0) {
+        printf("Cannot open device file\n");
+        return -1;
+    }
+
+    uint32_t *op1 = malloc(NR_OPS * sizeof(uint32_t));
+    uint32_t *op2 = malloc(NR_OPS * sizeof(uint32_t));
+    uint32_t *result = malloc(NR_OPS * sizeof(uint32_t));
+    if (op1 == NULL || op2 == NULL || result == NULL) {
+        printf("Cannot allocate buffers\n");
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < NR_OPS; i++) {
+        op1[i] = i;
+        op2[i] = 3;
+    }
+
+    /* One call, the driver and the device split it in batches. */
+    struct c_pci_batch batch = {
+        .op1 = (uintptr_t)op1,
+        .op2 = (uintptr_t)op2,
+        .result = (uintptr_t)result,
+        .count = NR_OPS,
+        .opcode = OPCODE_MUL,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(fd, C_PCI_IOCTL_BATCH, &batch) < 0) {
+        printf("Batch failed after %u ops\n", batch.done);
+        close(fd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < NR_OPS; i++) {
+        if (result[i] != op1[i] * op2[i]) {
+            printf("Wrong result at %u: %u\n", i, result[i]);
+            break;
+        }
+    }
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Test batch mul: %u ops in %.3f s (%.1f Mops/s)\n",
+           batch.done, sec, batch.done / sec / 1e6);
+
+    free(op1);
+    free(op2);
+    free(result);
+    close(fd);
+
+    return 0;
+}
@@ -4,16 +4,35 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-#define BAR_0_LENGTH (0x40)   // 64 byte.
+#define BAR_0_LENGTH (0x1000)   // 4 KiB, registers and tag results.
 #define REG_OP1                 0x10
 #define REG_OP2                 0x14
 #define REG_OPCODE              0x18
 #define REG_RESULT              0x20
 #define REG_ERROR               0x24
+#define REG_TAG_OPS             0x80
+#define REG_TAG_CMD             0x88
+#define REG_TAG_DONE            0x8C
+#define REG_TAG_RESULT          0x200
+#define TAG_CMD_OPCODE_SHIFT    8
+#define NR_TAGS                 4
 #define OPCODE_ADD              0x00
 #define OPCODE_MUL              0x01
 #define OPCODE_DIV              0x02
 #define OPCODE_SUB              0x03
+
+/* mmap() offset of BAR1 (device memory), see C_PCI_MMAP_BAR_SHIFT. */
+#define BAR_1_MMAP_OFFSET       ((off_t)1 << 40)
+#define BAR_1_MAP_LENGTH        (4096)
+
+/* mmap() offset of the status write-back page, see C_PCI_MMAP_WB. The device
+   copies its registers there, we poll it instead of reading REG_RESULT. */
+#define WB_MMAP_OFFSET          ((off_t)7 << 40)
+#define WB_MAP_LENGTH           (4096)
+#define WB_SEQ                  0x00
+#define WB_RESULT               0x04
+#define WB_TAG_DONE             0x14
+#define WB_TAG_RESULT           0xA0
 int main()
 {
     int fd = open("/dev/c_pci_dev", O_RDWR);
@@ -37,6 +56,18 @@ int main()
     }
 
     printf("mmap() success!.\n");
+
+    const uint8_t *wb = mmap(NULL, WB_MAP_LENGTH, PROT_READ, MAP_SHARED, fd,
+                             WB_MMAP_OFFSET);
+    if (wb == MAP_FAILED) {
+        printf("Failed to map the status write-back page\n");
+        munmap(pci_dev_bar0_base, BAR_0_LENGTH);
+        close(fd);
+        return -1;
+    }
+
+    uint32_t seq = __atomic_load_n((const uint32_t *)(wb + WB_SEQ), __ATOMIC_ACQUIRE);
+
     uint32_t *ptr = (uint32_t *)(pci_dev_bar0_base + REG_OP1);
     *ptr = 1;
 
@@ -46,9 +77,53 @@ int main()
     ptr = (uint32_t *)(pci_dev_bar0_base + REG_OPCODE);
     *ptr = OPCODE_ADD;
 
-    printf("Test add operator: %d \n", *(uint32_t *)(pci_dev_bar0_base + REG_RESULT));
+    /* Spin on cached memory, the acquire load orders the result read after
+       the sequence number. */
+    while (__atomic_load_n((const uint32_t *)(wb + WB_SEQ), __ATOMIC_ACQUIRE) == seq) {
+    }
+
+    printf("Test add operator: %d \n", *(const uint32_t *)(wb + WB_RESULT));
+
+    /* Tagged operations: push them back to back, the device works on the
+       first ones while we push the next. Results come back by tag. */
+    uint32_t tag;
+
+    *(volatile uint32_t *)(pci_dev_bar0_base + REG_TAG_DONE) = (1u << NR_TAGS) - 1;
+    for (tag = 0; tag < NR_TAGS; tag++) {
+        *(volatile uint64_t *)(pci_dev_bar0_base + REG_TAG_OPS) = ((uint64_t)3 << 32) | (tag + 1);
+        *(volatile uint32_t *)(pci_dev_bar0_base + REG_TAG_CMD) = (OPCODE_MUL << TAG_CMD_OPCODE_SHIFT) | tag;
+    }
 
+    while ((__atomic_load_n((const uint32_t *)(wb + WB_TAG_DONE), __ATOMIC_ACQUIRE) &
+            ((1u << NR_TAGS) - 1)) != (1u << NR_TAGS) - 1) {
+    }
+
+    for (tag = 0; tag < NR_TAGS; tag++) {
+        printf("Test tagged mul, tag %u: %u \n", tag,
+               ((const uint32_t *)(wb + WB_TAG_RESULT))[tag]);
+    }
+
+    munmap((void *)wb, WB_MAP_LENGTH);
     munmap(pci_dev_bar0_base, BAR_0_LENGTH);
+
+    /* Device memory is plain RAM on the device side, we can use it like any
+       other buffer. */
+    uint8_t *pci_dev_bar1_base = mmap(NULL,
+                                      BAR_1_MAP_LENGTH,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED,
+                                      fd,
+                                      BAR_1_MMAP_OFFSET);
+    if (pci_dev_bar1_base == MAP_FAILED) {
+        printf("Failed to map with PCI BAR 1\n");
+        close(fd);
+        return -1;
+    }
+
+    pci_dev_bar1_base[0] = 0x5a;
+    printf("Test device memory: 0x%x \n", pci_dev_bar1_base[0]);
+
+    munmap(pci_dev_bar1_base, BAR_1_MAP_LENGTH);
     close(fd);
 
     return 0;
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* Same as `struct c_pci_p2p_copy` in the driver. */
+struct c_pci_p2p_copy {
+    int32_t peer_fd;
+    uint32_t flags;
+    uint64_t src;
+    uint64_t dst;
+    uint64_t len;
+};
+
+#define C_PCI_P2P_F_BOUNCE      (1 << 0)
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_P2P_COPY    _IOWR(C_PCI_IOCTL_MAGIC, 5, struct c_pci_p2p_copy)
+
+#define COPY_LEN                (1024 * 1024)
+
+int main()
+{
+    struct timespec start, end;
+    uint32_t i;
+    double sec = 0;
+
+    /* Needs two devices: -device c_pci_dev -device c_pci_dev */
+    int fd = open("/dev/c_pci_dev", O_RDWR);
+    int peer_fd = open("/dev/c_pci_dev1", O_RDWR);
+    if (fd < 0 || peer_fd < 0) {
+        printf("Cannot open device files\n");
+        return -1;
+    }
+
+    uint32_t *in = malloc(COPY_LEN);
+    uint32_t *out = malloc(COPY_LEN);
+    if (in == NULL || out == NULL) {
+        printf("Cannot allocate buffers\n");
+        close(fd);
+        close(peer_fd);
+        return -1;
+    }
+
+    for (i = 0; i < COPY_LEN / sizeof(uint32_t); i++) {
+        in[i] = i * 2654435761u;
+    }
+    memset(out, 0, COPY_LEN);
+
+    if (pwrite(fd, in, COPY_LEN, 0) != COPY_LEN ||
+        pwrite(peer_fd, out, COPY_LEN, 0) != COPY_LEN) {
+        printf("Cannot write device memory\n");
+        close(fd);
+        close(peer_fd);
+        return -1;
+    }
+
+    /* Device memory of the first device to the second one. */
+    struct c_pci_p2p_copy copy = {
+        .peer_fd = peer_fd,
+        .src = 0,
+        .dst = 0,
+        .len = COPY_LEN,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(fd, C_PCI_IOCTL_P2P_COPY, &copy) < 0) {
+        printf("P2P copy failed\n");
+        close(fd);
+        close(peer_fd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (pread(peer_fd, out, COPY_LEN, 0) != COPY_LEN) {
+        printf("Cannot read device memory\n");
+    } else if (memcmp(in, out, COPY_LEN) != 0) {
+        printf("Wrong data in peer memory\n");
+    }
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Test p2p copy (%s): %u bytes in %.6f s (%.1f MB/s)\n",
+           copy.flags & C_PCI_P2P_F_BOUNCE ? "bounce" : "direct",
+           COPY_LEN, sec, COPY_LEN / sec / 1e6);
+
+    free(in);
+    free(out);
+    close(fd);
+    close(peer_fd);
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* Same as `struct c_pci_insn` and the PROG_* opcodes in the driver. */
+struct c_pci_insn {
+    uint8_t op;
+    uint8_t reserved[3];
+    uint32_t imm;
+};
+
+#define PROG_MAP_MUL            0x03
+#define PROG_FILTER_GT          0x14
+#define PROG_EMIT               0x20
+#define PROG_REDUCE_SUM         0x30
+
+struct c_pci_prog {
+    uint64_t insns;
+    uint32_t count;
+    uint32_t slot;
+};
+
+struct c_pci_prog_run {
+    uint64_t input;
+    uint64_t output;
+    uint64_t result;
+    uint32_t count;
+    uint32_t slot;
+    uint32_t emitted;
+    uint32_t reserved;
+};
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_PROG_LOAD   _IOW(C_PCI_IOCTL_MAGIC, 6, struct c_pci_prog)
+#define C_PCI_IOCTL_PROG_RUN    _IOWR(C_PCI_IOCTL_MAGIC, 7, struct c_pci_prog_run)
+
+#define NR_ELEMENTS             (4 * 1024 * 1024)
+#define THRESHOLD               1000000
+
+int main()
+{
+    struct timespec start, end;
+    uint64_t sum = 0;
+    uint32_t emitted = 0;
+    uint32_t i;
+    double sec = 0;
+
+    /* x = 3 * x, keep x > THRESHOLD, emit x, sum x. */
+    struct c_pci_insn insns[] = {
+        { .op = PROG_MAP_MUL, .imm = 3 },
+        { .op = PROG_FILTER_GT, .imm = THRESHOLD },
+        { .op = PROG_EMIT },
+        { .op = PROG_REDUCE_SUM },
+    };
+
+    int fd = open("/dev/c_pci_dev", O_RDWR);
+    if (fd < 0) {
+        printf("Cannot open device file\n");
+        return -1;
+    }
+
+    struct c_pci_prog prog = {
+        .insns = (uintptr_t)insns,
+        .count = sizeof(insns) / sizeof(insns[0]),
+        .slot = 0,
+    };
+
+    if (ioctl(fd, C_PCI_IOCTL_PROG_LOAD, &prog) < 0) {
+        printf("Program load failed\n");
+        close(fd);
+        return -1;
+    }
+
+    uint32_t *input = malloc(NR_ELEMENTS * sizeof(uint32_t));
+    uint32_t *output = malloc(NR_ELEMENTS * sizeof(uint32_t));
+    if (input == NULL || output == NULL) {
+        printf("Cannot allocate buffers\n");
+        close(fd);
+        return -1;
+    }
+
+    for (i = 0; i < NR_ELEMENTS; i++) {
+        input[i] = rand() % (2 * THRESHOLD);
+    }
+
+    /* One call, the driver streams the input through the device. */
+    struct c_pci_prog_run run = {
+        .input = (uintptr_t)input,
+        .output = (uintptr_t)output,
+        .count = NR_ELEMENTS,
+        .slot = prog.slot,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(fd, C_PCI_IOCTL_PROG_RUN, &run) < 0) {
+        printf("Program run failed\n");
+        close(fd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < NR_ELEMENTS; i++) {
+        uint32_t x = input[i] * 3;
+
+        if (x <= THRESHOLD) {
+            continue;
+        }
+        if (emitted < run.emitted && output[emitted] != x) {
+            printf("Wrong element at %u: %u\n", emitted, output[emitted]);
+            break;
+        }
+        emitted++;
+        sum += x;
+    }
+
+    if (emitted != run.emitted || sum != run.result) {
+        printf("Wrong result: %u elements, sum %llu\n",
+               run.emitted, (unsigned long long)run.result);
+    }
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Test program: %u elements in %.3f s (%.1f Melem/s), %u emitted\n",
+           run.count, sec, run.count / sec / 1e6, run.emitted);
+
+    free(input);
+    free(output);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#define OPCODE_ADD              0x00
+#define OPCODE_MUL              0x01
+#define OPCODE_DIV              0x02
+#define OPCODE_SUB              0x03
+
+/* Same as `struct c_pci_sqe`, `struct c_pci_cqe` and `struct c_pci_submit` in
+ * the driver. */
+struct c_pci_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t op1;
+    uint32_t op2;
+    uint32_t len;
+    uint64_t src;
+    uint64_t dst;
+    uint64_t aux;
+    uint8_t reserved[24];
+} __attribute__((packed));
+
+struct c_pci_cqe {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t reserved2;
+    uint16_t cid;
+    uint16_t status;
+} __attribute__((packed));
+
+struct c_pci_submit {
+    uint64_t sqes;
+    uint64_t cqes;
+    uint32_t count;
+    uint32_t done;
+};
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_SUBMIT      _IOWR(C_PCI_IOCTL_MAGIC, 2, struct c_pci_submit)
+
+#define NR_CMDS                 (64 * 1024)
+
+int main()
+{
+    struct timespec start, end;
+    uint32_t i;
+    double sec = 0;
+
+    int fd = open("/dev/c_pci_dev", O_RDWR);
+    if (fd < 0) {
+        printf("Cannot open device file\n");
+        return -1;
+    }
+
+    struct c_pci_sqe *sqes = calloc(NR_CMDS, sizeof(*sqes));
+    struct c_pci_cqe *cqes = calloc(NR_CMDS, sizeof(*cqes));
+    if (sqes == NULL || cqes == NULL) {
+        printf("Cannot allocate queues\n");
+        close(fd);
+        return -1;
+    }
+
+    /* Mix of operators, every 1000th command divides by zero. */
+    for (i = 0; i < NR_CMDS; i++) {
+        sqes[i].opcode = i % 4;
+        sqes[i].op1 = i;
+        sqes[i].op2 = (i % 1000) ? 7 : 0;
+    }
+
+    struct c_pci_submit submit = {
+        .sqes = (uintptr_t)sqes,
+        .cqes = (uintptr_t)cqes,
+        .count = NR_CMDS,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(fd, C_PCI_IOCTL_SUBMIT, &submit) < 0) {
+        printf("Submit failed after %u commands\n", submit.done);
+        close(fd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint32_t failed = 0;
+    for (i = 0; i < NR_CMDS; i++) {
+        if (cqes[i].status != 0) {
+            failed++;
+        }
+    }
+
+    printf("cmd 9: %u * %u = %u\n", sqes[9].op1, sqes[9].op2, cqes[9].result);
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Test queue pairs: %u commands (%u failed) in %.3f s (%.1f Kcmds/s)\n",
+           submit.done, failed, sec, submit.done / sec / 1e3);
+
+    free(sqes);
+    free(cqes);
+    close(fd);
+
+    return 0;
+}
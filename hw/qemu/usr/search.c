@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+/* Same as `struct c_pci_pattern`, `struct c_pci_search_match` and
+ * `struct c_pci_search` in the driver. */
+#define C_PCI_SEARCH_MAX_LEN    56
+
+struct c_pci_pattern {
+    uint8_t len;
+    uint8_t reserved[7];
+    uint8_t bytes[C_PCI_SEARCH_MAX_LEN];
+};
+
+struct c_pci_search_match {
+    uint64_t offset;
+    uint32_t pattern;
+    uint32_t reserved;
+};
+
+struct c_pci_search {
+    uint64_t buf;
+    uint64_t len;
+    uint64_t patterns;
+    uint64_t matches;
+    uint64_t found;
+    uint32_t count;
+    uint32_t room;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_SEARCH      _IOWR(C_PCI_IOCTL_MAGIC, 8, struct c_pci_search)
+
+#define BUF_SIZE                (64 * 1024 * 1024)
+#define NR_MATCHES              (1024 * 1024)
+
+static const char *words[] = {
+    "GET /index.html ", "200 ", "user=admin ", "timeout ", "ERROR ",
+    "kernel: ", "panic ", "OK\n",
+};
+
+static const char *patterns[] = { "ERROR", "panic", "user=admin" };
+
+#define NR_WORDS                (sizeof(words) / sizeof(words[0]))
+#define NR_PATTERNS             (sizeof(patterns) / sizeof(patterns[0]))
+
+/* Matches of @pattern in @buf, with the C library. */
+static uint64_t count_matches(const char *buf, size_t len, const char *pattern)
+{
+    const char *p = buf;
+    uint64_t n = 0;
+
+    while ((p = memmem(p, buf + len - p, pattern, strlen(pattern))) != NULL) {
+        n++;
+        p++;
+    }
+
+    return n;
+}
+
+int main()
+{
+    struct c_pci_pattern pats[NR_PATTERNS];
+    struct timespec start, end;
+    uint64_t expected = 0;
+    size_t len = 0;
+    uint32_t i;
+    double sec = 0;
+
+    int fd = open("/dev/c_pci_dev", O_RDWR);
+    if (fd < 0) {
+        printf("Cannot open device file\n");
+        return -1;
+    }
+
+    char *buf = malloc(BUF_SIZE);
+    struct c_pci_search_match *matches = malloc(NR_MATCHES * sizeof(*matches));
+    if (buf == NULL || matches == NULL) {
+        printf("Cannot allocate buffers\n");
+        close(fd);
+        return -1;
+    }
+
+    /* A log made of random words. */
+    while (len + 16 < BUF_SIZE) {
+        const char *w = words[rand() % NR_WORDS];
+
+        memcpy(buf + len, w, strlen(w));
+        len += strlen(w);
+    }
+
+    memset(pats, 0, sizeof(pats));
+    for (i = 0; i < NR_PATTERNS; i++) {
+        pats[i].len = strlen(patterns[i]);
+        memcpy(pats[i].bytes, patterns[i], pats[i].len);
+        expected += count_matches(buf, len, patterns[i]);
+    }
+
+    struct c_pci_search search = {
+        .buf = (uintptr_t)buf,
+        .len = len,
+        .patterns = (uintptr_t)pats,
+        .matches = (uintptr_t)matches,
+        .count = NR_PATTERNS,
+        .room = NR_MATCHES,
+    };
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (ioctl(fd, C_PCI_IOCTL_SEARCH, &search) < 0) {
+        printf("Search failed\n");
+        close(fd);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (search.found != expected) {
+        printf("Wrong number of matches: %llu, expected %llu\n",
+               (unsigned long long)search.found, (unsigned long long)expected);
+    }
+
+    for (i = 0; i < search.found && i < NR_MATCHES; i++) {
+        const char *p = patterns[matches[i].pattern];
+
+        if (memcmp(buf + matches[i].offset, p, strlen(p)) != 0) {
+            printf("Wrong match at %llu\n", (unsigned long long)matches[i].offset);
+            break;
+        }
+    }
+
+    sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Test search: %zu bytes in %.3f s (%.1f MB/s), %llu matches\n",
+           len, sec, len / sec / 1e6, (unsigned long long)search.found);
+
+    free(buf);
+    free(matches);
+    close(fd);
+
+    return 0;
+}
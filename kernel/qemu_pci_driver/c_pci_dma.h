@@ -0,0 +1,32 @@
+/* c_pci_dma.h - copy engine of c_pci_dev for other kernel modules.
+ *
+ * Addresses are DMA addresses of the c_pci_dev PCI device, map buffers with
+ * c_pci_dma_device(). `mem` functions work on offsets in device memory (BAR1).
+ * All functions sleep until the device finished and return 0, -ENODEV without
+ * a device, -EINVAL, -ETIMEDOUT or -EIO.
+ *
+ * After -ETIMEDOUT the device may still access the buffers: leave them mapped
+ * and allocated. The copy engine channel which timed out is disabled, later
+ * calls on it return -EIO.
+ */
+
+#ifndef C_PCI_DMA_H
+#define C_PCI_DMA_H
+
+#include <linux/types.h>
+
+struct device;
+struct page;
+
+struct device *c_pci_dma_device(void);
+
+int c_pci_dma_memcpy(dma_addr_t dst, dma_addr_t src, size_t len);
+int c_pci_dma_fill(dma_addr_t dst, u64 pattern, size_t len);
+
+int c_pci_mem_copy(u64 dst, u64 src, size_t len);
+int c_pci_mem_fill(u64 dst, u64 pattern, size_t len);
+
+int c_pci_copy_page(struct page *dst, struct page *src);
+int c_pci_clear_page(struct page *page);
+
+#endif /* C_PCI_DMA_H */
@@ -3,6 +3,24 @@
 #include <linux/pci.h>
 #include <linux/delay.h>
 #include <linux/cdev.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/iopoll.h>
+#include <linux/uaccess.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/file.h>
+#include <linux/pci-p2pdma.h>
+#include <crypto/internal/acompress.h>
+#include <crypto/internal/hash.h>
+#include <crypto/sha2.h>
+
+#include "c_pci_dma.h"
 
 #define TYPE_PCI_CUSTOM_DEVICE  "c_pci_dev"
 #define DEVICE_VENDOR_ID        0x1234
@@ -13,248 +31,3245 @@
 #define REG_OPCODE              0x18
 #define REG_RESULT              0x20
 #define REG_ERROR               0x24
+#define REG_DMA_CHANNELS        0x28
+#define REG_BATCH_STATUS        0x2C
+#define REG_QUEUES              0x30
+#define REG_BATCH_OP1           0x40
+#define REG_BATCH_OP2           0x48
+#define REG_BATCH_RES           0x50
+#define REG_BATCH_COUNT         0x58
+#define REG_BATCH_OPCODE        0x5C
+#define REG_IRQ_STATUS          0x60
+#define REG_IRQ_MASK            0x64
+#define REG_IRQ_COAL_COUNT      0x68
+#define REG_IRQ_COAL_USEC       0x6C
+#define REG_WB_BASE             0x70
+#define REG_TIMESTAMP           0x78
+
+/**
+ * Tagged operations, see the QEMU device. Operands go to REG_TAG_OPS (op1 low,
+ * op2 high), the push is REG_TAG_CMD: tag in bits 4..0, opcode in bits 15..8.
+ * REG_TAG_DONE and REG_TAG_ERROR have one bit per tag, write 1 to clear, the
+ * result of tag N is at REG_TAG_RESULT + 4 * N. The compute vector fires when
+ * the queue drains. The arithmetic unit is user space's (BAR0 mmap()), the
+ * driver only mirrors the layout.
+ */
+#define REG_TAG_OPS             0x80
+#define REG_TAG_CMD             0x88
+#define REG_TAG_DONE            0x8C
+#define REG_TAG_ERROR           0x90
+#define REG_TAG_RESULT          0x200
+#define TAG_NR                  32
+
+/**
+ * BAR layout:
+ * BAR0 is registers of the arithmetic unit.
+ * BAR1 is device memory, 64 bit prefetchable RAM (also takes the BAR2 slot).
+ * BAR3 is DMA controller registers.
+ * BAR4 is MSI-X table.
+ * BAR5 is the submission BAR of the queue pairs, prefetchable.
+ */
+#define C_PCI_MMIO_BAR          0
+#define C_PCI_MEM_BAR           1
+#define C_PCI_DMA_BAR           3
+#define C_PCI_PUSH_BAR          5
+
+/* mmap() offset bits selecting the BAR. */
+#define C_PCI_MMAP_BAR_SHIFT    40
+
+/* mmap() "BAR" of the status write-back page, read only. */
+#define C_PCI_MMAP_WB           7
+
+/* Largest chunk moved by one read()/write() call. */
+#define C_PCI_RW_MAX            (128 * 1024)
 #define OPCODE_ADD              0x00
 #define OPCODE_MUL              0x01
 #define OPCODE_DIV              0x02
 #define OPCODE_SUB              0x03
 
-#define DMA_REG_CMD             0x00
-#define DMA_REG_SRC             0x04
-#define DMA_REG_DST             0x08
-#define DMA_REG_LEN             0x0C
+/* REG_ERROR bits, write 1 to clear. */
+#define ERR_COMPUTE             (1 << 0)
+#define ERR_DMA                 (1 << 1)
+
+/* REG_BATCH_STATUS bits, all but busy are write 1 to clear. */
+#define BATCH_STS_BUSY          (1 << 0)
+#define BATCH_STS_DONE          (1 << 1)
+#define BATCH_STS_ERROR         (1 << 2)
+#define BATCH_STS_DIV_ZERO      (1 << 3)
+
+/* Lanes per device batch, the ioctl splits bigger arrays. */
+#define C_PCI_BATCH_CHUNK       (64 * 1024)
+#define C_PCI_BATCH_TIMEOUT_MS  1000
+
+/**
+ * ioctl interface.
+ * C_PCI_IOCTL_BATCH: compute `result[i] = op1[i] <opcode> op2[i]` for `count`
+ * uint32_t lanes on the device. `flags` and `done` are written back: number
+ * of lanes computed, and C_PCI_BATCH_F_DIV_ZERO if a lane divided by zero
+ * (its result is 0).
+ */
+struct c_pci_batch {
+    __u64 op1;
+    __u64 op2;
+    __u64 result;
+    __u32 count;
+    __u32 opcode;
+    __u32 flags;
+    __u32 done;
+};
+
+#define C_PCI_BATCH_F_DIV_ZERO  (1 << 0)
+
+/**
+ * Queue pairs, see `c_pci_sqe` and `c_pci_cqe` in the QEMU device. Every queue
+ * pair has a register window in BAR0. The device executes SQ entries in order
+ * and posts one CQ entry per SQ entry, CQ entries of the current pass carry
+ * the current phase bit (1 on the first pass, flipped on every wrap).
+ */
+#define REG_QP_BASE             0x100
+#define QP_STRIDE               0x20
+#define QP_MAX                  4
+#define QP_ENTRIES              256
+
+#define QP_REG_SQ_BASE          0x00
+#define QP_REG_CQ_BASE          0x08
+#define QP_REG_SIZE             0x10
+#define QP_REG_SQ_TAIL          0x14
+#define QP_REG_SQ_HEAD          0x18
+#define QP_REG_CQ_HEAD          0x1C
+
+/* Window of a queue pair in the submission BAR, slot N is SQ entry N. A
+ * complete entry written there is submitted, without a doorbell. */
+#define QP_PUSH_STRIDE          (4096 * 64)
+
+#define SQE_F_VECTOR            (1 << 0)
+#define SQE_F_SGL               (1 << 1)
+#define SQE_F_DEVMEM            (1 << 2)
+
+/* Engine opcodes, see the QEMU device. */
+#define OPCODE_SHA256           0x10
+#define OPCODE_PROG_LOAD        0x11
+#define OPCODE_PROG_RUN         0x12
+#define OPCODE_SEARCH           0x13
+
+/* OPCODE_PROG_RUN `op2`, the reduction goes on from the accumulator. */
+#define PROG_RUN_F_CONTINUE     (1 << 0)
+
+#define CQE_STS_SUCCESS         0
+#define CQE_STS_INVALID_OPCODE  1
+#define CQE_STS_DIV_ZERO        2
+#define CQE_STS_DMA_ERROR       3
+#define CQE_STS_INVALID_FIELD   4
+
+#define CQE_PHASE(status)       ((status) & 1)
+#define CQE_CODE(status)        ((status) >> 1)
+
+struct c_pci_sqe {
+    __u8 opcode;
+    __u8 flags;
+    __le16 cid;
+    __le32 op1;
+    __le32 op2;
+    __le32 len;
+    __le64 src;
+    __le64 dst;
+    __le64 aux;
+    __u8 reserved[24];
+} __packed;
+
+struct c_pci_cqe {
+    __le32 result;
+    __le32 reserved;
+    __le16 sq_head;
+    __le16 reserved2;
+    __le16 cid;
+    __le16 status;
+} __packed;
+
+/* Gather list entry of SQE_F_SGL commands. */
+struct c_pci_sg {
+    __le64 addr;
+    __le32 len;
+    __le32 reserved;
+} __packed;
+
+/* Match of OPCODE_SEARCH, the offset is from `src` of the command. */
+struct c_pci_match {
+    __le32 offset;
+    __le32 pattern;
+} __packed;
+
+/**
+ * C_PCI_IOCTL_SUBMIT: queue `count` SQ entries at once and wait for all of
+ * them. `cqes` receives one completion per entry, in submission order, `cid`
+ * is the index of the entry and `status` the status code (no phase bit).
+ * The `cid` of the SQ entries is ignored, the driver allocates its own.
+ * Entries carrying guest addresses (`flags` != 0, engine opcodes) are refused,
+ * user space can not hand DMA addresses to the device, C_PCI_IOCTL_BATCH and
+ * C_PCI_IOCTL_PROG_RUN cover arrays.
+ */
+struct c_pci_submit {
+    __u64 sqes;
+    __u64 cqes;
+    __u32 count;
+    __u32 done;
+};
+
+/* SQ entries queued per round of C_PCI_IOCTL_SUBMIT. */
+#define C_PCI_SUBMIT_CHUNK      (QP_ENTRIES - 1)
+#define C_PCI_SUBMIT_TIMEOUT_MS 1000
+
+#define C_PCI_IOCTL_MAGIC       0xCA
+#define C_PCI_IOCTL_BATCH       _IOWR(C_PCI_IOCTL_MAGIC, 1, struct c_pci_batch)
+#define C_PCI_IOCTL_SUBMIT      _IOWR(C_PCI_IOCTL_MAGIC, 2, struct c_pci_submit)
+
+/**
+ * C_PCI_IOCTL_SET_CSUM: checksum (DMA_CSUM_*) computed on the following
+ * read()/write() calls of this file.
+ * C_PCI_IOCTL_GET_CSUM: checksum of the bytes moved by the last read()/write()
+ * call of this file.
+ */
+#define C_PCI_IOCTL_SET_CSUM    _IOW(C_PCI_IOCTL_MAGIC, 3, __u32)
+#define C_PCI_IOCTL_GET_CSUM    _IOR(C_PCI_IOCTL_MAGIC, 4, __u32)
+
+/**
+ * C_PCI_IOCTL_P2P_COPY: copy `len` bytes from offset `src` of the device
+ * memory (BAR1) of this device to offset `dst` of the device memory of the
+ * device `peer_fd` is an open file of. This device writes straight into the
+ * BAR of the peer when the PCI topology allows peer-to-peer transactions,
+ * otherwise both devices move the data through a DMA buffer and `flags`
+ * returns C_PCI_P2P_F_BOUNCE. The CPU does not touch the data either way.
+ */
+struct c_pci_p2p_copy {
+    __s32 peer_fd;
+    __u32 flags;
+    __u64 src;
+    __u64 dst;
+    __u64 len;
+};
+
+#define C_PCI_P2P_F_BOUNCE      (1 << 0)
+#define C_PCI_P2P_BOUNCE_SIZE   (1024 * 1024)
+
+#define C_PCI_IOCTL_P2P_COPY    _IOWR(C_PCI_IOCTL_MAGIC, 5, struct c_pci_p2p_copy)
+
+/**
+ * Filter/map/reduce programs, see `c_pci_insn` in the QEMU device for the
+ * instruction set and the rules of the verifier.
+ * C_PCI_IOCTL_PROG_LOAD: load the `count` instructions at `insns` as program
+ * `slot` of the device, -EINVAL if they do not verify.
+ * C_PCI_IOCTL_PROG_RUN: stream the `count` uint32_t elements at `input`
+ * through program `slot`. Emitted elements are packed at `output`, which has
+ * room for `count` of them, `emitted` returns their number and `result` the
+ * reduction over the whole input (0 without one).
+ */
+struct c_pci_insn {
+    __u8 op;
+    __u8 reserved[3];
+    __u32 imm;
+};
+
+#define C_PCI_PROG_SLOTS        8
+#define C_PCI_PROG_MAX_INSNS    64
+
+#define PROG_MAP_ADD            0x01
+#define PROG_MAP_SUB            0x02
+#define PROG_MAP_MUL            0x03
+#define PROG_MAP_AND            0x04
+#define PROG_MAP_OR             0x05
+#define PROG_MAP_XOR            0x06
+#define PROG_MAP_SHL            0x07
+#define PROG_MAP_SHR            0x08
+#define PROG_MAP_MIN            0x09
+#define PROG_MAP_MAX            0x0A
+#define PROG_FILTER_EQ          0x10
+#define PROG_FILTER_NE          0x11
+#define PROG_FILTER_LT          0x12
+#define PROG_FILTER_LE          0x13
+#define PROG_FILTER_GT          0x14
+#define PROG_FILTER_GE          0x15
+#define PROG_FILTER_ANY         0x16
+#define PROG_EMIT               0x20
+#define PROG_REDUCE_SUM         0x30
+#define PROG_REDUCE_MIN         0x31
+#define PROG_REDUCE_MAX         0x32
+#define PROG_REDUCE_COUNT       0x33
+
+struct c_pci_prog {
+    __u64 insns;
+    __u32 count;
+    __u32 slot;
+};
+
+struct c_pci_prog_run {
+    __u64 input;
+    __u64 output;
+    __u64 result;
+    __u32 count;
+    __u32 slot;
+    __u32 emitted;
+    __u32 reserved;
+};
+
+#define C_PCI_IOCTL_PROG_LOAD   _IOW(C_PCI_IOCTL_MAGIC, 6, struct c_pci_prog)
+#define C_PCI_IOCTL_PROG_RUN    _IOWR(C_PCI_IOCTL_MAGIC, 7, struct c_pci_prog_run)
+
+/**
+ * C_PCI_IOCTL_SEARCH: find the `count` patterns at `patterns` in the `len`
+ * bytes at `buf`, or with C_PCI_SEARCH_F_DEVMEM at offset `buf` of the device
+ * memory (BAR1). The first `room` matches go to `matches`, in order of offset
+ * then pattern index. `found` returns the number of matches, which may be more
+ * than `room`.
+ */
+#define C_PCI_SEARCH_MAX_PATTERNS   16
+#define C_PCI_SEARCH_MAX_LEN        56
+
+struct c_pci_pattern {
+    __u8 len;
+    __u8 reserved[7];
+    __u8 bytes[C_PCI_SEARCH_MAX_LEN];
+};
+
+struct c_pci_search_match {
+    __u64 offset;
+    __u32 pattern;
+    __u32 reserved;
+};
+
+struct c_pci_search {
+    __u64 buf;
+    __u64 len;
+    __u64 patterns;
+    __u64 matches;
+    __u64 found;
+    __u32 count;
+    __u32 room;
+    __u32 flags;
+    __u32 reserved;
+};
+
+#define C_PCI_SEARCH_F_DEVMEM   (1 << 0)
+
+/* Bytes searched per command, the batch buffer holds them with the bytes a
+ * match starting in them can reach. */
+#define C_PCI_SEARCH_CHUNK      (C_PCI_BATCH_CHUNK * sizeof(u32) - C_PCI_SEARCH_MAX_LEN)
+/* Matches a batch buffer holds. */
+#define C_PCI_SEARCH_MATCHES    (C_PCI_BATCH_CHUNK * sizeof(u32) / sizeof(struct c_pci_match))
+
+#define C_PCI_IOCTL_SEARCH      _IOWR(C_PCI_IOCTL_MAGIC, 8, struct c_pci_search)
+
+/**
+ * @brief Per open file state.
+ */
+struct c_pci_file {
+    struct c_pci_dev *dev;
+    u32 csum_type;
+    u32 csum;
+};
+
+/**
+ * MSI-X vector layout:
+ * Vector 0 is compute done.
+ * Vector 1 is error.
+ * Vector 2.. are DMA done, one per channel, shared round robin if the device
+ * table is smaller than the number of channels.
+ */
+#define C_PCI_VEC_COMPUTE       0
+#define C_PCI_VEC_ERROR         1
+#define C_PCI_VEC_DMA_BASE      2
+
+/**
+ * REG_IRQ_STATUS and REG_IRQ_MASK bits, one per source, numbered like the
+ * MSI-X vectors. DMA channels are acknowledged through their own STATUS
+ * register, which also clears their bit here.
+ */
+#define IRQ_SRC_COMPUTE         BIT(C_PCI_VEC_COMPUTE)
+#define IRQ_SRC_ERROR           BIT(C_PCI_VEC_ERROR)
+
+/* Interrupt moderation bounds, see the QEMU device. */
+#define IRQ_COAL_MAX_USEC       (1000 * 1000)
+
+/**
+ * Status write-back, see the QEMU device. The device copies its status
+ * registers to this page on every event and acknowledge, `seq` last. Pollers
+ * read `seq`, dma_rmb(), then the fields, without a trap to the hypervisor.
+ */
+#define WB_ENABLE               (1 << 0)
+#define WB_POLL_TIMEOUT_US      1000
+
+struct c_pci_wb_dma {
+    __le32 status;
+    __le32 completed;
+    __le32 csum;
+    __le32 ring_head;
+} __packed;
+
+struct c_pci_wb {
+    __le32 seq;
+    __le32 result;
+    __le32 error;
+    __le32 batch_status;
+    __le32 irq_status;
+    __le32 tag_done;
+    __le32 tag_error;
+    __le32 reserved;
+    struct c_pci_wb_dma dma[8];
+    __le32 tag_result[TAG_NR];
+} __packed;
+
+/* Every DMA channel has its own register window in BAR3. */
+#define DMA_MAX_CHANNELS        8
+#define DMA_CHAN_STRIDE         0x80
+
+#define DMA_REG_CMD             0x00
+#define DMA_REG_SRC             0x04
+#define DMA_REG_DST             0x08
+#define DMA_REG_LEN             0x0C
+#define DMA_REG_RING_BASE       0x10
+#define DMA_REG_RING_SIZE       0x14
+#define DMA_REG_RING_HEAD       0x18
+#define DMA_REG_RING_TAIL       0x1C
+#define DMA_REG_STATUS          0x20
+#define DMA_REG_COMPLETED       0x24
+#define DMA_REG_CSUM            0x28
+
+/* 64 bit forms of SRC, DST, LEN and RING_BASE. */
+#define DMA_REG_SRC64           0x30
+#define DMA_REG_DST64           0x38
+#define DMA_REG_LEN64           0x40
+#define DMA_REG_RING_BASE64     0x48
+
+/**
+ * our CMD register:
+ * Bit 0 is run DMA or not.
+ * Bit 1 are DMA direction: to device or from device.
+ */
+#define DMA_CMD_RUN                 1
+#define DMA_DIRECTION_TO_DEVICE     0
+#define DMA_DIRECTION_FROM_DEVICE   1
+
+#define DMA_GET_DIR(cmd) ((cmd & 0b10) >> 1)
+
+/**
+ * Checksum over the transferred bytes, computed by the device during the copy,
+ * bits 5..4 of CMD and of the descriptor flags.
+ */
+#define DMA_CSUM_NONE               0
+#define DMA_CSUM_CRC32C             1
+#define DMA_CSUM_CRC32              2
+#define DMA_CSUM_SHIFT              4
+
+/**
+ * Operation of the copy engine, bits 10..8 of CMD and of the descriptor flags:
+ * DMA_OP_XFER: guest memory <-> device memory, by direction.
+ * DMA_OP_COPY: guest memory to guest memory.
+ * DMA_OP_DEV_COPY: device memory to device memory.
+ * DMA_OP_FILL, DMA_OP_DEV_FILL: fill guest or device memory at `dst` with the
+ *      8 byte pattern in `src`.
+ * DMA_OP_COMPRESS, DMA_OP_DECOMPRESS: LZ4 block of guest memory `src` to at
+ *      most `dst_len` bytes at `dst`, descriptors only. The output length is
+ *      written to `out_len`, a compress which does not fit gets 0.
+ */
+#define DMA_OP_XFER                 0
+#define DMA_OP_COPY                 1
+#define DMA_OP_DEV_COPY             2
+#define DMA_OP_FILL                 3
+#define DMA_OP_DEV_FILL             4
+#define DMA_OP_COMPRESS             5
+#define DMA_OP_DECOMPRESS           6
+#define DMA_OP_SHIFT                8
+
+/**
+ * our STATUS register:
+ * Bit 0 is busy.
+ * Bit 1 is done, write 1 to clear.
+ * Bit 2 is error, write 1 to clear.
+ */
+#define DMA_STS_BUSY                (1 << 0)
+#define DMA_STS_DONE                (1 << 1)
+#define DMA_STS_ERROR               (1 << 2)
+
+#define DMA_TIMEOUT_MS              1000
+
+/**
+ * Latency stages of a DMA request, from the descriptor timestamps and a read
+ * of REG_TIMESTAMP (device nanoseconds) when the submitter wakes up:
+ * queue: doorbell to the device starting the first descriptor.
+ * exec: first descriptor started to last descriptor done.
+ * wake: last descriptor done to the submitter running again.
+ * Histogram bucket N counts latencies of [2^N, 2^(N + 1)) ns.
+ */
+#define DMA_LAT_QUEUE               0
+#define DMA_LAT_EXEC                1
+#define DMA_LAT_WAKE                2
+#define DMA_LAT_NR                  3
+#define DMA_LAT_BUCKETS             32
+
+/**
+ * Descriptor ring, see `dma_desc` in the QEMU device. Descriptor flags use the
+ * same direction and checksum bits as the CMD register, bit 2 chains a
+ * descriptor to the next one. The checksum of a chain is written to `csum` of
+ * its last descriptor.
+ */
+#define DMA_RING_ENTRIES            256
+#define DMA_DESC_MAX_LEN            SZ_1G
+#define DMA_DESC_F_CHAIN            (1 << 2)
+#define DMA_DESC_STS_DONE           (1 << 0)
+#define DMA_DESC_STS_ERROR          (1 << 1)
+
+struct dma_desc {
+    __le64 src;
+    __le64 dst;
+    __le32 len;
+    __le32 flags;
+    __le32 status;
+    __le32 csum;
+    __le64 ts_submit;
+    __le64 ts_start;
+    __le64 ts_complete;
+    __le32 dst_len;
+    __le32 out_len;
+} __packed;
+
+#define DEVICE_NAME TYPE_PCI_CUSTOM_DEVICE
+
+#define __pr_info(fmt, arg...) pr_info("%s():" fmt, __FUNCTION__, ##arg)
+#define __pr_err(fmt, arg...) pr_err("%s():" fmt, __FUNCTION__, ##arg)
+
+
+struct c_pci_dev;
+
+struct c_pci_dma_chan {
+    struct c_pci_dev *_owner;
+    unsigned int _index;
+    void __iomem *_regs;
+    int _irq;
+
+    /* CPUs which submit on this channel. */
+    struct cpumask _cpus;
+
+    /* DMA descriptor ring, shared with the device. */
+    struct dma_desc *_ring;
+    dma_addr_t _ring_dma;
+    u32 _ring_tail;
+
+    /* One request in flight, completed from the interrupt handler. */
+    struct mutex _lock;
+    struct completion _done;
+    u32 _status;
+
+    /* A request timed out. The device may still run its descriptors and
+     * write its buffers, the channel takes no more requests. */
+    bool _dead;
+
+    /* DMA_LAT_* histograms, updated under `_lock`. */
+    u64 _lat[DMA_LAT_NR][DMA_LAT_BUCKETS];
+};
+
+struct c_pci_cmd;
+
+/**
+ * @brief A command for the queue pairs. The caller fills `sqe` (but `cid`)
+ * and `done`, the driver fills `result` and `status` (CQE_STS_*) then calls
+ * `done`. With MSI-X `done` runs in the compute interrupt thread, otherwise
+ * from a work item, it must not sleep either way.
+ */
+struct c_pci_cmd {
+    struct c_pci_sqe sqe;
+    u32 result;
+    u16 status;
+    void (*done)(struct c_pci_cmd *cmd);
+    void *priv;
+    struct list_head _node;
+};
+
+struct c_pci_qp {
+    struct c_pci_dev *_owner;
+    unsigned int _index;
+    void __iomem *_regs;
+    spinlock_t _lock;
+
+    /* Window in the submission BAR, write combined. NULL without it, entries
+     * then go through `_sq` and the doorbell. */
+    void __iomem *_push;
+
+    /* Queues, shared with the device. */
+    struct c_pci_sqe *_sq;
+    dma_addr_t _sq_dma;
+    struct c_pci_cqe *_cq;
+    dma_addr_t _cq_dma;
+    u32 _sq_tail;
+    u32 _cq_head;
+    bool _phase;
+
+    /* Commands in flight, indexed by command id. */
+    unsigned int _inflight;
+    DECLARE_BITMAP(_cids, QP_ENTRIES);
+    struct c_pci_cmd *_cmds[QP_ENTRIES];
+};
+
+struct c_pci_dev {
+    struct pci_dev *_dev;
+    void __iomem *bar_0_ptr;
+    void __iomem *bar_3_ptr;
+    void __iomem *bar_5_ptr;
+
+    /* Index in `_devs`, minor number of the character device. */
+    unsigned int _minor;
+
+    /* Status write-back page, see `struct c_pci_wb`. */
+    struct c_pci_wb *_wb;
+    dma_addr_t _wb_dma;
+
+    /* MSI-X in use, compute and error events have their own vectors. */
+    bool _msix;
+    atomic64_t _compute_done;
+
+    /* Batch compute, one batch in flight. Operand and result buffers are
+     * C_PCI_BATCH_CHUNK lanes each. */
+    struct mutex _batch_lock;
+    struct completion _batch_done;
+    u32 _batch_status;
+    u32 *_batch_buf[3];
+    dma_addr_t _batch_dma[3];
+
+    /* Work on the batch buffers timed out. The device may still use them,
+     * they take no more work. */
+    bool _batch_dead;
+
+    /* Queue pairs. Without MSI-X completions are not signalled, `_qp_poll`
+     * reaps them while commands are in flight. */
+    unsigned int _nr_qps;
+    struct c_pci_qp _qps[QP_MAX];
+    struct delayed_work _qp_poll;
+
+    /* The exported copy engine functions may use the device. */
+    bool _dma_ready;
+
+    /* BAR1 is a p2pdma provider, peers may DMA to it directly. */
+    bool _p2p;
+
+    /* Registered the LZ4 acomp, as `_dma_dev`. */
+    bool _lz4;
+
+    /* Record DMA_LAT_* histograms, costs a register read per request. */
+    bool _dma_lat;
+
+    /* DMA channels, `_cpu_chan[cpu]` is the channel a CPU submits to so
+     * submissions from different CPUs do not share a lock. */
+    unsigned int _nr_chans;
+    struct c_pci_dma_chan _chans[DMA_MAX_CHANNELS];
+    struct c_pci_dma_chan **_cpu_chan;
+};
+
+/**
+ * Devices by minor number. The first one is /dev/c_pci_dev, the others are
+ * /dev/c_pci_dev<minor>. The exported copy engine and the hash engine run on
+ * the first device probed, `_dma_dev` and `_hash_dev`.
+ */
+#define C_PCI_MAX_DEVS          8
+
+static int _major;
+static struct class *_cls;
+static DEFINE_MUTEX(_devs_lock);
+static struct c_pci_dev *_devs[C_PCI_MAX_DEVS];
+static struct c_pci_dev *_dma_dev;
+static struct c_pci_dev *_hash_dev;
+
+static struct pci_device_id dev_ids[] = {
+    {PCI_DEVICE(DEVICE_VENDOR_ID, DEVICE_DEVICE_ID)},
+    {}
+};
+MODULE_DEVICE_TABLE(pci, dev_ids);
+
+/**
+ * @brief DMA channel interrupt. A vector might be shared by several channels
+ * (not enough MSI vectors, or legacy line), so we check the channel status
+ * register before claiming it.
+ */
+static irqreturn_t _irq_handler(int irq, void *data)
+{
+    struct c_pci_dma_chan *chan = data;
+    u32 status = ioread32(chan->_regs + DMA_REG_STATUS);
+
+    if (!(status & (DMA_STS_DONE | DMA_STS_ERROR))) {
+        return IRQ_NONE;
+    }
+
+    /* Acknowledge, this also lowers INTx. */
+    iowrite32(status & (DMA_STS_DONE | DMA_STS_ERROR),
+              chan->_regs + DMA_REG_STATUS);
+
+    chan->_status = status;
+    complete(&chan->_done);
+
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief Reap every new completion of @qp. Completed commands are collected
+ * under the lock and their callbacks run after it is dropped, so a callback
+ * may submit again.
+ */
+static unsigned int _qp_reap(struct c_pci_qp *qp)
+{
+    struct c_pci_cmd *cmd, *tmp;
+    unsigned long flags;
+    unsigned int reaped = 0;
+    LIST_HEAD(done);
+
+    spin_lock_irqsave(&qp->_lock, flags);
+
+    for (;;) {
+        struct c_pci_cqe *cqe = &qp->_cq[qp->_cq_head];
+        u16 status = le16_to_cpu(READ_ONCE(cqe->status));
+        u16 cid;
+
+        if (CQE_PHASE(status) != qp->_phase) {
+            break;
+        }
+
+        /* Read the rest of the entry only after we saw its phase bit. */
+        dma_rmb();
+
+        cid = le16_to_cpu(cqe->cid);
+        if (cid < QP_ENTRIES && qp->_cmds[cid] != NULL) {
+            cmd = qp->_cmds[cid];
+            qp->_cmds[cid] = NULL;
+            __clear_bit(cid, qp->_cids);
+            qp->_inflight--;
+
+            cmd->result = le32_to_cpu(cqe->result);
+            cmd->status = CQE_CODE(status);
+            list_add_tail(&cmd->_node, &done);
+        } else {
+            dev_err_ratelimited(&qp->_owner->_dev->dev,
+                                "queue %u: completion for unknown cid %u\n",
+                                qp->_index, cid);
+        }
+
+        qp->_cq_head = (qp->_cq_head + 1) % QP_ENTRIES;
+        if (qp->_cq_head == 0) {
+            qp->_phase = !qp->_phase;
+        }
+        reaped++;
+    }
+
+    if (reaped) {
+        iowrite32(qp->_cq_head, qp->_regs + QP_REG_CQ_HEAD);
+    }
+
+    spin_unlock_irqrestore(&qp->_lock, flags);
+
+    list_for_each_entry_safe(cmd, tmp, &done, _node) {
+        cmd->done(cmd);
+    }
+
+    return reaped;
+}
+
+/**
+ * @brief Compute done vector, shared by single operations (result latched in
+ * REG_RESULT), tagged operations (REG_TAG_DONE), batches (status in
+ * REG_BATCH_STATUS) and queue pairs.
+ */
+static irqreturn_t _compute_irq_handler(int irq, void *data)
+{
+    struct c_pci_dev *_dev = data;
+    u32 status;
+    unsigned int reaped = 0;
+    unsigned int i;
+
+    /* Acknowledge first, completions posted from now on signal again. */
+    iowrite32(IRQ_SRC_COMPUTE, _dev->bar_0_ptr + REG_IRQ_STATUS);
+    status = ioread32(_dev->bar_0_ptr + REG_BATCH_STATUS);
+
+    if (status & (BATCH_STS_DONE | BATCH_STS_ERROR)) {
+        iowrite32(status & (BATCH_STS_DONE | BATCH_STS_ERROR | BATCH_STS_DIV_ZERO),
+                  _dev->bar_0_ptr + REG_BATCH_STATUS);
+        _dev->_batch_status = status;
+        complete(&_dev->_batch_done);
+    }
+
+    for (i = 0; i < _dev->_nr_qps; i++) {
+        reaped += _qp_reap(&_dev->_qps[i]);
+    }
+
+    if (!(status & (BATCH_STS_DONE | BATCH_STS_ERROR)) && reaped == 0) {
+        atomic64_inc(&_dev->_compute_done);
+    }
+
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief Completion polling when the compute vector is not available. Runs
+ * every jiffy as long as commands are in flight.
+ */
+static void _qp_poll_work(struct work_struct *work)
+{
+    struct c_pci_dev *_dev = container_of(to_delayed_work(work),
+                                          struct c_pci_dev,
+                                          _qp_poll);
+    unsigned int inflight = 0;
+    unsigned int i;
+
+    for (i = 0; i < _dev->_nr_qps; i++) {
+        _qp_reap(&_dev->_qps[i]);
+        inflight += READ_ONCE(_dev->_qps[i]._inflight);
+    }
+
+    if (inflight) {
+        queue_delayed_work(system_wq, &_dev->_qp_poll, 1);
+    }
+}
+
+/**
+ * @brief Queue up to @n commands on the queue pair of the current CPU and
+ * ring its doorbell once.
+ *
+ * @return Number of commands queued, less than @n if the queue pair is full.
+ */
+static unsigned int _qp_submit(struct c_pci_dev *_dev,
+                               struct c_pci_cmd *cmds,
+                               unsigned int n)
+{
+    struct c_pci_qp *qp = &_dev->_qps[raw_smp_processor_id() % _dev->_nr_qps];
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&qp->_lock, flags);
+
+    for (i = 0; i < n; i++) {
+        struct c_pci_sqe *sqe = &qp->_sq[qp->_sq_tail];
+        struct c_pci_sqe push;
+        unsigned int cid;
+
+        /* One slot stays free, so the device never sees a full queue as an
+         * empty one and always has room for our completions. */
+        if (qp->_inflight == QP_ENTRIES - 1) {
+            break;
+        }
+
+        cid = find_first_zero_bit(qp->_cids, QP_ENTRIES);
+        __set_bit(cid, qp->_cids);
+        qp->_cmds[cid] = &cmds[i];
+        qp->_inflight++;
+
+        /* An entry pushed through the submission BAR is one 64 byte burst
+         * of 8 byte stores, instead of memory the device has to fetch. */
+        if (qp->_push) {
+            push = cmds[i].sqe;
+            push.cid = cpu_to_le16(cid);
+            __iowrite64_copy(qp->_push + qp->_sq_tail * sizeof(push),
+                             &push,
+                             sizeof(push) / 8);
+        } else {
+            *sqe = cmds[i].sqe;
+            sqe->cid = cpu_to_le16(cid);
+        }
+        qp->_sq_tail = (qp->_sq_tail + 1) % QP_ENTRIES;
+    }
+
+    /* Pushed entries need no doorbell, wmb() drains the write combining
+     * buffers so they leave now. Otherwise iowrite32() orders the SQ entries
+     * above before the doorbell. */
+    if (i && qp->_push) {
+        wmb();
+    } else if (i) {
+        iowrite32(qp->_sq_tail, qp->_regs + QP_REG_SQ_TAIL);
+    }
+
+    spin_unlock_irqrestore(&qp->_lock, flags);
+
+    if (i && !_dev->_msix) {
+        queue_delayed_work(system_wq, &_dev->_qp_poll, 1);
+    }
+
+    return i;
+}
+
+/**
+ * @brief Error vector, report and acknowledge the latched causes.
+ */
+static irqreturn_t _error_irq_handler(int irq, void *data)
+{
+    struct c_pci_dev *_dev = data;
+    u32 error = ioread32(_dev->bar_0_ptr + REG_ERROR);
+
+    iowrite32(error, _dev->bar_0_ptr + REG_ERROR);
+    iowrite32(IRQ_SRC_ERROR, _dev->bar_0_ptr + REG_IRQ_STATUS);
+
+    dev_err_ratelimited(&_dev->_dev->dev, "device error:%s%s (0x%x)\n",
+                        (error & ERR_COMPUTE) ? " compute" : "",
+                        (error & ERR_DMA) ? " dma" : "",
+                        error);
+
+    return IRQ_HANDLED;
+}
+
+/**
+ * @brief Allocate the descriptor ring of a channel and program it.
+ */
+static int _dma_chan_init(struct c_pci_dev *_dev, unsigned int index)
+{
+    struct c_pci_dma_chan *chan = &_dev->_chans[index];
+
+    chan->_owner = _dev;
+    chan->_index = index;
+    chan->_regs = _dev->bar_3_ptr + index * DMA_CHAN_STRIDE;
+    mutex_init(&chan->_lock);
+    init_completion(&chan->_done);
+
+    /* The device fetches descriptors from the ring so it has to be coherent
+     * memory. */
+    chan->_ring = dmam_alloc_coherent(&_dev->_dev->dev,
+                                      DMA_RING_ENTRIES * sizeof(struct dma_desc),
+                                      &chan->_ring_dma,
+                                      GFP_KERNEL);
+    if (chan->_ring == NULL) {
+        return -ENOMEM;
+    }
+
+    chan->_ring_tail = 0;
+    lo_hi_writeq(chan->_ring_dma, chan->_regs + DMA_REG_RING_BASE64);
+    iowrite32(DMA_RING_ENTRIES, chan->_regs + DMA_REG_RING_SIZE);
+
+    return 0;
+}
+
+/**
+ * @brief Allocate the queues of a queue pair and program them.
+ */
+static int _qp_init(struct c_pci_dev *_dev, unsigned int index)
+{
+    struct c_pci_qp *qp = &_dev->_qps[index];
+
+    qp->_owner = _dev;
+    qp->_index = index;
+    qp->_regs = _dev->bar_0_ptr + REG_QP_BASE + index * QP_STRIDE;
+    qp->_push = _dev->bar_5_ptr ? _dev->bar_5_ptr + index * QP_PUSH_STRIDE : NULL;
+    spin_lock_init(&qp->_lock);
+
+    qp->_sq = dmam_alloc_coherent(&_dev->_dev->dev,
+                                  QP_ENTRIES * sizeof(struct c_pci_sqe),
+                                  &qp->_sq_dma,
+                                  GFP_KERNEL);
+    qp->_cq = dmam_alloc_coherent(&_dev->_dev->dev,
+                                  QP_ENTRIES * sizeof(struct c_pci_cqe),
+                                  &qp->_cq_dma,
+                                  GFP_KERNEL);
+    if (qp->_sq == NULL || qp->_cq == NULL) {
+        return -ENOMEM;
+    }
+
+    /* The CQ is zeroed, no entry has the phase bit of the first pass. */
+    qp->_sq_tail = 0;
+    qp->_cq_head = 0;
+    qp->_phase = true;
+
+    lo_hi_writeq(qp->_sq_dma, qp->_regs + QP_REG_SQ_BASE);
+    lo_hi_writeq(qp->_cq_dma, qp->_regs + QP_REG_CQ_BASE);
+    iowrite32(QP_ENTRIES, qp->_regs + QP_REG_SIZE);
+
+    return 0;
+}
+
+/**
+ * @brief Spread CPUs over channels round robin. A CPU always submits on the
+ * same channel, and the channel interrupt is steered back to those CPUs.
+ */
+static void _dma_map_cpus(struct c_pci_dev *_dev)
+{
+    unsigned int cpu;
+    unsigned int i;
+
+    for (i = 0; i < _dev->_nr_chans; i++) {
+        cpumask_clear(&_dev->_chans[i]._cpus);
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct c_pci_dma_chan *chan = &_dev->_chans[cpu % _dev->_nr_chans];
+
+        _dev->_cpu_chan[cpu] = chan;
+        cpumask_set_cpu(cpu, &chan->_cpus);
+    }
+}
+
+/**
+ * @brief Release the first @count channel interrupts, the compute and error
+ * vectors and the vectors themselves.
+ */
+static void _free_irqs(struct c_pci_dev *_dev, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        irq_update_affinity_hint(_dev->_chans[i]._irq, NULL);
+        free_irq(_dev->_chans[i]._irq, &_dev->_chans[i]);
+    }
+
+    if (_dev->_msix) {
+        pci_free_irq(_dev->_dev, C_PCI_VEC_ERROR, _dev);
+        pci_free_irq(_dev->_dev, C_PCI_VEC_COMPUTE, _dev);
+        _dev->_msix = false;
+    }
+
+    pci_free_irq_vectors(_dev->_dev);
+}
+
+/**
+ * @brief MSI-X setup. The compute and error vectors are pre vectors, the DMA
+ * vectors are managed by the kernel which spreads them over all CPUs. Every
+ * CPU then submits on the channel whose vector is affine to it, so the
+ * completion comes back on the submitting CPU.
+ */
+static int _setup_msix_irqs(struct c_pci_dev *_dev)
+{
+    struct irq_affinity affd = {
+        .pre_vectors = C_PCI_VEC_DMA_BASE,
+    };
+    struct pci_dev *dev = _dev->_dev;
+    unsigned int i;
+    unsigned int cpu;
+    int table = 0;
+    int nvec = 0;
+    int res = 0;
+
+    table = pci_msix_vec_count(dev);
+    if (table <= C_PCI_VEC_DMA_BASE) {
+        return -ENODEV;
+    }
+
+    /* The device only signals vectors of its table, we need all of them. */
+    nvec = min_t(int, table, C_PCI_VEC_DMA_BASE + _dev->_nr_chans);
+    nvec = pci_alloc_irq_vectors_affinity(dev,
+                                          nvec,
+                                          nvec,
+                                          PCI_IRQ_MSIX | PCI_IRQ_AFFINITY,
+                                          &affd);
+    if (nvec < 0) {
+        return nvec;
+    }
+
+    /* Threaded, completions of the queue pairs call back into their users
+     * (crypto requests), they should not run in hard interrupt context. */
+    res = pci_request_irq(dev, C_PCI_VEC_COMPUTE, NULL, _compute_irq_handler,
+                          _dev, "%s-compute", DEVICE_NAME);
+    if (res < 0) {
+        goto free_vectors;
+    }
+
+    res = pci_request_irq(dev, C_PCI_VEC_ERROR, _error_irq_handler, NULL,
+                          _dev, "%s-error", DEVICE_NAME);
+    if (res < 0) {
+        pci_free_irq(dev, C_PCI_VEC_COMPUTE, _dev);
+        goto free_vectors;
+    }
+
+    _dev->_msix = true;
+
+    for (i = 0; i < _dev->_nr_chans; i++) {
+        struct c_pci_dma_chan *chan = &_dev->_chans[i];
+        int vec = C_PCI_VEC_DMA_BASE + i % (nvec - C_PCI_VEC_DMA_BASE);
+        const struct cpumask *mask = pci_irq_get_affinity(dev, vec);
+
+        chan->_irq = pci_irq_vector(dev, vec);
+        res = request_irq(chan->_irq, _irq_handler, IRQF_SHARED, DEVICE_NAME, chan);
+        if (res < 0) {
+            _free_irqs(_dev, i);
+            return res;
+        }
+
+        /* Channels sharing a vector keep the round robin CPUs, the first one
+         * takes over the CPUs its vector is affine to. */
+        if (mask == NULL || i >= nvec - C_PCI_VEC_DMA_BASE) {
+            continue;
+        }
+
+        for_each_cpu(cpu, mask) {
+            _dev->_cpu_chan[cpu] = chan;
+        }
+    }
+
+    __pr_info("%u DMA channels on %d MSI-X vectors.\n", _dev->_nr_chans, nvec);
+
+    return 0;
+
+free_vectors:
+    pci_free_irq_vectors(dev);
+    return res;
+}
+
+/**
+ * @brief Fallback when MSI-X is not available: only DMA completions are
+ * signalled. We ask for one MSI vector per channel, if we get less, channels
+ * share vectors round robin. Legacy line is the last resort.
+ */
+static int _setup_msi_irqs(struct c_pci_dev *_dev)
+{
+    struct pci_dev *dev = _dev->_dev;
+    unsigned int i;
+    int nvec = 0;
+    int res = 0;
+
+    nvec = pci_alloc_irq_vectors(dev,
+                                 1,
+                                 _dev->_nr_chans,
+                                 PCI_IRQ_MSI | PCI_IRQ_LEGACY);
+    if (nvec < 0) {
+        return nvec;
+    }
+
+    for (i = 0; i < _dev->_nr_chans; i++) {
+        struct c_pci_dma_chan *chan = &_dev->_chans[i];
+
+        chan->_irq = pci_irq_vector(dev, i % nvec);
+        res = request_irq(chan->_irq, _irq_handler, IRQF_SHARED, DEVICE_NAME, chan);
+        if (res < 0) {
+            _free_irqs(_dev, i);
+            return res;
+        }
+
+        /* Complete on the CPUs that submit on this channel. */
+        if (nvec == _dev->_nr_chans) {
+            irq_set_affinity_and_hint(chan->_irq, &chan->_cpus);
+        }
+    }
+
+    __pr_info("%u DMA channels on %d vectors.\n", _dev->_nr_chans, nvec);
+
+    return 0;
+}
+
+static int _setup_irqs(struct c_pci_dev *_dev)
+{
+    int res = 0;
+
+    _dma_map_cpus(_dev);
+
+    res = _setup_msix_irqs(_dev);
+    if (res == 0) {
+        return 0;
+    }
+
+    __pr_info("MSI-X not available (%d), falling back to MSI/INTx.\n", res);
+
+    _dma_map_cpus(_dev);
+
+    return _setup_msi_irqs(_dev);
+}
+
+/**
+ * @brief Map a BAR to user space. The mmap() offset selects the BAR:
+ * (bar << C_PCI_MMAP_BAR_SHIFT) + offset inside the BAR. Offset 0 is BAR0
+ * registers, (1 << C_PCI_MMAP_BAR_SHIFT) is BAR1 device memory,
+ * (C_PCI_MMAP_WB << C_PCI_MMAP_BAR_SHIFT) is the status write-back page.
+ *
+ * BAR1 may be shared with a host process (`memdev` of the QEMU device). Its
+ * mapping is write combined, user space fences its stores (sfence) before it
+ * tells the other side they are there.
+ */
+static int _mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct c_pci_file *f = file->private_data;
+    struct c_pci_dev *_dev = f->dev;
+    int res = 0;
+    u64 offset = (u64)vma->vm_pgoff << PAGE_SHIFT;
+    unsigned int bar = offset >> C_PCI_MMAP_BAR_SHIFT;
+    u64 bar_offset = offset & (BIT_ULL(C_PCI_MMAP_BAR_SHIFT) - 1);
+    unsigned long size = vma->vm_end - vma->vm_start;
+    u64 bar_len = 0;
+
+    if (bar == C_PCI_MMAP_WB) {
+        if (bar_offset != 0 || size > PAGE_SIZE || (vma->vm_flags & VM_WRITE)) {
+            return -EINVAL;
+        }
+        vm_flags_clear(vma, VM_MAYWRITE);
+        vma->vm_pgoff = 0;
+        return dma_mmap_coherent(&_dev->_dev->dev, vma, _dev->_wb, _dev->_wb_dma, size);
+    }
+
+    if (bar != C_PCI_MMIO_BAR && bar != C_PCI_MEM_BAR) {
+        return -EINVAL;
+    }
+
+    bar_len = PAGE_ALIGN(pci_resource_len(_dev->_dev, bar));
+    if (bar_offset >= bar_len || size > bar_len - bar_offset) {
+        return -EINVAL;
+    }
+
+    /* Device memory is prefetchable, let the CPU combine stores. */
+    if (pci_resource_flags(_dev->_dev, bar) & IORESOURCE_PREFETCH) {
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    }
+
+    /* VM Area offset will point to first page of PCI DMA (physical addr).
+     * pci_resource_start() return start address od PCI BAR.
+     * We shift `PAGE_SHIFT` bits the address to right to get the page number.
+     **/
+    vma->vm_pgoff = (pci_resource_start(_dev->_dev, bar) + bar_offset) >> PAGE_SHIFT;
+
+    /* We map user VMA to the BAR. */
+    res = io_remap_pfn_range(vma,
+                             vma->vm_start,
+                             vma->vm_pgoff,
+                             size,
+                             vma->vm_page_prot);
+    if (res) {
+        __pr_err("Failed to map PCI BAR %u to user VMA: %d", bar, res);
+        goto exit;
+    }
+
+exit:
+    return res;
+}
+
+/**
+ * SHA-256 ahash. One-shot digests (digest(), the common case) run on the
+ * device, the gather list of the request goes to the device as is. The
+ * incremental interface (init/update/final, export/import) and requests the
+ * device can not take go to a CPU implementation.
+ */
+#define HASH_MAX_SEGMENTS       64
+#define HASH_PRIORITY           300
+
+struct c_pci_hash_ctx {
+    struct crypto_ahash *fallback;
+};
+
+struct c_pci_hash_reqctx {
+    struct c_pci_cmd cmd;
+    int src_nents;
+    int nents;
+    dma_addr_t sgl_dma;
+    dma_addr_t digest_dma;
+    struct c_pci_sg sgl[HASH_MAX_SEGMENTS];
+
+    /* The device writes the digest, keep it in its own cache line. */
+    u8 digest[SHA256_DIGEST_SIZE] ____cacheline_aligned;
+
+    /* Must be last, its size depends on the fallback. */
+    struct ahash_request fallback_req ____cacheline_aligned;
+};
+
+static struct ahash_request *_hash_fallback_req(struct ahash_request *req)
+{
+    struct c_pci_hash_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct c_pci_hash_reqctx *rctx = ahash_request_ctx_dma(req);
+
+    ahash_request_set_tfm(&rctx->fallback_req, ctx->fallback);
+    ahash_request_set_callback(&rctx->fallback_req,
+                               req->base.flags & CRYPTO_TFM_REQ_MAY_SLEEP,
+                               req->base.complete,
+                               req->base.data);
+    ahash_request_set_crypt(&rctx->fallback_req, req->src, req->result, req->nbytes);
+
+    return &rctx->fallback_req;
+}
+
+static int _sha256_init(struct ahash_request *req)
+{
+    return crypto_ahash_init(_hash_fallback_req(req));
+}
+
+static int _sha256_update(struct ahash_request *req)
+{
+    return crypto_ahash_update(_hash_fallback_req(req));
+}
+
+static int _sha256_final(struct ahash_request *req)
+{
+    return crypto_ahash_final(_hash_fallback_req(req));
+}
+
+static int _sha256_finup(struct ahash_request *req)
+{
+    return crypto_ahash_finup(_hash_fallback_req(req));
+}
+
+static int _sha256_export(struct ahash_request *req, void *out)
+{
+    return crypto_ahash_export(_hash_fallback_req(req), out);
+}
+
+static int _sha256_import(struct ahash_request *req, const void *in)
+{
+    return crypto_ahash_import(_hash_fallback_req(req), in);
+}
+
+static void _sha256_unmap(struct ahash_request *req)
+{
+    struct c_pci_hash_reqctx *rctx = ahash_request_ctx_dma(req);
+    struct device *dev = &_hash_dev->_dev->dev;
+
+    dma_unmap_single(dev, rctx->digest_dma, SHA256_DIGEST_SIZE, DMA_FROM_DEVICE);
+    dma_unmap_single(dev, rctx->sgl_dma, rctx->nents * sizeof(struct c_pci_sg),
+                     DMA_TO_DEVICE);
+    dma_unmap_sg(dev, req->src, rctx->src_nents, DMA_TO_DEVICE);
+}
+
+static void _sha256_done(struct c_pci_cmd *cmd)
+{
+    struct ahash_request *req = cmd->priv;
+    struct c_pci_hash_reqctx *rctx = ahash_request_ctx_dma(req);
+    int err = 0;
+
+    _sha256_unmap(req);
+
+    if (cmd->status != CQE_STS_SUCCESS) {
+        err = -EIO;
+    } else {
+        memcpy(req->result, rctx->digest, SHA256_DIGEST_SIZE);
+    }
+
+    /* Crypto users expect completions with softirqs off. */
+    local_bh_disable();
+    ahash_request_complete(req, err);
+    local_bh_enable();
+}
+
+static int _sha256_digest(struct ahash_request *req)
+{
+    struct c_pci_hash_reqctx *rctx = ahash_request_ctx_dma(req);
+    struct device *dev = &_hash_dev->_dev->dev;
+    struct scatterlist *sg;
+    unsigned int left = req->nbytes;
+    unsigned int len;
+    int i;
+
+    rctx->src_nents = sg_nents_for_len(req->src, req->nbytes);
+    if (req->nbytes == 0 || rctx->src_nents <= 0 ||
+        rctx->src_nents > HASH_MAX_SEGMENTS) {
+        return crypto_ahash_digest(_hash_fallback_req(req));
+    }
+
+    rctx->nents = dma_map_sg(dev, req->src, rctx->src_nents, DMA_TO_DEVICE);
+    if (rctx->nents == 0) {
+        return -ENOMEM;
+    }
+
+    /* The last entry is cut at nbytes, the scatterlist may be longer. */
+    for_each_sg(req->src, sg, rctx->nents, i) {
+        len = min_t(unsigned int, sg_dma_len(sg), left);
+        rctx->sgl[i].addr = cpu_to_le64(sg_dma_address(sg));
+        rctx->sgl[i].len = cpu_to_le32(len);
+        rctx->sgl[i].reserved = 0;
+        left -= len;
+    }
+
+    rctx->sgl_dma = dma_map_single(dev, rctx->sgl,
+                                   rctx->nents * sizeof(struct c_pci_sg),
+                                   DMA_TO_DEVICE);
+    rctx->digest_dma = dma_map_single(dev, rctx->digest, SHA256_DIGEST_SIZE,
+                                      DMA_FROM_DEVICE);
+    if (dma_mapping_error(dev, rctx->sgl_dma) ||
+        dma_mapping_error(dev, rctx->digest_dma)) {
+        _sha256_unmap(req);
+        return -ENOMEM;
+    }
+
+    memset(&rctx->cmd, 0, sizeof(rctx->cmd));
+    rctx->cmd.sqe.opcode = OPCODE_SHA256;
+    rctx->cmd.sqe.flags = SQE_F_SGL;
+    rctx->cmd.sqe.len = cpu_to_le32(rctx->nents);
+    rctx->cmd.sqe.src = cpu_to_le64(rctx->sgl_dma);
+    rctx->cmd.sqe.dst = cpu_to_le64(rctx->digest_dma);
+    rctx->cmd.done = _sha256_done;
+    rctx->cmd.priv = req;
+
+    /* Queue pair full, hash on the CPU instead of waiting. */
+    if (_qp_submit(_hash_dev, &rctx->cmd, 1) == 0) {
+        _sha256_unmap(req);
+        return crypto_ahash_digest(_hash_fallback_req(req));
+    }
+
+    return -EINPROGRESS;
+}
+
+static int _sha256_cra_init(struct crypto_tfm *tfm)
+{
+    struct crypto_ahash *ahash = __crypto_ahash_cast(tfm);
+    struct c_pci_hash_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    ctx->fallback = crypto_alloc_ahash(crypto_tfm_alg_name(tfm), 0,
+                                       CRYPTO_ALG_NEED_FALLBACK);
+    if (IS_ERR(ctx->fallback)) {
+        return PTR_ERR(ctx->fallback);
+    }
+
+    /* export and import hand the state of the fallback through, it has to
+     * fit the size we advertise. */
+    if (crypto_ahash_statesize(ctx->fallback) != crypto_ahash_statesize(ahash)) {
+        __pr_err("Fallback %s has a state of %u bytes\n",
+                 crypto_ahash_driver_name(ctx->fallback),
+                 crypto_ahash_statesize(ctx->fallback));
+        crypto_free_ahash(ctx->fallback);
+        return -EINVAL;
+    }
+
+    crypto_ahash_set_reqsize_dma(ahash, sizeof(struct c_pci_hash_reqctx) +
+                                        crypto_ahash_reqsize(ctx->fallback));
+
+    return 0;
+}
+
+static void _sha256_cra_exit(struct crypto_tfm *tfm)
+{
+    struct c_pci_hash_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    crypto_free_ahash(ctx->fallback);
+}
+
+static struct ahash_alg _sha256_alg = {
+    .init = _sha256_init,
+    .update = _sha256_update,
+    .final = _sha256_final,
+    .finup = _sha256_finup,
+    .digest = _sha256_digest,
+    .export = _sha256_export,
+    .import = _sha256_import,
+    .halg = {
+        .digestsize = SHA256_DIGEST_SIZE,
+        .statesize = sizeof(struct sha256_state),
+        .base = {
+            .cra_name = "sha256",
+            .cra_driver_name = "sha256-" DEVICE_NAME,
+            .cra_priority = HASH_PRIORITY,
+            .cra_flags = CRYPTO_ALG_ASYNC |
+                         CRYPTO_ALG_NEED_FALLBACK |
+                         CRYPTO_ALG_KERN_DRIVER_ONLY,
+            .cra_blocksize = SHA256_BLOCK_SIZE,
+            .cra_ctxsize = sizeof(struct c_pci_hash_ctx),
+            .cra_init = _sha256_cra_init,
+            .cra_exit = _sha256_cra_exit,
+            .cra_module = THIS_MODULE,
+        },
+    },
+};
+
+static int _open(struct inode *inode, struct file *f);
+static int _release(struct inode *inode, struct file *f);
+static ssize_t _read(struct file *f, char __user *p, size_t size, loff_t *offset);
+static ssize_t _write(struct file *f, const char __user *p, size_t size, loff_t *offset);
+static long _unlocked_ioctl(struct file *f, unsigned int cmd, unsigned long arg);
+
+/* Defined with the LZ4 callbacks, after the DMA helpers they use. */
+static struct acomp_alg _lz4_alg;
+
+static struct file_operations f_ops = {
+    .read = _read,
+    .write = _write,
+    .open = _open,
+    .release = _release,
+    .mmap = _mmap,
+    .unlocked_ioctl = _unlocked_ioctl,
+};
+
+static int _probe(struct pci_dev *dev, const struct pci_device_id *id)
+{
+    int res = 0;
+    void __iomem *bar_0_ptr = NULL;
+    struct c_pci_dev *_dev = NULL;
+    unsigned int i;
+    __le32 seq, val;
+
+    /* 1. Enable PCI device. */
+    res = pcim_enable_device(dev);
+    if (res < 0) {
+        pr_err("%s(): Failed to enable PCI device.\n", __FUNCTION__);
+        goto exit;
+    }
+
+    _dev = devm_kzalloc(&dev->dev, sizeof(*_dev), GFP_KERNEL);
+    if (_dev == NULL) {
+        res = -ENOMEM;
+        goto exit;
+    }
+    _dev->_dev = dev;
+    pci_set_drvdata(dev, _dev);
+
+    pci_set_master(dev);
+
+    /* Descriptors, queues and all address registers are 64 bit, buffers
+     * anywhere in memory are reached without bouncing. */
+    res = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64));
+    if (res < 0) {
+        pr_err("%s(): No usable DMA configuration.\n", __FUNCTION__);
+        goto exit;
+    }
+
+    /* Map device's memory regions. */
+    bar_0_ptr = pcim_iomap(dev, C_PCI_MMIO_BAR, pci_resource_len(dev, C_PCI_MMIO_BAR));
+    if (bar_0_ptr == NULL)
+    {
+        pr_err("%s(): Failed to map mem region 0.\n", __FUNCTION__);
+        res = -ENODEV;
+        goto exit;
+    }
+
+    pr_info("%s(): Region 0 length: %d \n", __FUNCTION__, pci_resource_len(dev, 0));
+
+    _dev->bar_0_ptr = bar_0_ptr;
+
+    /* Device memory is reached through DMA and mmap(), the kernel does not
+     * need a mapping of it. */
+    if (pci_resource_len(dev, C_PCI_MEM_BAR) == 0)
+    {
+        pr_err("%s(): Missing mem region 1.\n", __FUNCTION__);
+        res = -ENODEV;
+        goto exit;
+    }
+
+    pr_info("%s(): Region 1 length: %llu \n", __FUNCTION__,
+            (u64)pci_resource_len(dev, C_PCI_MEM_BAR));
+
+    /* Peers reach device memory without a stop in system memory. The
+     * memory is not published, it stays ours and only copies we start
+     * target it. Without p2pdma copies between devices bounce. */
+    res = pci_p2pdma_add_resource(dev, C_PCI_MEM_BAR, 0, 0);
+    if (res < 0) {
+        pr_info("%s(): Region 1 is no p2pdma provider: %d\n", __FUNCTION__, res);
+        res = 0;
+    } else {
+        _dev->_p2p = true;
+    }
+
+    _dev->bar_3_ptr = pcim_iomap(dev, C_PCI_DMA_BAR, pci_resource_len(dev, C_PCI_DMA_BAR));
+    if ( _dev->bar_3_ptr == NULL)
+    {
+        pr_err("%s(): Failed to map mem region 3.\n", __FUNCTION__);
+        res = -ENODEV;
+        goto exit;
+    }
+
+    pr_info("%s(): Region 3 length: %d \n", __FUNCTION__, pci_resource_len(dev, C_PCI_DMA_BAR));
+
+    /* Submission BAR, write combined: stores to it are merged into bursts.
+     * Older devices have none, queue pairs then use the doorbell. */
+    if (pci_resource_len(dev, C_PCI_PUSH_BAR) >= QP_MAX * QP_PUSH_STRIDE &&
+        (pci_resource_flags(dev, C_PCI_PUSH_BAR) & IORESOURCE_PREFETCH)) {
+        _dev->bar_5_ptr = devm_ioremap_wc(&dev->dev,
+                                          pci_resource_start(dev, C_PCI_PUSH_BAR),
+                                          pci_resource_len(dev, C_PCI_PUSH_BAR));
+        if (_dev->bar_5_ptr == NULL) {
+            pr_info("%s(): Failed to map region 5, using doorbells.\n", __FUNCTION__);
+        }
+    }
+
+    /* 2. Set up DMA channels, their rings and completion interrupts. */
+    _dev->_nr_chans = min_t(u32, ioread32(bar_0_ptr + REG_DMA_CHANNELS),
+                           pci_resource_len(dev, C_PCI_DMA_BAR) / DMA_CHAN_STRIDE);
+    _dev->_nr_chans = clamp_t(u32, _dev->_nr_chans, 1, DMA_MAX_CHANNELS);
+
+    for (i = 0; i < _dev->_nr_chans; i++) {
+        res = _dma_chan_init(_dev, i);
+        if (res < 0) {
+            pr_err("%s(): Failed to allocate DMA ring %u.\n", __FUNCTION__, i);
+            goto exit;
+        }
+    }
+
+    _dev->_cpu_chan = devm_kcalloc(&dev->dev,
+                                  nr_cpu_ids,
+                                  sizeof(*_dev->_cpu_chan),
+                                  GFP_KERNEL);
+    if (_dev->_cpu_chan == NULL) {
+        res = -ENOMEM;
+        goto exit;
+    }
+
+    /* Batch operands and results, the device reads and writes them by DMA. */
+    mutex_init(&_dev->_batch_lock);
+    init_completion(&_dev->_batch_done);
+    for (i = 0; i < ARRAY_SIZE(_dev->_batch_buf); i++) {
+        _dev->_batch_buf[i] = dmam_alloc_coherent(&dev->dev,
+                                                 C_PCI_BATCH_CHUNK * sizeof(u32),
+                                                 &_dev->_batch_dma[i],
+                                                 GFP_KERNEL);
+        if (_dev->_batch_buf[i] == NULL) {
+            res = -ENOMEM;
+            goto exit;
+        }
+    }
+
+    /* Queue pairs. */
+    INIT_DELAYED_WORK(&_dev->_qp_poll, _qp_poll_work);
+    _dev->_nr_qps = clamp_t(u32, ioread32(bar_0_ptr + REG_QUEUES), 1, QP_MAX);
+    for (i = 0; i < _dev->_nr_qps; i++) {
+        res = _qp_init(_dev, i);
+        if (res < 0) {
+            pr_err("%s(): Failed to allocate queue pair %u.\n", __FUNCTION__, i);
+            goto exit;
+        }
+    }
+
+    /* Status write-back, before interrupts so handlers may look at it. */
+    _dev->_wb = dmam_alloc_coherent(&dev->dev, PAGE_SIZE, &_dev->_wb_dma, GFP_KERNEL);
+    if (_dev->_wb == NULL) {
+        res = -ENOMEM;
+        goto exit;
+    }
+    lo_hi_writeq(_dev->_wb_dma | WB_ENABLE, bar_0_ptr + REG_WB_BASE);
+
+    /* No moderation until an administrator asks for it, see the
+     * irq_coalesce_* attributes. */
+    iowrite32(0, bar_0_ptr + REG_IRQ_MASK);
+    iowrite32(0, bar_0_ptr + REG_IRQ_COAL_COUNT);
+    iowrite32(0, bar_0_ptr + REG_IRQ_COAL_USEC);
+
+    res = _setup_irqs(_dev);
+    if (res < 0) {
+        pr_err("%s(): Failed to set up IRQs: %d\n", __FUNCTION__, res);
+        goto exit;
+    }
+
+    /* 3. Test math operators. The result comes back through the write-back
+     * page, no register read. */
+    seq = READ_ONCE(_dev->_wb->seq);
+    iowrite32((u32)1, bar_0_ptr + REG_OP1);
+    iowrite32((u32)2, bar_0_ptr + REG_OP2);
+    iowrite32((u32)OPCODE_ADD, bar_0_ptr + REG_OPCODE);
+
+    if (read_poll_timeout_atomic(READ_ONCE, val, val != seq, 1,
+                                 WB_POLL_TIMEOUT_US, false, _dev->_wb->seq)) {
+        __pr_err("No status write-back from the device.\n");
+    } else {
+        dma_rmb();
+        pr_info("%s(): Read result from write-back: %d\n",
+                __FUNCTION__,
+                le32_to_cpu(_dev->_wb->result));
+    }
+
+    /* 4. Expose our driver, on the first free minor. */
+    mutex_lock(&_devs_lock);
+    for (i = 0; i < C_PCI_MAX_DEVS; i++) {
+        if (_devs[i] == NULL) {
+            break;
+        }
+    }
+    if (i == C_PCI_MAX_DEVS) {
+        mutex_unlock(&_devs_lock);
+        pr_err("%s(): More than %d devices.\n", __FUNCTION__, C_PCI_MAX_DEVS);
+        res = -EBUSY;
+        goto free_irq;
+    }
+    _dev->_minor = i;
+    _devs[i] = _dev;
+    mutex_unlock(&_devs_lock);
+
+    /* Creates a device and registers it with sysfs.
+     * @class: pointer to the struct class that this device should be registered to.
+     * @parent: pointer to the parent struct device of this new device, if any.
+     * @devt: the dev_t for the char device to be added.
+     * @drvdata: the data to be added to the device for callbacks.
+     * @fmt: string for the device's name.
+     * @...: variable arguments.
+     */
+    if (_dev->_minor == 0) {
+        device_create(_cls, &dev->dev, MKDEV(_major, 0), _dev, DEVICE_NAME);
+    } else {
+        device_create(_cls, &dev->dev, MKDEV(_major, _dev->_minor), _dev,
+                      DEVICE_NAME "%u", _dev->_minor);
+    }
+
+    __pr_info("Device created, minor %u.\n", _dev->_minor);
+
+    _dev->_dma_ready = true;
+
+    /* 5. Offer the copy engine, LZ4 and the hash engine to the kernel, the
+     * first device serves them. A failure to register an algorithm is not
+     * fatal. */
+    mutex_lock(&_devs_lock);
+    if (_dma_dev == NULL) {
+        WRITE_ONCE(_dma_dev, _dev);
+        res = crypto_register_acomp(&_lz4_alg);
+        if (res < 0) {
+            __pr_err("Failed to register lz4: %d\n", res);
+        }
+        _dev->_lz4 = res == 0;
+    }
+    if (_hash_dev == NULL) {
+        _hash_dev = _dev;
+        res = crypto_register_ahash(&_sha256_alg);
+        if (res < 0) {
+            __pr_err("Failed to register sha256: %d\n", res);
+            _hash_dev = NULL;
+        }
+    }
+    mutex_unlock(&_devs_lock);
+
+    return 0;
+
+free_irq:
+    _free_irqs(_dev, _dev->_nr_chans);
+exit:
+    return res;
+}
+
+static void _remove(struct pci_dev *dev)
+{
+    struct c_pci_dev *_dev = pci_get_drvdata(dev);
+
+    __pr_info("invoked.\n");
+
+    mutex_lock(&_devs_lock);
+    _dev->_dma_ready = false;
+    if (_dma_dev == _dev) {
+        if (_dev->_lz4) {
+            crypto_unregister_acomp(&_lz4_alg);
+        }
+        WRITE_ONCE(_dma_dev, NULL);
+    }
+    if (_hash_dev == _dev) {
+        crypto_unregister_ahash(&_sha256_alg);
+        _hash_dev = NULL;
+    }
+    _devs[_dev->_minor] = NULL;
+    mutex_unlock(&_devs_lock);
+
+    device_destroy(_cls, MKDEV(_major, _dev->_minor));
+    _free_irqs(_dev, _dev->_nr_chans);
+    cancel_delayed_work_sync(&_dev->_qp_poll);
+
+    /* The page goes with the device resources, stop the device writing it. */
+    lo_hi_writeq(0, _dev->bar_0_ptr + REG_WB_BASE);
+}
+
+/**
+ * Interrupt moderation tunables, in the sysfs directory of the PCI device:
+ * irq_coalesce_count: completions per interrupt, 0 or 1 for one each.
+ * irq_coalesce_usecs: longest a completion waits for its interrupt, 0 for no
+ *      moderation.
+ * Higher values trade latency for fewer interrupts at high completion rates.
+ */
+static ssize_t irq_coalesce_count_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", ioread32(_dev->bar_0_ptr + REG_IRQ_COAL_COUNT));
+}
+
+static ssize_t irq_coalesce_count_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+    u32 val;
+    int res = kstrtou32(buf, 0, &val);
+
+    if (res < 0) {
+        return res;
+    }
+
+    iowrite32(val, _dev->bar_0_ptr + REG_IRQ_COAL_COUNT);
+    return count;
+}
+static DEVICE_ATTR_RW(irq_coalesce_count);
+
+static ssize_t irq_coalesce_usecs_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%u\n", ioread32(_dev->bar_0_ptr + REG_IRQ_COAL_USEC));
+}
+
+static ssize_t irq_coalesce_usecs_store(struct device *dev,
+                                        struct device_attribute *attr,
+                                        const char *buf, size_t count)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+    u32 val;
+    int res = kstrtou32(buf, 0, &val);
+
+    if (res < 0) {
+        return res;
+    }
+
+    if (val > IRQ_COAL_MAX_USEC) {
+        return -EINVAL;
+    }
+
+    iowrite32(val, _dev->bar_0_ptr + REG_IRQ_COAL_USEC);
+    return count;
+}
+static DEVICE_ATTR_RW(irq_coalesce_usecs);
+
+/**
+ * dma_latency: DMA_LAT_* histograms of all channels, one line per bucket with
+ * requests: the lower bound in ns and the count of every stage. Writing 1
+ * clears them and starts recording, 0 stops recording.
+ */
+static ssize_t dma_latency_show(struct device *dev,
+                                struct device_attribute *attr,
+                                char *buf)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+    ssize_t len = sysfs_emit(buf, "%-12s %12s %12s %12s\n",
+                             "ns", "queue", "exec", "wake");
+    unsigned int b, i, s;
+
+    for (b = 0; b < DMA_LAT_BUCKETS; b++) {
+        u64 sum[DMA_LAT_NR] = { 0 };
+
+        for (i = 0; i < _dev->_nr_chans; i++) {
+            for (s = 0; s < DMA_LAT_NR; s++) {
+                sum[s] += READ_ONCE(_dev->_chans[i]._lat[s][b]);
+            }
+        }
+
+        if (!sum[DMA_LAT_QUEUE] && !sum[DMA_LAT_EXEC] && !sum[DMA_LAT_WAKE]) {
+            continue;
+        }
+
+        len += sysfs_emit_at(buf, len, "%-12llu %12llu %12llu %12llu\n",
+                             b ? 1ULL << b : 0ULL,
+                             sum[DMA_LAT_QUEUE],
+                             sum[DMA_LAT_EXEC],
+                             sum[DMA_LAT_WAKE]);
+    }
+
+    return len;
+}
+
+static ssize_t dma_latency_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    struct c_pci_dev *_dev = dev_get_drvdata(dev);
+    bool enable;
+    unsigned int i;
+    int res = kstrtobool(buf, &enable);
+
+    if (res < 0) {
+        return res;
+    }
+
+    if (enable) {
+        for (i = 0; i < _dev->_nr_chans; i++) {
+            struct c_pci_dma_chan *chan = &_dev->_chans[i];
+
+            mutex_lock(&chan->_lock);
+            memset(chan->_lat, 0, sizeof(chan->_lat));
+            mutex_unlock(&chan->_lock);
+        }
+    }
+
+    WRITE_ONCE(_dev->_dma_lat, enable);
+    return count;
+}
+static DEVICE_ATTR_RW(dma_latency);
+
+static struct attribute *_dev_attrs[] = {
+    &dev_attr_irq_coalesce_count.attr,
+    &dev_attr_irq_coalesce_usecs.attr,
+    &dev_attr_dma_latency.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(_dev);
+
+static struct pci_driver _driver = {
+    .name = TYPE_PCI_CUSTOM_DEVICE,
+    .probe = _probe,
+    .remove = _remove,
+    .id_table = dev_ids,
+    .dev_groups = _dev_groups,
+};
+
+/**
+ * @brief Queue one descriptor per scatterlist segment and ring the doorbell of
+ * @chan. Segments are chained, so the device handles them as a single request
+ * which lands contiguously at @address in device memory.
+ *
+ * @sgl: DMA mapped scatterlist.
+ * @nents: Number of mapped segments.
+ * @address: Offset in device memory.
+ * @dir: DMA_DIRECTION_TO_DEVICE or DMA_DIRECTION_FROM_DEVICE.
+ * @csum_type: DMA_CSUM_*, checksum of the whole chain.
+ */
+static int _dma_submit_sg(struct c_pci_dma_chan *chan,
+                          struct scatterlist *sgl,
+                          int nents,
+                          dma_addr_t address,
+                          uint8_t dir,
+                          u32 csum_type)
+{
+    struct scatterlist *sg;
+    int i;
+
+    if (chan->_dead) {
+        return -EIO;
+    }
+
+    if (nents >= DMA_RING_ENTRIES) {
+        __pr_err("Too many segments: %d\n", nents);
+        return -EINVAL;
+    }
+
+    for_each_sg(sgl, sg, nents, i) {
+        struct dma_desc *desc = &chan->_ring[chan->_ring_tail];
+        u32 flags = (dir << 1) | (csum_type << DMA_CSUM_SHIFT);
+
+        if (dir == DMA_DIRECTION_FROM_DEVICE) {
+            /* We read from the device, so dest will be our memory buffer.
+             * Source data will be device address. */
+            desc->src = cpu_to_le64(address);
+            desc->dst = cpu_to_le64(sg_dma_address(sg));
+        } else {
+            desc->src = cpu_to_le64(sg_dma_address(sg));
+            desc->dst = cpu_to_le64(address);
+        }
+
+        if (i < nents - 1) {
+            flags |= DMA_DESC_F_CHAIN;
+        }
+
+        desc->len = cpu_to_le32(sg_dma_len(sg));
+        desc->flags = cpu_to_le32(flags);
+        desc->status = 0;
+        desc->csum = 0;
+
+        address += sg_dma_len(sg);
+        chan->_ring_tail = (chan->_ring_tail + 1) % DMA_RING_ENTRIES;
+    }
+
+    /* iowrite32() orders the descriptor stores above before the doorbell, one
+     * MMIO write starts the whole chain. */
+    iowrite32(chan->_ring_tail, chan->_regs + DMA_REG_RING_TAIL);
+
+    return 0;
+}
+
+/**
+ * @brief Sleep until the interrupt handler reports the request of @chan done.
+ * Called with the channel lock held. On -ETIMEDOUT the channel is dead and
+ * the caller must leave the buffers of the request mapped and allocated.
+ */
+static int _dma_wait(struct c_pci_dma_chan *chan)
+{
+    long timeout = wait_for_completion_timeout(&chan->_done,
+                                               msecs_to_jiffies(DMA_TIMEOUT_MS));
+
+    if (timeout == 0) {
+        __pr_err("DMA timed out on channel %u, disabling it\n", chan->_index);
+        chan->_dead = true;
+        return -ETIMEDOUT;
+    }
+
+    if (chan->_status & DMA_STS_ERROR) {
+        __pr_err("DMA failed on channel %u, status 0x%x\n",
+                 chan->_index, chan->_status);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void _dma_lat_add(u64 *hist, u64 start, u64 end)
+{
+    s64 ns = end - start;
+
+    hist[ns > 0 ? min_t(u32, ilog2((u64)ns), DMA_LAT_BUCKETS - 1) : 0]++;
+}
+
+/**
+ * @brief Account the request which just completed on @chan, its @nents
+ * descriptors end at the ring tail. Called with the channel lock held.
+ */
+static void _dma_lat_record(struct c_pci_dma_chan *chan, unsigned int nents)
+{
+    struct dma_desc *first, *last;
+    u64 now;
+
+    if (!READ_ONCE(chan->_owner->_dma_lat)) {
+        return;
+    }
+
+    now = readq(chan->_owner->bar_0_ptr + REG_TIMESTAMP);
+    first = &chan->_ring[(chan->_ring_tail + DMA_RING_ENTRIES - nents) %
+                         DMA_RING_ENTRIES];
+    last = &chan->_ring[(chan->_ring_tail + DMA_RING_ENTRIES - 1) %
+                        DMA_RING_ENTRIES];
+
+    _dma_lat_add(chan->_lat[DMA_LAT_QUEUE],
+                 le64_to_cpu(first->ts_submit),
+                 le64_to_cpu(first->ts_start));
+    _dma_lat_add(chan->_lat[DMA_LAT_EXEC],
+                 le64_to_cpu(first->ts_start),
+                 le64_to_cpu(last->ts_complete));
+    _dma_lat_add(chan->_lat[DMA_LAT_WAKE],
+                 le64_to_cpu(last->ts_complete),
+                 now);
+}
+
+/**
+ * @brief Move @len bytes between @buffer and @address in device memory and
+ * wait for the device.
+ *
+ * @csum_type: DMA_CSUM_*, the device checksums the bytes during the copy.
+ * @csum: receives the checksum, may be NULL with DMA_CSUM_NONE.
+ */
+static int _dma_transfer(struct c_pci_dev* _dev,
+                         void *buffer,
+                         int len,
+                         dma_addr_t address,
+                         uint8_t dir,
+                         u32 csum_type,
+                         u32 *csum)
+{
+    struct c_pci_dma_chan *chan = NULL;
+    struct scatterlist sg;
+    enum dma_data_direction dma_dir;
+    int nents = 0;
+    int res = 0;
+
+    __pr_info("invoked.\n");
+
+    if (dir == DMA_DIRECTION_FROM_DEVICE) {
+        dma_dir = DMA_FROM_DEVICE;
+    } else if (dir == DMA_DIRECTION_TO_DEVICE) {
+        dma_dir = DMA_TO_DEVICE;
+    } else {
+        __pr_err("Invalid DIR\n");
+        return -EINVAL;
+    }
+
+    /* Map virtual memory `buffer` to the DMA device. */
+    sg_init_one(&sg, buffer, len);
+    nents = dma_map_sg(&_dev->_dev->dev, &sg, 1, dma_dir);
+    if (nents == 0) {
+        __pr_err("Failed to map buffer\n");
+        return -ENOMEM;
+    }
+
+    /* Submit on the channel of the current CPU. If we get migrated after the
+     * lookup we only share a channel with another CPU for one request, the
+     * channel lock keeps our completion paired with our doorbell. */
+    chan = _dev->_cpu_chan[raw_smp_processor_id()];
+    mutex_lock(&chan->_lock);
+    reinit_completion(&chan->_done);
+
+    res = _dma_submit_sg(chan, &sg, nents, address, dir, csum_type);
+    if (res) {
+        goto unlock;
+    }
+
+    res = _dma_wait(chan);
+    if (res == 0) {
+        _dma_lat_record(chan, nents);
+    }
+    if (res == 0 && csum_type != DMA_CSUM_NONE) {
+        /* The device wrote the checksum to the last descriptor. */
+        *csum = le32_to_cpu(chan->_ring[(chan->_ring_tail + DMA_RING_ENTRIES - 1) %
+                                        DMA_RING_ENTRIES].csum);
+    }
+
+unlock:
+    mutex_unlock(&chan->_lock);
+    if (res != -ETIMEDOUT) {
+        dma_unmap_sg(&_dev->_dev->dev, &sg, 1, dma_dir);
+    }
+    return res;
+}
+
+/**
+ * @brief Run one copy engine operation (DMA_OP_*) and wait for it. Requests
+ * longer than DMA_DESC_MAX_LEN are split into a chain of descriptors. Copies
+ * advance @src with @dst, fills keep the pattern in @src.
+ *
+ * @dir: DMA_DIRECTION_*, only used by DMA_OP_XFER.
+ */
+static int _dma_run_op(struct c_pci_dev *_dev, u32 op, u32 dir,
+                       u64 src, u64 dst, size_t len)
+{
+    struct c_pci_dma_chan *chan = NULL;
+    bool fill = op == DMA_OP_FILL || op == DMA_OP_DEV_FILL;
+    size_t nents = DIV_ROUND_UP(len, DMA_DESC_MAX_LEN);
+    size_t i;
+    int res = 0;
+
+    if (_dev == NULL || !_dev->_dma_ready) {
+        return -ENODEV;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (nents >= DMA_RING_ENTRIES) {
+        return -EINVAL;
+    }
+
+    chan = _dev->_cpu_chan[raw_smp_processor_id()];
+    mutex_lock(&chan->_lock);
+    if (chan->_dead) {
+        mutex_unlock(&chan->_lock);
+        return -EIO;
+    }
+    reinit_completion(&chan->_done);
+
+    for (i = 0; i < nents; i++) {
+        struct dma_desc *desc = &chan->_ring[chan->_ring_tail];
+        u32 n = min_t(size_t, len, DMA_DESC_MAX_LEN);
+        u32 flags = (op << DMA_OP_SHIFT) | (dir << 1);
+
+        if (i < nents - 1) {
+            flags |= DMA_DESC_F_CHAIN;
+        }
+
+        desc->src = cpu_to_le64(src);
+        desc->dst = cpu_to_le64(dst);
+        desc->len = cpu_to_le32(n);
+        desc->flags = cpu_to_le32(flags);
+        desc->status = 0;
+        desc->csum = 0;
+
+        if (!fill) {
+            src += n;
+        }
+        dst += n;
+        len -= n;
+        chan->_ring_tail = (chan->_ring_tail + 1) % DMA_RING_ENTRIES;
+    }
+
+    iowrite32(chan->_ring_tail, chan->_regs + DMA_REG_RING_TAIL);
+
+    res = _dma_wait(chan);
+    if (res == 0) {
+        _dma_lat_record(chan, nents);
+    }
+    mutex_unlock(&chan->_lock);
+    return res;
+}
+
+/**
+ * @brief Device to map buffers for the functions below, NULL without one.
+ */
+struct device *c_pci_dma_device(void)
+{
+    struct c_pci_dev *_dev = READ_ONCE(_dma_dev);
+
+    return _dev ? &_dev->_dev->dev : NULL;
+}
+EXPORT_SYMBOL_GPL(c_pci_dma_device);
+
+/**
+ * @brief Copy @len bytes between two DMA mapped buffers, they must not
+ * overlap.
+ */
+int c_pci_dma_memcpy(dma_addr_t dst, dma_addr_t src, size_t len)
+{
+    return _dma_run_op(READ_ONCE(_dma_dev), DMA_OP_COPY, 0, src, dst, len);
+}
+EXPORT_SYMBOL_GPL(c_pci_dma_memcpy);
+
+/**
+ * @brief Fill @len bytes of a DMA mapped buffer with the little endian
+ * @pattern, repeated from @dst on.
+ */
+int c_pci_dma_fill(dma_addr_t dst, u64 pattern, size_t len)
+{
+    return _dma_run_op(READ_ONCE(_dma_dev), DMA_OP_FILL, 0, pattern, dst, len);
+}
+EXPORT_SYMBOL_GPL(c_pci_dma_fill);
+
+/**
+ * @brief Copy @len bytes inside device memory, the ranges may overlap.
+ */
+int c_pci_mem_copy(u64 dst, u64 src, size_t len)
+{
+    return _dma_run_op(READ_ONCE(_dma_dev), DMA_OP_DEV_COPY, 0, src, dst, len);
+}
+EXPORT_SYMBOL_GPL(c_pci_mem_copy);
+
+int c_pci_mem_fill(u64 dst, u64 pattern, size_t len)
+{
+    return _dma_run_op(READ_ONCE(_dma_dev), DMA_OP_DEV_FILL, 0, pattern, dst, len);
+}
+EXPORT_SYMBOL_GPL(c_pci_mem_fill);
+
+int c_pci_copy_page(struct page *dst, struct page *src)
+{
+    struct device *dev = c_pci_dma_device();
+    dma_addr_t dst_dma, src_dma;
+    int res = 0;
+
+    if (dev == NULL) {
+        return -ENODEV;
+    }
+
+    src_dma = dma_map_page(dev, src, 0, PAGE_SIZE, DMA_TO_DEVICE);
+    if (dma_mapping_error(dev, src_dma)) {
+        return -ENOMEM;
+    }
+
+    dst_dma = dma_map_page(dev, dst, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+    if (dma_mapping_error(dev, dst_dma)) {
+        res = -ENOMEM;
+        goto unmap_src;
+    }
+
+    res = c_pci_dma_memcpy(dst_dma, src_dma, PAGE_SIZE);
+    if (res == -ETIMEDOUT) {
+        return res;
+    }
+
+    dma_unmap_page(dev, dst_dma, PAGE_SIZE, DMA_FROM_DEVICE);
+unmap_src:
+    dma_unmap_page(dev, src_dma, PAGE_SIZE, DMA_TO_DEVICE);
+    return res;
+}
+EXPORT_SYMBOL_GPL(c_pci_copy_page);
+
+int c_pci_clear_page(struct page *page)
+{
+    struct device *dev = c_pci_dma_device();
+    dma_addr_t page_dma;
+    int res = 0;
+
+    if (dev == NULL) {
+        return -ENODEV;
+    }
+
+    page_dma = dma_map_page(dev, page, 0, PAGE_SIZE, DMA_FROM_DEVICE);
+    if (dma_mapping_error(dev, page_dma)) {
+        return -ENOMEM;
+    }
+
+    res = c_pci_dma_fill(page_dma, 0, PAGE_SIZE);
+    if (res == -ETIMEDOUT) {
+        return res;
+    }
+
+    dma_unmap_page(dev, page_dma, PAGE_SIZE, DMA_FROM_DEVICE);
+    return res;
+}
+EXPORT_SYMBOL_GPL(c_pci_clear_page);
+
+/**
+ * LZ4 acomp. Requests of one segment each way (zswap: a page in, a buffer
+ * out) run on the copy engine of `_dma_dev`, the output is compatible with
+ * the CPU "lz4". Other requests, and requests the device fails, go to the CPU
+ * implementation. The engine sleeps, callers which may not sleep get their
+ * request run from a work item.
+ */
+#define LZ4_MAX_LEN             SZ_4M
+#define LZ4_PRIORITY            300
+
+struct c_pci_lz4_ctx {
+    struct crypto_acomp *fallback;
+};
+
+struct c_pci_lz4_reqctx {
+    struct acomp_req *req;
+    struct work_struct work;
+    bool compress;
+};
+
+/**
+ * @brief Run one LZ4 descriptor and wait for it.
+ *
+ * @out_len: bytes written to @dst, 0 if a compress did not fit @dst_len.
+ */
+static int _dma_run_lz4(struct c_pci_dev *_dev, u32 op, u64 src, u64 dst,
+                        u32 len, u32 dst_len, u32 *out_len)
+{
+    struct c_pci_dma_chan *chan = NULL;
+    struct dma_desc *desc = NULL;
+    int res = 0;
+
+    if (_dev == NULL || !_dev->_dma_ready) {
+        return -ENODEV;
+    }
+
+    chan = _dev->_cpu_chan[raw_smp_processor_id()];
+    mutex_lock(&chan->_lock);
+    if (chan->_dead) {
+        mutex_unlock(&chan->_lock);
+        return -EIO;
+    }
+    reinit_completion(&chan->_done);
+
+    desc = &chan->_ring[chan->_ring_tail];
+    desc->src = cpu_to_le64(src);
+    desc->dst = cpu_to_le64(dst);
+    desc->len = cpu_to_le32(len);
+    desc->flags = cpu_to_le32(op << DMA_OP_SHIFT);
+    desc->status = 0;
+    desc->csum = 0;
+    desc->dst_len = cpu_to_le32(dst_len);
+    desc->out_len = 0;
+    chan->_ring_tail = (chan->_ring_tail + 1) % DMA_RING_ENTRIES;
+
+    iowrite32(chan->_ring_tail, chan->_regs + DMA_REG_RING_TAIL);
+
+    res = _dma_wait(chan);
+    if (res == 0) {
+        *out_len = le32_to_cpu(desc->out_len);
+        _dma_lat_record(chan, 1);
+    }
+    mutex_unlock(&chan->_lock);
+    return res;
+}
+
+static int _lz4_fallback(struct acomp_req *req, bool compress)
+{
+    struct c_pci_lz4_ctx *ctx = acomp_tfm_ctx(crypto_acomp_reqtfm(req));
+    struct acomp_req *fallback_req;
+    int res = 0;
+
+    fallback_req = acomp_request_alloc(ctx->fallback);
+    if (fallback_req == NULL) {
+        return -ENOMEM;
+    }
+
+    /* The CPU implementation is synchronous. */
+    acomp_request_set_callback(fallback_req, 0, NULL, NULL);
+    acomp_request_set_params(fallback_req, req->src, req->dst, req->slen, req->dlen);
+    res = compress ? crypto_acomp_compress(fallback_req) :
+                     crypto_acomp_decompress(fallback_req);
+    if (res == 0) {
+        req->dlen = fallback_req->dlen;
+    }
+
+    acomp_request_free(fallback_req);
+    return res;
+}
+
+static int _lz4_run(struct acomp_req *req, bool compress)
+{
+    struct c_pci_dev *_dev = READ_ONCE(_dma_dev);
+    struct device *dev = NULL;
+    u32 dst_len = min_t(u32, req->dlen, LZ4_MAX_LEN);
+    u32 out_len = 0;
+    int res = 0;
+
+    if (_dev == NULL || req->dst == NULL ||
+        req->slen == 0 || req->slen > LZ4_MAX_LEN ||
+        sg_nents_for_len(req->src, req->slen) != 1 ||
+        sg_nents_for_len(req->dst, dst_len) != 1) {
+        return _lz4_fallback(req, compress);
+    }
+
+    dev = &_dev->_dev->dev;
+    if (dma_map_sg(dev, req->src, 1, DMA_TO_DEVICE) != 1) {
+        return -ENOMEM;
+    }
+    if (dma_map_sg(dev, req->dst, 1, DMA_FROM_DEVICE) != 1) {
+        dma_unmap_sg(dev, req->src, 1, DMA_TO_DEVICE);
+        return -ENOMEM;
+    }
+
+    res = _dma_run_lz4(_dev,
+                       compress ? DMA_OP_COMPRESS : DMA_OP_DECOMPRESS,
+                       sg_dma_address(req->src),
+                       sg_dma_address(req->dst),
+                       req->slen,
+                       dst_len,
+                       &out_len);
+
+    /* The device may still write @dst, the CPU must not race it. */
+    if (res == -ETIMEDOUT) {
+        return res;
+    }
+
+    dma_unmap_sg(dev, req->dst, 1, DMA_FROM_DEVICE);
+    dma_unmap_sg(dev, req->src, 1, DMA_TO_DEVICE);
+
+    /* Data which does not compress is an answer, not a failure. */
+    if (res == 0 && compress && out_len == 0) {
+        return -ENOSPC;
+    }
+
+    /* A device without LZ4 or a corrupt block, the CPU gives the answer. */
+    if (res) {
+        return _lz4_fallback(req, compress);
+    }
+
+    req->dlen = out_len;
+    return 0;
+}
+
+static void _lz4_work(struct work_struct *work)
+{
+    struct c_pci_lz4_reqctx *rctx = container_of(work, struct c_pci_lz4_reqctx, work);
+    int err = _lz4_run(rctx->req, rctx->compress);
+
+    /* Crypto users expect completions with softirqs off. */
+    local_bh_disable();
+    acomp_request_complete(rctx->req, err);
+    local_bh_enable();
+}
+
+static int _lz4_submit(struct acomp_req *req, bool compress)
+{
+    struct c_pci_lz4_reqctx *rctx = acomp_request_ctx(req);
+
+    if (req->base.flags & CRYPTO_TFM_REQ_MAY_SLEEP) {
+        return _lz4_run(req, compress);
+    }
+
+    rctx->req = req;
+    rctx->compress = compress;
+    INIT_WORK(&rctx->work, _lz4_work);
+    queue_work(system_wq, &rctx->work);
+
+    return -EINPROGRESS;
+}
+
+static int _lz4_compress(struct acomp_req *req)
+{
+    return _lz4_submit(req, true);
+}
+
+static int _lz4_decompress(struct acomp_req *req)
+{
+    return _lz4_submit(req, false);
+}
+
+static int _lz4_init(struct crypto_acomp *tfm)
+{
+    struct c_pci_lz4_ctx *ctx = acomp_tfm_ctx(tfm);
+
+    ctx->fallback = crypto_alloc_acomp(crypto_tfm_alg_name(crypto_acomp_tfm(tfm)),
+                                       0, CRYPTO_ALG_NEED_FALLBACK);
+    if (IS_ERR(ctx->fallback)) {
+        return PTR_ERR(ctx->fallback);
+    }
+
+    return 0;
+}
+
+static void _lz4_exit(struct crypto_acomp *tfm)
+{
+    struct c_pci_lz4_ctx *ctx = acomp_tfm_ctx(tfm);
+
+    crypto_free_acomp(ctx->fallback);
+}
+
+static struct acomp_alg _lz4_alg = {
+    .compress = _lz4_compress,
+    .decompress = _lz4_decompress,
+    .init = _lz4_init,
+    .exit = _lz4_exit,
+    .reqsize = sizeof(struct c_pci_lz4_reqctx),
+    .base = {
+        .cra_name = "lz4",
+        .cra_driver_name = "lz4-" DEVICE_NAME,
+        .cra_priority = LZ4_PRIORITY,
+        .cra_flags = CRYPTO_ALG_ASYNC |
+                     CRYPTO_ALG_NEED_FALLBACK |
+                     CRYPTO_ALG_KERN_DRIVER_ONLY,
+        .cra_ctxsize = sizeof(struct c_pci_lz4_ctx),
+        .cra_module = THIS_MODULE,
+    },
+};
+
+/**
+ * @brief Run one batch of @count lanes from the batch buffers and wait for it.
+ * Batch completion is only signalled on MSI-X, without it we poll the status.
+ * A batch which times out keeps the unit busy, later batches fail with -EIO.
+ * Called with the batch lock held.
+ */
+static int _batch_run(struct c_pci_dev *_dev, u32 opcode, u32 count, u32 *status)
+{
+    void __iomem *regs = _dev->bar_0_ptr;
+    u32 sts = 0;
+    int res = 0;
+
+    if (_dev->_batch_dead) {
+        return -EIO;
+    }
+
+    reinit_completion(&_dev->_batch_done);
+
+    lo_hi_writeq(_dev->_batch_dma[0], regs + REG_BATCH_OP1);
+    lo_hi_writeq(_dev->_batch_dma[1], regs + REG_BATCH_OP2);
+    lo_hi_writeq(_dev->_batch_dma[2], regs + REG_BATCH_RES);
+    iowrite32(count, regs + REG_BATCH_COUNT);
+    iowrite32(opcode, regs + REG_BATCH_OPCODE);
+
+    if (_dev->_msix) {
+        if (!wait_for_completion_timeout(&_dev->_batch_done,
+                                         msecs_to_jiffies(C_PCI_BATCH_TIMEOUT_MS))) {
+            _dev->_batch_dead = true;
+            return -ETIMEDOUT;
+        }
+        sts = _dev->_batch_status;
+    } else {
+        /* Spin on the write-back page, not on the register. */
+        res = read_poll_timeout(le32_to_cpu, sts,
+                                sts & (BATCH_STS_DONE | BATCH_STS_ERROR),
+                                10,
+                                C_PCI_BATCH_TIMEOUT_MS * USEC_PER_MSEC,
+                                false,
+                                READ_ONCE(_dev->_wb->batch_status));
+        if (res) {
+            _dev->_batch_dead = true;
+            return res;
+        }
+        iowrite32(sts & (BATCH_STS_DONE | BATCH_STS_ERROR | BATCH_STS_DIV_ZERO),
+                  regs + REG_BATCH_STATUS);
+    }
+
+    *status = sts;
+
+    return (sts & BATCH_STS_ERROR) ? -EIO : 0;
+}
+
+/**
+ * @brief C_PCI_IOCTL_BATCH. The user arrays go through the batch buffers
+ * C_PCI_BATCH_CHUNK lanes at a time, so one call can carry millions of
+ * operations. Lanes are passed as is, the device expects little endian.
+ */
+static long _ioctl_batch(struct c_pci_dev *_dev, struct c_pci_batch __user *arg)
+{
+    struct c_pci_batch batch;
+    const u32 __user *op1 = NULL;
+    const u32 __user *op2 = NULL;
+    u32 __user *result = NULL;
+    u32 status = 0;
+    long res = 0;
+
+    if (copy_from_user(&batch, arg, sizeof(batch))) {
+        return -EFAULT;
+    }
+
+    if (batch.opcode > OPCODE_SUB) {
+        return -EINVAL;
+    }
+
+    op1 = u64_to_user_ptr(batch.op1);
+    op2 = u64_to_user_ptr(batch.op2);
+    result = u64_to_user_ptr(batch.result);
+    batch.flags = 0;
+    batch.done = 0;
+
+    mutex_lock(&_dev->_batch_lock);
+
+    while (batch.done < batch.count) {
+        u32 n = min_t(u32, batch.count - batch.done, C_PCI_BATCH_CHUNK);
+        size_t len = n * sizeof(u32);
+
+        if (copy_from_user(_dev->_batch_buf[0], op1 + batch.done, len) ||
+            copy_from_user(_dev->_batch_buf[1], op2 + batch.done, len)) {
+            res = -EFAULT;
+            break;
+        }
+
+        res = _batch_run(_dev, batch.opcode, n, &status);
+        if (res) {
+            __pr_err("Batch failed: %ld, status 0x%x\n", res, status);
+            break;
+        }
+
+        if (status & BATCH_STS_DIV_ZERO) {
+            batch.flags |= C_PCI_BATCH_F_DIV_ZERO;
+        }
+
+        if (copy_to_user(result + batch.done, _dev->_batch_buf[2], len)) {
+            res = -EFAULT;
+            break;
+        }
+
+        batch.done += n;
+    }
+
+    mutex_unlock(&_dev->_batch_lock);
+
+    if (copy_to_user(arg, &batch, sizeof(batch))) {
+        return -EFAULT;
+    }
+
+    return res;
+}
+
+/**
+ * @brief Copy device memory of @_dev to device memory of @peer, @_dev writes
+ * into BAR1 of @peer. The BAR pages are p2pdma pages, the DMA API picks the
+ * address @_dev reaches them at (bus address, or through the host bridge).
+ */
+static int _p2p_copy(struct c_pci_dev *_dev, struct c_pci_dev *peer,
+                     u64 src, u64 dst, u64 len)
+{
+    struct device *dev = &_dev->_dev->dev;
+    phys_addr_t phys = pci_resource_start(peer->_dev, C_PCI_MEM_BAR) + dst;
+    struct scatterlist sg;
+    int res = 0;
+
+    sg_init_table(&sg, 1);
+    sg_set_page(&sg, pfn_to_page(PHYS_PFN(phys)), len, offset_in_page(phys));
+
+    if (dma_map_sg(dev, &sg, 1, DMA_FROM_DEVICE) != 1) {
+        return -EIO;
+    }
+
+    res = _dma_run_op(_dev, DMA_OP_XFER, DMA_DIRECTION_FROM_DEVICE,
+                      src, sg_dma_address(&sg), len);
+    if (res == -ETIMEDOUT) {
+        return res;
+    }
+
+    dma_unmap_sg(dev, &sg, 1, DMA_FROM_DEVICE);
+    return res;
+}
+
+/**
+ * @brief Copy device memory of @_dev to device memory of @peer through a
+ * buffer in system memory, for peers p2pdma can not connect. Both devices
+ * DMA, the CPU does not copy.
+ */
+static int _p2p_bounce(struct c_pci_dev *_dev, struct c_pci_dev *peer,
+                       u64 src, u64 dst, u64 len)
+{
+    struct device *from = &_dev->_dev->dev;
+    struct device *to = &peer->_dev->dev;
+    unsigned int order = get_order(C_PCI_P2P_BOUNCE_SIZE);
+    dma_addr_t from_dma, to_dma;
+    struct page *page = NULL;
+    u64 done = 0;
+    int res = 0;
+
+    page = alloc_pages(GFP_KERNEL, order);
+    if (page == NULL) {
+        return -ENOMEM;
+    }
+
+    from_dma = dma_map_page(from, page, 0, C_PCI_P2P_BOUNCE_SIZE, DMA_FROM_DEVICE);
+    if (dma_mapping_error(from, from_dma)) {
+        res = -ENOMEM;
+        goto free;
+    }
+
+    to_dma = dma_map_page(to, page, 0, C_PCI_P2P_BOUNCE_SIZE, DMA_TO_DEVICE);
+    if (dma_mapping_error(to, to_dma)) {
+        res = -ENOMEM;
+        goto unmap_from;
+    }
+
+    while (done < len && res == 0) {
+        u64 n = min_t(u64, len - done, C_PCI_P2P_BOUNCE_SIZE);
+
+        res = _dma_run_op(_dev, DMA_OP_XFER, DMA_DIRECTION_FROM_DEVICE,
+                          src + done, from_dma, n);
+        if (res) {
+            break;
+        }
+
+        /* The buffer changes hands between the two mappings. */
+        dma_sync_single_for_cpu(from, from_dma, n, DMA_FROM_DEVICE);
+        dma_sync_single_for_device(to, to_dma, n, DMA_TO_DEVICE);
+
+        res = _dma_run_op(peer, DMA_OP_XFER, DMA_DIRECTION_TO_DEVICE,
+                          to_dma, dst + done, n);
+        done += n;
+    }
+
+    /* One of the devices may still access the buffer, leak it. */
+    if (res == -ETIMEDOUT) {
+        return res;
+    }
+
+    dma_unmap_page(to, to_dma, C_PCI_P2P_BOUNCE_SIZE, DMA_TO_DEVICE);
+unmap_from:
+    dma_unmap_page(from, from_dma, C_PCI_P2P_BOUNCE_SIZE, DMA_FROM_DEVICE);
+free:
+    __free_pages(page, order);
+    return res;
+}
+
+static long _ioctl_p2p_copy(struct c_pci_dev *_dev,
+                            struct c_pci_p2p_copy __user *arg)
+{
+    struct c_pci_p2p_copy copy;
+    struct c_pci_dev *peer = NULL;
+    struct fd peer_f;
+    long res = 0;
+
+    if (copy_from_user(&copy, arg, sizeof(copy))) {
+        return -EFAULT;
+    }
+
+    peer_f = fdget(copy.peer_fd);
+    if (peer_f.file == NULL) {
+        return -EBADF;
+    }
+
+    if (peer_f.file->f_op != &f_ops) {
+        res = -EINVAL;
+        goto put;
+    }
+    peer = ((struct c_pci_file *)peer_f.file->private_data)->dev;
+
+    if (copy.len == 0 ||
+        copy.len > pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) ||
+        copy.src > pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) - copy.len ||
+        copy.len > pci_resource_len(peer->_dev, C_PCI_MEM_BAR) ||
+        copy.dst > pci_resource_len(peer->_dev, C_PCI_MEM_BAR) - copy.len) {
+        res = -EINVAL;
+        goto put;
+    }
+
+    copy.flags = 0;
+    if (peer == _dev) {
+        res = _dma_run_op(_dev, DMA_OP_DEV_COPY, 0, copy.src, copy.dst, copy.len);
+    } else if (peer->_p2p &&
+               pci_p2pdma_distance(peer->_dev, &_dev->_dev->dev, false) >= 0) {
+        res = _p2p_copy(_dev, peer, copy.src, copy.dst, copy.len);
+    } else {
+        copy.flags |= C_PCI_P2P_F_BOUNCE;
+        res = _p2p_bounce(_dev, peer, copy.src, copy.dst, copy.len);
+    }
+
+    if (res == 0 && copy_to_user(arg, &copy, sizeof(copy))) {
+        res = -EFAULT;
+    }
+
+put:
+    fdput(peer_f);
+    return res;
+}
+
+/**
+ * @brief One C_PCI_IOCTL_SUBMIT chunk. Allocated as a whole, the commands
+ * point back at it through `priv` and are leaked together on a timeout.
+ */
+struct c_pci_submit_ctx {
+    atomic_t pending;
+    struct completion done;
+    struct c_pci_cmd cmds[C_PCI_SUBMIT_CHUNK];
+};
+
+static void _submit_cmd_done(struct c_pci_cmd *cmd)
+{
+    struct c_pci_submit_ctx *ctx = cmd->priv;
+
+    if (atomic_dec_and_test(&ctx->pending)) {
+        complete(&ctx->done);
+    }
+}
 
 /**
- * our CMD register:
- * Bit 0 is run DMA or not.
- * Bit 1 are DMA direction: to device or from device.
+ * @brief C_PCI_IOCTL_SUBMIT. Entries are queued C_PCI_SUBMIT_CHUNK at a time,
+ * the whole chunk is in flight at once and its completions are reaped in bulk.
  */
-#define DMA_CMD_RUN                 1
-#define DMA_DIRECTION_TO_DEVICE     0
-#define DMA_DIRECTION_FROM_DEVICE   1
+static long _ioctl_submit(struct c_pci_dev *_dev, struct c_pci_submit __user *arg)
+{
+    struct c_pci_submit submit;
+    const struct c_pci_sqe __user *sqes = NULL;
+    struct c_pci_cqe __user *cqes = NULL;
+    struct c_pci_submit_ctx *ctx = NULL;
+    struct c_pci_cmd *cmds = NULL;
+    long res = 0;
 
-#define DMA_GET_DIR(cmd) ((cmd & 0b10) >> 1)
+    if (copy_from_user(&submit, arg, sizeof(submit))) {
+        return -EFAULT;
+    }
 
-#define DEVICE_NAME TYPE_PCI_CUSTOM_DEVICE
+    sqes = u64_to_user_ptr(submit.sqes);
+    cqes = u64_to_user_ptr(submit.cqes);
+    submit.done = 0;
 
-#define __pr_info(fmt, arg...) pr_info("%s():" fmt, __FUNCTION__, ##arg)
-#define __pr_err(fmt, arg...) pr_err("%s():" fmt, __FUNCTION__, ##arg)
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (ctx == NULL) {
+        return -ENOMEM;
+    }
+    cmds = ctx->cmds;
 
+    while (submit.done < submit.count) {
+        unsigned int n = min_t(u32, submit.count - submit.done, C_PCI_SUBMIT_CHUNK);
+        unsigned int queued = 0;
+        unsigned int i;
 
-struct c_pci_dev {
-    struct pci_dev *_dev;
-    struct class *_cls;
-    void __iomem *bar_2_ptr;
-    int _major;
-} _dev;
+        for (i = 0; i < n; i++) {
+            if (copy_from_user(&cmds[i].sqe, &sqes[submit.done + i],
+                               sizeof(cmds[i].sqe))) {
+                res = -EFAULT;
+                goto out;
+            }
+            if (cmds[i].sqe.flags || cmds[i].sqe.opcode >= OPCODE_SHA256) {
+                res = -EINVAL;
+                goto out;
+            }
+            cmds[i].done = _submit_cmd_done;
+            cmds[i].priv = ctx;
+        }
 
-static struct pci_device_id dev_ids[] = {
-    {PCI_DEVICE(DEVICE_VENDOR_ID, DEVICE_DEVICE_ID)},
-    {}
-};
-MODULE_DEVICE_TABLE(pci, dev_ids);
+        /* The extra reference keeps `pending` above 0 until every command
+         * of the chunk is queued. */
+        atomic_set(&ctx->pending, 1);
+        init_completion(&ctx->done);
 
-static int _mmap(struct file *file, struct vm_area_struct *vma)
-{
-    int res = 0;
+        while (queued < n) {
+            unsigned int q = 0;
 
-    /* VM Area offset will point to first page of PCI DMA (physical addr).
-     * pci_resource_start() return start address od PCI BAR.
-     * We shift `PAGE_SHIFT` bits the address to right to get the page number.
-     **/
-    vma->vm_pgoff = pci_resource_start(_dev._dev, 0) >> PAGE_SHIFT;
+            atomic_add(n - queued, &ctx->pending);
+            q = _qp_submit(_dev, &cmds[queued], n - queued);
+            atomic_sub(n - queued - q, &ctx->pending);
 
-    /* We map user VMA to the BAR. */
-    res = io_remap_pfn_range(vma,
-                             vma->vm_start,
-                             vma->vm_pgoff,
-                             vma->vm_end - vma->vm_start,
-                             vma->vm_page_prot);
-    if (res) {
-        __pr_err("Failed to map PCI BAR 0 to user VMA: %d", res);
-        res = -res;
-        goto exit;
+            /* Queue pair full of other commands, let them drain. */
+            if (q == 0) {
+                usleep_range(10, 20);
+            }
+            queued += q;
+        }
+
+        if (!atomic_dec_and_test(&ctx->pending) &&
+            !wait_for_completion_timeout(&ctx->done,
+                                         msecs_to_jiffies(C_PCI_SUBMIT_TIMEOUT_MS))) {
+            /* The device still owns the commands and their late completions
+             * still count down `pending`, none of it can be freed. */
+            __pr_err("Queue pair timed out, leaking %u commands\n", n);
+            ctx = NULL;
+            res = -ETIMEDOUT;
+            goto out;
+        }
+
+        for (i = 0; i < n; i++) {
+            struct c_pci_cqe cqe = {
+                .result = cpu_to_le32(cmds[i].result),
+                .cid = cpu_to_le16(submit.done + i),
+                .status = cpu_to_le16(cmds[i].status),
+            };
+
+            if (copy_to_user(&cqes[submit.done + i], &cqe, sizeof(cqe))) {
+                res = -EFAULT;
+                goto out;
+            }
+        }
+
+        submit.done += n;
+    }
+
+out:
+    kfree(ctx);
+
+    if (copy_to_user(arg, &submit, sizeof(submit))) {
+        return -EFAULT;
     }
 
-exit:
     return res;
 }
 
-static int _open(struct inode *inode, struct file *f);
-static int _release(struct inode *inode, struct file *f);
-static ssize_t _read(struct file *f, char __user *p, size_t size, loff_t *offset);
-static ssize_t _write(struct file *f, const char __user *p, size_t size, loff_t *offset);
-
-static struct file_operations f_ops = {
-    .read = _read,
-    .write = _write,
-    .open = _open,
-    .release = _release,
-    .mmap = _mmap,
+/**
+ * @brief A queue pair command a thread waits for.
+ */
+struct c_pci_sync_cmd {
+    struct c_pci_cmd cmd;
+    struct completion done;
 };
 
-static int _probe(struct pci_dev *dev, const struct pci_device_id *id)
+static void _sync_cmd_done(struct c_pci_cmd *cmd)
 {
-    int res = 0;
-    void __iomem *bar_0_ptr = NULL;
-    void __iomem *bar_1_ptr = NULL;
+    struct c_pci_sync_cmd *sync = container_of(cmd, struct c_pci_sync_cmd, cmd);
 
-    /* 1. Enable PCI device. */
-    res = pcim_enable_device(dev);
-    if (res < 0) {
-        pr_err("%s(): Failed to enable PCI device.\n", __FUNCTION__);
-        goto exit;
+    complete(&sync->done);
+}
+
+/**
+ * @brief Run @sync on the queue pairs and wait for it.
+ *
+ * @return 0, -ETIMEDOUT (the device still owns @sync, it must be leaked),
+ * -EINVAL or -EIO on a CQE error status.
+ */
+static int _qp_run_sync(struct c_pci_dev *_dev, struct c_pci_sync_cmd *sync)
+{
+    sync->cmd.done = _sync_cmd_done;
+    init_completion(&sync->done);
+
+    /* Queue pair full of other commands, let them drain. */
+    while (_qp_submit(_dev, &sync->cmd, 1) == 0) {
+        usleep_range(10, 20);
     }
 
-    pci_set_master(dev);
+    if (!wait_for_completion_timeout(&sync->done,
+                                     msecs_to_jiffies(C_PCI_SUBMIT_TIMEOUT_MS))) {
+        __pr_err("Queue pair timed out, leaking opcode 0x%x\n",
+                 sync->cmd.sqe.opcode);
+        return -ETIMEDOUT;
+    }
 
-    /* Map device's memory regions. */
-    bar_0_ptr = pcim_iomap(dev, 0, pci_resource_len(dev, 0));
-    if (bar_0_ptr == NULL)
-    {
-        pr_err("%s(): Failed to map mem region 0.\n", __FUNCTION__);
-        res = -ENODEV;
-        goto exit;
+    switch (sync->cmd.status) {
+    case CQE_STS_SUCCESS:
+        return 0;
+    case CQE_STS_INVALID_FIELD:
+        return -EINVAL;
+    default:
+        return -EIO;
     }
+}
 
-    pr_info("%s(): Region 0 length: %d \n", __FUNCTION__, pci_resource_len(dev, 0));
+/**
+ * @brief C_PCI_IOCTL_PROG_LOAD. The instructions go through a batch buffer,
+ * the device fetches and verifies them.
+ */
+static long _ioctl_prog_load(struct c_pci_dev *_dev, struct c_pci_prog __user *arg)
+{
+    struct c_pci_sync_cmd *sync = NULL;
+    struct c_pci_prog prog;
+    long res = 0;
 
-    bar_1_ptr = pcim_iomap(dev, 1, pci_resource_len(dev, 1));
-    if (bar_1_ptr == NULL)
-    {
-        pr_err("%s(): Failed to map mem region 1.\n", __FUNCTION__);
-        res = -ENODEV;
-        goto exit;
+    if (copy_from_user(&prog, arg, sizeof(prog))) {
+        return -EFAULT;
     }
 
-    pr_info("%s(): Region 1 length: %d \n", __FUNCTION__, pci_resource_len(dev, 1));
+    if (prog.count == 0 || prog.count > C_PCI_PROG_MAX_INSNS ||
+        prog.slot >= C_PCI_PROG_SLOTS) {
+        return -EINVAL;
+    }
 
-    _dev.bar_2_ptr = pcim_iomap(dev, 2, pci_resource_len(dev, 2));
-    if ( _dev.bar_2_ptr == NULL)
-    {
-        pr_err("%s(): Failed to map mem region 2.\n", __FUNCTION__);
-        res = -ENODEV;
-        goto exit;
+    sync = kzalloc(sizeof(*sync), GFP_KERNEL);
+    if (sync == NULL) {
+        return -ENOMEM;
     }
 
-    pr_info("%s(): Region 2 length: %d \n", __FUNCTION__, pci_resource_len(dev, 2));
+    mutex_lock(&_dev->_batch_lock);
 
-    /* 3. Test math operators. */
-    iowrite32((u32)1, bar_0_ptr + REG_OP1);
-    iowrite32((u32)2, bar_0_ptr + REG_OP2);
-    iowrite32((u32)OPCODE_ADD, bar_0_ptr + REG_OPCODE);
+    if (_dev->_batch_dead) {
+        res = -EIO;
+        goto unlock;
+    }
 
-    mdelay(1);
+    if (copy_from_user(_dev->_batch_buf[1], u64_to_user_ptr(prog.insns),
+                       prog.count * sizeof(struct c_pci_insn))) {
+        res = -EFAULT;
+        goto unlock;
+    }
 
-    pr_info("%s(): Read result from BAR0: %d\n",
-            __FUNCTION__,
-            ioread32(bar_0_ptr + REG_RESULT));
+    sync->cmd.sqe.opcode = OPCODE_PROG_LOAD;
+    sync->cmd.sqe.op1 = cpu_to_le32(prog.slot);
+    sync->cmd.sqe.len = cpu_to_le32(prog.count);
+    sync->cmd.sqe.src = cpu_to_le64(_dev->_batch_dma[1]);
 
-    /* 4. Expose our driver. */
-    _dev._dev = dev;
-    _dev._major = register_chrdev(0, DEVICE_NAME, &f_ops);
-    if (_dev._major < 0)
-    { // Registration failed.
-        pr_alert("Registering char device failed with %d\n",  _dev._major);
-        res = _dev._major;
-        goto exit;
+    res = _qp_run_sync(_dev, sync);
+    if (res == -ETIMEDOUT) {
+        /* The device may still read the batch buffers. */
+        _dev->_batch_dead = true;
+        sync = NULL;
     }
 
-    /* Create a struct class structure.
-     * @owner: pointer to the module that is to `own` this struct class.
-     * @name: pointer to a string for the name of this class.
-     */
-     _dev._cls = class_create(DEVICE_NAME);
-    if (IS_ERR_OR_NULL(_dev._cls)) {
-        res = PTR_ERR(_dev._cls);
-        pr_err("%s(): Failed to create class: %d\n", __FUNCTION__, res);
-        goto release_dev;
+unlock:
+    mutex_unlock(&_dev->_batch_lock);
+    kfree(sync);
+
+    return res;
+}
+
+/**
+ * @brief C_PCI_IOCTL_PROG_RUN. The input goes through the batch buffers
+ * C_PCI_BATCH_CHUNK elements at a time, one command each. The accumulator of
+ * the reduction stays in the device memory the command points to, so every
+ * command after the first goes on from it.
+ */
+static long _ioctl_prog_run(struct c_pci_dev *_dev,
+                            struct c_pci_prog_run __user *arg)
+{
+    __le64 *acc = (__le64 *)_dev->_batch_buf[1];
+    struct c_pci_sync_cmd *sync = NULL;
+    const u32 __user *input = NULL;
+    u32 __user *output = NULL;
+    struct c_pci_prog_run run;
+    u32 done = 0;
+    long res = 0;
+
+    if (copy_from_user(&run, arg, sizeof(run))) {
+        return -EFAULT;
     }
 
-    /* Creates a device and registers it with sysfs.
-     * @class: pointer to the struct class that this device should be registered to.
-     * @parent: pointer to the parent struct device of this new device, if any.
-     * @devt: the dev_t for the char device to be added.
-     * @drvdata: the data to be added to the device for callbacks.
-     * @fmt: string for the device's name.
-     * @...: variable arguments.
-     */
-    device_create(_dev._cls, NULL, MKDEV(_dev._major, 0), NULL, DEVICE_NAME);
+    if (run.slot >= C_PCI_PROG_SLOTS) {
+        return -EINVAL;
+    }
 
-    __pr_info("Device created on /dev/%s.\n", DEVICE_NAME);
+    input = u64_to_user_ptr(run.input);
+    output = u64_to_user_ptr(run.output);
+    run.result = 0;
+    run.emitted = 0;
 
-    return 0;
+    sync = kzalloc(sizeof(*sync), GFP_KERNEL);
+    if (sync == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&_dev->_batch_lock);
+
+    if (_dev->_batch_dead) {
+        mutex_unlock(&_dev->_batch_lock);
+        kfree(sync);
+        return -EIO;
+    }
+
+    /* Programs without a reduction leave it alone. */
+    *acc = 0;
+
+    while (done < run.count) {
+        u32 n = min_t(u32, run.count - done, C_PCI_BATCH_CHUNK);
+        u32 emitted;
+
+        if (copy_from_user(_dev->_batch_buf[0], input + done, n * sizeof(u32))) {
+            res = -EFAULT;
+            break;
+        }
+
+        memset(&sync->cmd, 0, sizeof(sync->cmd));
+        sync->cmd.sqe.opcode = OPCODE_PROG_RUN;
+        sync->cmd.sqe.op1 = cpu_to_le32(run.slot);
+        sync->cmd.sqe.op2 = cpu_to_le32(done ? PROG_RUN_F_CONTINUE : 0);
+        sync->cmd.sqe.len = cpu_to_le32(n);
+        sync->cmd.sqe.src = cpu_to_le64(_dev->_batch_dma[0]);
+        sync->cmd.sqe.dst = cpu_to_le64(_dev->_batch_dma[2]);
+        sync->cmd.sqe.aux = cpu_to_le64(_dev->_batch_dma[1]);
+
+        res = _qp_run_sync(_dev, sync);
+        if (res) {
+            if (res == -ETIMEDOUT) {
+                _dev->_batch_dead = true;
+                sync = NULL;
+            }
+            break;
+        }
+
+        emitted = min(sync->cmd.result, n);
+        if (emitted && copy_to_user(output + run.emitted, _dev->_batch_buf[2],
+                                    emitted * sizeof(u32))) {
+            res = -EFAULT;
+            break;
+        }
+
+        run.emitted += emitted;
+        done += n;
+    }
+
+    run.result = le64_to_cpu(*acc);
+
+    mutex_unlock(&_dev->_batch_lock);
+    kfree(sync);
+
+    if (copy_to_user(arg, &run, sizeof(run))) {
+        return -EFAULT;
+    }
 
-release_dev:
-    unregister_chrdev(_dev._major, DEVICE_NAME);
-exit:
     return res;
 }
 
-static void _remove(struct pci_dev *dev)
+/**
+ * @brief Copy the @n matches of the last search command to @matches, their
+ * offsets are relative to @base.
+ */
+static int _search_copy(struct c_pci_dev *_dev,
+                        struct c_pci_search_match __user *matches,
+                        u64 base, u32 n)
 {
-    __pr_info("invoked.\n");
-    device_destroy(_dev._cls, MKDEV(_dev._major, 0));
-    class_destroy(_dev._cls);
-    unregister_chrdev(_dev._major, DEVICE_NAME);
-}
+    const struct c_pci_match *hits = (const struct c_pci_match *)_dev->_batch_buf[2];
+    struct c_pci_search_match out[32];
+    u32 i, j;
 
-static struct pci_driver _driver = {
-    .name = TYPE_PCI_CUSTOM_DEVICE,
-    .probe = _probe,
-    .remove = _remove,
-    .id_table = dev_ids
-};
+    for (i = 0; i < n; i += j) {
+        for (j = 0; j < ARRAY_SIZE(out) && i + j < n; j++) {
+            out[j].offset = base + le32_to_cpu(hits[i + j].offset);
+            out[j].pattern = le32_to_cpu(hits[i + j].pattern);
+            out[j].reserved = 0;
+        }
 
-static int _dma_transfer(struct c_pci_dev* _dev,
-                         void *buffer,
-                         int len,
-                         dma_addr_t address,
-                         uint8_t dir)
+        if (copy_to_user(&matches[i], out, j * sizeof(out[0]))) {
+            return -EFAULT;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief C_PCI_IOCTL_SEARCH. User buffers go through a batch buffer
+ * C_PCI_SEARCH_CHUNK bytes at a time, device memory is searched in place.
+ * While `matches` has more room than the match buffer, a command covers no
+ * more bytes than its matches can fill the match buffer with.
+ */
+static long _ioctl_search(struct c_pci_dev *_dev, struct c_pci_search __user *arg)
 {
-    __pr_info("invoked.\n");
+    struct c_pci_pattern *pats = (struct c_pci_pattern *)_dev->_batch_buf[1];
+    struct c_pci_search_match __user *matches = NULL;
+    struct c_pci_sync_cmd *sync = NULL;
+    const u8 __user *buf = NULL;
+    struct c_pci_search search;
+    bool devmem = false;
+    u32 stored = 0;
+    u32 maxlen = 0;
+    u64 done = 0;
+    long res = 0;
+    u32 i;
 
-    /* Map virtual memory `buffer` to the DMA device. */
-    dma_addr_t buffer_dma_addr = dma_map_single(&_dev->_dev->dev,
-                                                buffer,
-                                                len,
-                                                dir);
+    if (copy_from_user(&search, arg, sizeof(search))) {
+        return -EFAULT;
+    }
+
+    if (search.count == 0 || search.count > C_PCI_SEARCH_MAX_PATTERNS ||
+        (search.flags & ~C_PCI_SEARCH_F_DEVMEM)) {
+        return -EINVAL;
+    }
 
-    /* We configure DMA controller via registers first. */
-    iowrite32(len, _dev->bar_2_ptr + DMA_REG_LEN);
+    devmem = search.flags & C_PCI_SEARCH_F_DEVMEM;
+    if (devmem &&
+        (search.buf > pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) ||
+         search.len > pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) - search.buf)) {
+        return -EINVAL;
+    }
 
-    if (dir == DMA_DIRECTION_FROM_DEVICE) {
-        /* We read from the device, so dest will be our virtual memory buffer.
-         * Source data will be device address. In our case is offset from user.
-         */
+    buf = u64_to_user_ptr(search.buf);
+    matches = u64_to_user_ptr(search.matches);
+    search.found = 0;
 
-        iowrite32(buffer_dma_addr, _dev->bar_2_ptr + DMA_REG_DST);
-        iowrite32(address, _dev->bar_2_ptr + DMA_REG_SRC);
-    } else if (dir == DMA_DIRECTION_TO_DEVICE) {
-        iowrite32(buffer_dma_addr, _dev->bar_2_ptr + DMA_REG_SRC);
-        iowrite32(address, _dev->bar_2_ptr + DMA_REG_DST);
-    } else {
-        __pr_err("Invalid DIR\n");
-        goto exit;
+    sync = kzalloc(sizeof(*sync), GFP_KERNEL);
+    if (sync == NULL) {
+        return -ENOMEM;
     }
 
-    /* We send run command let DMA controller read/write to the buffer. */
-    iowrite32(DMA_CMD_RUN | (dir << 1), _dev->bar_2_ptr + DMA_REG_CMD);
+    mutex_lock(&_dev->_batch_lock);
 
-exit:
-    dma_unmap_single(&_dev->_dev->dev, buffer_dma_addr, len, dir);
-    return 0;
+    if (_dev->_batch_dead) {
+        res = -EIO;
+        goto unlock;
+    }
+
+    if (copy_from_user(pats, u64_to_user_ptr(search.patterns),
+                       search.count * sizeof(*pats))) {
+        res = -EFAULT;
+        goto unlock;
+    }
+
+    for (i = 0; i < search.count; i++) {
+        if (pats[i].len == 0 || pats[i].len > C_PCI_SEARCH_MAX_LEN) {
+            res = -EINVAL;
+            goto unlock;
+        }
+        maxlen = max_t(u32, maxlen, pats[i].len);
+    }
+
+    while (done < search.len) {
+        u32 room = min_t(u32, search.room - stored, C_PCI_SEARCH_MATCHES);
+        u32 n = C_PCI_SEARCH_CHUNK;
+        u32 tail = 0;
+        u32 hits = 0;
+
+        /* Matches past `room` are dropped by the device, that only loses
+         * some when `matches` has more room than the match buffer. */
+        if (search.room - stored > C_PCI_SEARCH_MATCHES) {
+            n = C_PCI_SEARCH_MATCHES / search.count;
+        }
+        n = min_t(u64, n, search.len - done);
+        tail = min_t(u64, maxlen - 1, search.len - done - n);
+
+        if (!devmem && copy_from_user(_dev->_batch_buf[0], buf + done, n + tail)) {
+            res = -EFAULT;
+            break;
+        }
+
+        memset(&sync->cmd, 0, sizeof(sync->cmd));
+        sync->cmd.sqe.opcode = OPCODE_SEARCH;
+        sync->cmd.sqe.flags = devmem ? SQE_F_DEVMEM : 0;
+        sync->cmd.sqe.op1 = cpu_to_le32(search.count | tail << 16);
+        sync->cmd.sqe.op2 = cpu_to_le32(room);
+        sync->cmd.sqe.len = cpu_to_le32(n);
+        sync->cmd.sqe.src = cpu_to_le64(devmem ? search.buf + done : _dev->_batch_dma[0]);
+        sync->cmd.sqe.dst = cpu_to_le64(_dev->_batch_dma[2]);
+        sync->cmd.sqe.aux = cpu_to_le64(_dev->_batch_dma[1]);
+
+        res = _qp_run_sync(_dev, sync);
+        if (res) {
+            if (res == -ETIMEDOUT) {
+                _dev->_batch_dead = true;
+                sync = NULL;
+            }
+            break;
+        }
+
+        hits = min(sync->cmd.result, room);
+        res = _search_copy(_dev, matches + stored, done, hits);
+        if (res) {
+            break;
+        }
+
+        stored += hits;
+        search.found += sync->cmd.result;
+        done += n;
+    }
+
+unlock:
+    mutex_unlock(&_dev->_batch_lock);
+    kfree(sync);
+
+    if (copy_to_user(arg, &search, sizeof(search))) {
+        return -EFAULT;
+    }
+
+    return res;
+}
+
+static long _unlocked_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+    struct c_pci_file *file = f->private_data;
+
+    switch (cmd) {
+    case C_PCI_IOCTL_BATCH:
+        return _ioctl_batch(file->dev, (struct c_pci_batch __user *)arg);
+    case C_PCI_IOCTL_SUBMIT:
+        return _ioctl_submit(file->dev, (struct c_pci_submit __user *)arg);
+    case C_PCI_IOCTL_P2P_COPY:
+        return _ioctl_p2p_copy(file->dev, (struct c_pci_p2p_copy __user *)arg);
+    case C_PCI_IOCTL_PROG_LOAD:
+        return _ioctl_prog_load(file->dev, (struct c_pci_prog __user *)arg);
+    case C_PCI_IOCTL_PROG_RUN:
+        return _ioctl_prog_run(file->dev, (struct c_pci_prog_run __user *)arg);
+    case C_PCI_IOCTL_SEARCH:
+        return _ioctl_search(file->dev, (struct c_pci_search __user *)arg);
+    case C_PCI_IOCTL_SET_CSUM:
+        if (arg > DMA_CSUM_CRC32) {
+            return -EINVAL;
+        }
+        file->csum_type = arg;
+        return 0;
+    case C_PCI_IOCTL_GET_CSUM:
+        return put_user(file->csum, (u32 __user *)arg);
+    default:
+        return -ENOTTY;
+    }
 }
 
 static int _open(struct inode *inode, struct file *f)
 {
+    struct c_pci_file *file = NULL;
+    unsigned int minor = iminor(inode);
+
     __pr_info("invoked.\n");
 
+    file = kzalloc(sizeof(struct c_pci_file), GFP_KERNEL);
+    if (file == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&_devs_lock);
+    file->dev = minor < C_PCI_MAX_DEVS ? _devs[minor] : NULL;
+    mutex_unlock(&_devs_lock);
+
+    if (file->dev == NULL) {
+        kfree(file);
+        return -ENODEV;
+    }
+
+    f->private_data = file;
     return 0;
 }
 
 static int _release(struct inode * inode, struct file *f)
 {
     __pr_info("invoked.\n");
+
+    kfree(f->private_data);
+    f->private_data = NULL;
+
     return 0;
 }
 
@@ -262,24 +3277,40 @@ static ssize_t _read(struct file *f, char __user *p, size_t size, loff_t *offset
 {
     __pr_info("invoked.\n");
 
+    struct c_pci_file *file = f->private_data;
+    struct c_pci_dev *_dev = file->dev;
     void *buf = NULL;
     int user_len = 0;
     int number_of_byte_not_transferred = 0;
-    if (size + *offset < pci_resource_len(_dev._dev, 1)) {
-        user_len = size;
-    } else {
-        user_len = pci_resource_len(_dev._dev, 1) - *offset;
+    int res = 0;
+
+    if (*offset >= pci_resource_len(_dev->_dev, C_PCI_MEM_BAR)) {
+        return 0;
     }
 
-    buf = kmalloc(user_len, GFP_ATOMIC);
+    if (size + *offset < pci_resource_len(_dev->_dev, C_PCI_MEM_BAR)) {
+        user_len = min_t(size_t, size, C_PCI_RW_MAX);
+    } else {
+        user_len = min_t(u64, pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) - *offset,
+                         C_PCI_RW_MAX);
+    }
 
-    /* We read from DMA to kernel buffer. */
-    _dma_transfer(&_dev, buf, user_len, *offset, DMA_DIRECTION_FROM_DEVICE);
+    buf = kmalloc(user_len, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
 
-    /* Wait a second for device do it's job. In real word, we can do something
-     * and receive DMA callback done. In our driver, we do some trick to wait
-     * the device done. */
-    mdelay(5);
+    /* We read from DMA to kernel buffer, this sleeps until the device raises
+     * the completion interrupt. */
+    res = _dma_transfer(_dev, buf, user_len, *offset, DMA_DIRECTION_FROM_DEVICE,
+                        file->csum_type, &file->csum);
+    if (res) {
+        /* On a timeout the device may still write the buffer, leak it. */
+        if (res != -ETIMEDOUT) {
+            kfree(buf);
+        }
+        return res;
+    }
 
     /* Copy from kernel buffer to user space. */
     number_of_byte_not_transferred = copy_to_user(p, buf, user_len);
@@ -294,30 +3325,91 @@ static ssize_t _write(struct file *f, const char __user *p, size_t size, loff_t
 {
     __pr_info("invoked.\n");
 
+    struct c_pci_file *file = f->private_data;
+    struct c_pci_dev *_dev = file->dev;
     void *buf = NULL;
     int user_len = 0;
     int number_of_byte_not_transferred = 0;
+    int res = 0;
+
+    if (*offset >= pci_resource_len(_dev->_dev, C_PCI_MEM_BAR)) {
+        return -ENOSPC;
+    }
 
-    if (size + *offset < pci_resource_len(_dev._dev, 1)) {
-        user_len = size;
+    if (size + *offset < pci_resource_len(_dev->_dev, C_PCI_MEM_BAR)) {
+        user_len = min_t(size_t, size, C_PCI_RW_MAX);
     } else {
-        user_len = pci_resource_len(_dev._dev, 1) - *offset;
+        user_len = min_t(u64, pci_resource_len(_dev->_dev, C_PCI_MEM_BAR) - *offset,
+                         C_PCI_RW_MAX);
     }
 
-    buf = kmalloc(user_len, GFP_ATOMIC);
+    buf = kmalloc(user_len, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
 
     number_of_byte_not_transferred = copy_from_user(buf, p, user_len);
     user_len -= number_of_byte_not_transferred;
 
     /* Start transfer data from kernel buffer to device memory. */
-    _dma_transfer(&_dev, buf, user_len, *offset, DMA_DIRECTION_TO_DEVICE);
+    res = _dma_transfer(_dev, buf, user_len, *offset, DMA_DIRECTION_TO_DEVICE,
+                        file->csum_type, &file->csum);
+    if (res == -ETIMEDOUT) {
+        /* The device may still read the buffer, leak it. */
+        return res;
+    }
 
-    mdelay(5);
     kfree(buf);
+    if (res) {
+        return res;
+    }
 
     *offset += user_len;
     return user_len;
 }
 
-module_pci_driver(_driver);
+static int __init _module_init(void)
+{
+    int res = 0;
+
+    _major = register_chrdev(0, DEVICE_NAME, &f_ops);
+    if (_major < 0)
+    { // Registration failed.
+        pr_alert("Registering char device failed with %d\n", _major);
+        return _major;
+    }
+
+    /* Create a struct class structure.
+     * @name: pointer to a string for the name of this class.
+     */
+    _cls = class_create(DEVICE_NAME);
+    if (IS_ERR(_cls)) {
+        res = PTR_ERR(_cls);
+        pr_err("%s(): Failed to create class: %d\n", __FUNCTION__, res);
+        goto release_dev;
+    }
+
+    res = pci_register_driver(&_driver);
+    if (res < 0) {
+        goto destroy_class;
+    }
+
+    return 0;
+
+destroy_class:
+    class_destroy(_cls);
+release_dev:
+    unregister_chrdev(_major, DEVICE_NAME);
+    return res;
+}
+
+static void __exit _module_exit(void)
+{
+    pci_unregister_driver(&_driver);
+    class_destroy(_cls);
+    unregister_chrdev(_major, DEVICE_NAME);
+}
+
+module_init(_module_init);
+module_exit(_module_exit);
 MODULE_LICENSE("GPL");
\ No newline at end of file